@@ -1,6 +1,19 @@
 #include "Dummy SDOCT.h"
+#include "OCT_Quantize.h"
+#include "OCT_Trace.h"
 
-SDOCT::SDOCT() : xrange(NULL), xsteps(NULL), yrange(NULL), ysteps(NULL)
+#include <stdlib.h>
+
+#include <boost/thread/thread.hpp>
+
+//A-scans per second emulated by captureVolScan. Matches the line rate of the real device
+const double DummyAScanRate = 5500.0;
+
+//Spectrometer behind the raw spectra: pixels per spectrum and bits per pixel, like the camera of the real device
+const uint32_t DummyCameraPixels = 2048;
+const uint32_t DummyCameraBitDepth = 12;
+
+SDOCT::SDOCT() : xrange(NULL), xsteps(NULL), yrange(NULL), ysteps(NULL), windowScale(1.0f), windowOffset(0.0f), voxelFormat(OCT_Voxel::UInt8), averaging(1), cropXStart(0), cropXCount(0), cropYStart(0), cropYCount(0), cropZStart(0), cropZCount(0)
 {
 	//Init OCT device
 	//Init();
@@ -37,10 +50,28 @@ void SDOCT::Init()
 	setXSteps(1);
 	setYSteps(4096);
 	setZSteps(1);
+
+	//Spectra get processed in here rather than made up as processed data when asked for, on a thread per core unless told otherwise
+	const char* processing = getenv("OCT_PROCESSING");
+	if (processing && std::string(processing) == "builtin" && !this->processor)
+	{
+		const char* threads = getenv("OCT_PROCESSING_THREADS");
+		const unsigned int numThreads = std::max(1u, threads ? (unsigned int)atoi(threads) : boost::thread::hardware_concurrency());
+		this->processor.reset(new OCT_Processor(numThreads));
+		std::cout << "		Processing synthetic spectra on " << numThreads << " threads\n";
+	}
+
+	InitDataHandler();
 }
 
 void SDOCT::Close()
 {
+	//Nothing may still be reading the raw buffers
+	if (this->processor)
+	{
+		this->processor->wait();
+	}
+	CleanDataHandler();
 	//closeProbe(this->probe);
 	//closeDevice(this->dev);
 	std::cout << "		Closing probe\n";
@@ -118,6 +149,63 @@ void SDOCT::setZSteps(int zsteps)
 	std::cout << "zsteps set to " << zsteps << std::endl;
 }
 
+//Maps the dB window [fMaxSigAmplitude - dBRange, fMaxSigAmplitude] onto 0..1, applies Contrast as gain and Brightness as offset on that, and scales the result to 0..255
+//Folded into a single scale and offset so captureVolScan only does one multiply-add per voxel
+void SDOCT::setAScanProperties(double Contrast, double Brightness, double dBRange, double fMaxSigAmplitude)
+{
+	if (dBRange <= 0.0)
+	{
+		dBRange = 1.0;
+	}
+
+	this->windowScale = (float)(255.0 * Contrast / dBRange);
+	this->windowOffset = (float)(255.0 * (Brightness - Contrast * (fMaxSigAmplitude - dBRange) / dBRange));
+	std::cout << "A-scan properties set to contrast " << Contrast << ", brightness " << Brightness << ", dB range " << dBRange << ", max amplitude " << fMaxSigAmplitude << std::endl;
+}
+
+void SDOCT::setVoxelFormat(uint32_t format)
+{
+	this->voxelFormat = OCT_Voxel::isSupported(format) ? format : (uint32_t)OCT_Voxel::UInt8;
+	std::cout << "voxel format set to " << this->voxelFormat << std::endl;
+}
+
+uint32_t SDOCT::getVoxelFormat()
+{
+	return this->voxelFormat;
+}
+
+void SDOCT::setCrop(uint32_t xstart, uint32_t xcount, uint32_t ystart, uint32_t ycount, uint32_t zstart, uint32_t zcount)
+{
+	this->cropXStart = xstart;
+	this->cropXCount = xcount;
+	this->cropYStart = ystart;
+	this->cropYCount = ycount;
+	this->cropZStart = zstart;
+	this->cropZCount = zcount;
+	std::cout << "crop set to x " << xstart << "+" << xcount << ", y " << ystart << "+" << ycount << ", z " << zstart << "+" << zcount << std::endl;
+}
+
+void SDOCT::setAveraging(uint32_t averaging)
+{
+	this->averaging = std::max(averaging, 1u);
+	std::cout << "averaging set to " << this->averaging << std::endl;
+}
+
+uint32_t SDOCT::getAveraging()
+{
+	return this->averaging;
+}
+
+uint32_t SDOCT::getCameraPixels()
+{
+	return DummyCameraPixels;
+}
+
+uint32_t SDOCT::getCameraBitDepth()
+{
+	return DummyCameraBitDepth;
+}
+
 //Getters
 int SDOCT::getXSteps()
 {
@@ -158,9 +246,13 @@ double SDOCT::getZRange()
 {
 	return this->zrange;
 }
-void SDOCT::captureVolScan(std::vector<uint8_t>& result)
+void SDOCT::captureVolScan(OCT_Buffer& result)
+{
+	captureVolScan(result, BScanHandler());
+}
+
+void SDOCT::captureVolScan(OCT_Buffer& result, const BScanHandler& onBScan)
 {
-	InitDataHandler();
 
 	//this->pattern = createBScanStackPattern(this->probe, this->xrange, this->xsteps, this->yrange, this->ysteps);
 
@@ -191,12 +283,242 @@ void SDOCT::captureVolScan(std::vector<uint8_t>& result)
 
 	//Copy data from pointer to std::vector
 	//int size = this->xsteps*this->ysteps;	
-	int value = this->ysteps;
+	const unsigned int bscansize = (this->xsteps) * (this->zsteps);
+
+	//Only the region of interest is ever converted and stored
+	uint32_t xstart = this->cropXStart, xcount = this->cropXCount;
+	uint32_t ystart = this->cropYStart, ycount = this->cropYCount;
+	uint32_t zstart = this->cropZStart, zcount = this->cropZCount;
+	OCT_Voxel::clampWindow(this->xsteps, xstart, xcount);
+	OCT_Voxel::clampWindow(this->ysteps, ystart, ycount);
+	OCT_Voxel::clampWindow(this->voxelFormat == OCT_Voxel::RawSpectra ? DummyCameraPixels : this->zsteps, zstart, zcount);
+
+	const size_t bscanBytes = (size_t)xcount * zcount * OCT_Voxel::size(this->voxelFormat);
+	const size_t volumeStart = result.size();
+	result.resize(volumeStart + bscanBytes * ycount);
+
+	if (bscanBytes == 0)
+	{
+		return;
+	}
 
-	for (int i = 0; i < value; i++)
+	if (this->voxelFormat == OCT_Voxel::RawSpectra)
 	{
-		result.push_back((int)i%16 + 10);
+		captureRaw(result, volumeStart, bscanBytes, xstart, xcount, ystart, ycount, zstart, zcount, onBScan);
+		return;
+	}
+
+	//Every repeat of a position is added up right after it is processed, and only their average is converted
+	this->averager.reset(this->averaging, this->zsteps, xstart, xcount);
+	const uint32_t repeats = this->averager.repeats();
+
+	if (this->processor)
+	{
+		captureWithProcessor(result, volumeStart, bscanBytes, xstart, xcount, ystart, ycount, zstart, zcount, onBScan);
+		return;
+	}
+
+	//Stands in for the processed float data of the SDK, so the same quantization runs as on the real device. Every depth of an A-scan gets its own value, so crops can be told apart
+	std::vector<float>& bscan = this->bscanBuffer;
+	bscan.resize(bscansize);
+
+	//Each B-scan takes as long as the real device would need to sweep its A-scans, so pipelining can be tested without hardware
+	boost::posix_time::microseconds bscanTime((boost::int64_t)(this->xsteps * 1000000.0 / DummyAScanRate));
+
+	for (uint32_t n = 0; n < this->ysteps * repeats; n++)
+	{
+		//Acquisition n is repeat n % repeats of the B-scan at position n / repeats
+		const uint32_t i = n / repeats;
+		{
+			OCT_Trace::Scope trace("getRawData", "bscan", i);
+			boost::this_thread::sleep(bscanTime);
+		}
+
+		//B-scans outside the region of interest still take their time on the device, but aren't processed
+		if (i < ystart || i >= ystart + ycount)
+		{
+			continue;
+		}
+
+		{
+			OCT_Trace::Scope trace("executeProcessing", "bscan", i);
+			for (unsigned int v = 0; v < bscansize; v++)
+			{
+				bscan[v] = (float)(i%16 + 10 + (v % this->zsteps) % 16);
+			}
+		}
+
+		const float* average;
+		{
+			OCT_Trace::Scope trace("average", "bscan", i);
+			average = this->averager.add(&bscan[0], n % repeats);
+		}
+		if (!average)
+		{
+			continue;
+		}
+
+		uint8_t* bscanVoxels = &result[volumeStart + (i - ystart) * bscanBytes];
+		{
+			OCT_Trace::Scope trace("convert", "bscan", i);
+			OCT_Voxel::convertBScanWindow(this->voxelFormat, average, this->zsteps, 0, xcount, zstart, zcount, bscanVoxels, this->windowScale, this->windowOffset);
+		}
+
+		if (onBScan)
+		{
+			onBScan(bscanVoxels, bscanBytes);
+		}
 	}
 
 	return;
-}
\ No newline at end of file
+}
+
+void SDOCT::captureWithProcessor(OCT_Buffer& result, size_t volumeStart, size_t bscanBytes, uint32_t xstart, uint32_t xcount, uint32_t ystart, uint32_t ycount, uint32_t zstart, uint32_t zcount, const BScanHandler& onBScan)
+{
+	const uint32_t pixels = DummyCameraPixels;
+	if (this->chirp.size() != pixels)
+	{
+		this->chirp = OCT_Processor::syntheticChirp(pixels);
+	}
+	if (this->processor->pixels() != pixels || this->processor->depths() != this->zsteps)
+	{
+		this->processor->configure(pixels, this->zsteps, this->chirp);
+	}
+	const uint32_t fftSize = OCT_Processor::fftSizeFor(pixels, this->zsteps);
+
+	for (int b = 0; b < 2; b++)
+	{
+		this->rawBuffers[b].resize((size_t)pixels * this->xsteps);
+	}
+	std::vector<float>& bscan = this->bscanBuffer;
+	bscan.resize((size_t)this->xsteps * this->zsteps);
+
+	const uint64_t bscanTime = (uint64_t)(this->xsteps * 1000000000.0 / DummyAScanRate);
+
+	//Acquisition n is repeat n % repeats of the B-scan at position n / repeats
+	const int repeats = (int)this->averager.repeats();
+	const int acquisitions = (int)this->ysteps * repeats;
+
+	//Acquisition whose processing is running, averaged, converted and handed over once the next one has been acquired. -1 for none
+	int processing = -1;
+	for (int n = 0; n <= acquisitions; n++)
+	{
+		const int i = n / repeats;
+		const bool inRegion = n < acquisitions && (uint32_t)i >= ystart && (uint32_t)i < ystart + ycount;
+		std::vector<uint16_t>& raw = this->rawBuffers[n % 2];
+
+		//Synthesizing the spectra counts as part of the time the device takes for them
+		if (n < acquisitions)
+		{
+			OCT_Trace::Scope trace("getRawData", "bscan", i);
+			const uint64_t start = OCT_Trace::now();
+			if (inRegion)
+			{
+				OCT_Processor::synthesizeSpectra(&raw[0], pixels, this->xsteps, fftSize, this->chirp, i);
+			}
+
+			const uint64_t elapsed = OCT_Trace::now() - start;
+			if (elapsed < bscanTime)
+			{
+				boost::this_thread::sleep(boost::posix_time::microseconds((boost::int64_t)((bscanTime - elapsed) / 1000)));
+			}
+		}
+
+		if (processing >= 0)
+		{
+			const int position = processing / repeats;
+			{
+				OCT_Trace::Scope trace("waitProcessing", "bscan", position);
+				this->processor->wait();
+			}
+
+			const float* average;
+			{
+				OCT_Trace::Scope trace("average", "bscan", position);
+				average = this->averager.add(&bscan[0], processing % repeats);
+			}
+
+			if (average)
+			{
+				uint8_t* bscanVoxels = &result[volumeStart + (position - ystart) * bscanBytes];
+				{
+					OCT_Trace::Scope trace("convert", "bscan", position);
+					OCT_Voxel::convertBScanWindow(this->voxelFormat, average, this->zsteps, 0, xcount, zstart, zcount, bscanVoxels, this->windowScale, this->windowOffset);
+				}
+
+				if (onBScan)
+				{
+					onBScan(bscanVoxels, bscanBytes);
+				}
+			}
+			processing = -1;
+		}
+
+		if (!inRegion)
+		{
+			continue;
+		}
+
+		//The first B-scan of every capture doubles as the background, as nothing of the sample is left once its A-scans are averaged
+		if (n == (int)ystart * repeats)
+		{
+			this->processor->setBackground(&raw[0], this->xsteps);
+		}
+
+		//Only the A-scans of the region are processed, into their place in the B-scan where the averager picks them up
+		this->processor->start(&raw[0] + (size_t)xstart * pixels, xcount, &bscan[(size_t)xstart * this->zsteps]);
+		processing = n;
+	}
+}
+
+void SDOCT::captureRaw(OCT_Buffer& result, size_t volumeStart, size_t bscanBytes, uint32_t xstart, uint32_t xcount, uint32_t ystart, uint32_t ycount, uint32_t zstart, uint32_t zcount, const BScanHandler& onBScan)
+{
+	const uint32_t pixels = DummyCameraPixels;
+	if (this->chirp.size() != pixels)
+	{
+		this->chirp = OCT_Processor::syntheticChirp(pixels);
+	}
+
+	//The same spectra the built-in processing gets, with the layers placed for an FFT of the camera's size, so a client processing them finds the surface where it expects it
+	const uint32_t fftSize = OCT_Processor::fftSizeFor(pixels, 0);
+	std::vector<uint16_t>& raw = this->rawBuffers[0];
+	raw.resize((size_t)pixels * this->xsteps);
+
+	const uint64_t bscanTime = (uint64_t)(this->xsteps * 1000000000.0 / DummyAScanRate);
+
+	for (int i = 0; i < (int)this->ysteps; i++)
+	{
+		const bool inRegion = (uint32_t)i >= ystart && (uint32_t)i < ystart + ycount;
+		{
+			OCT_Trace::Scope trace("getRawData", "bscan", i);
+			const uint64_t start = OCT_Trace::now();
+			if (inRegion)
+			{
+				OCT_Processor::synthesizeSpectra(&raw[0], pixels, this->xsteps, fftSize, this->chirp, i);
+			}
+
+			const uint64_t elapsed = OCT_Trace::now() - start;
+			if (elapsed < bscanTime)
+			{
+				boost::this_thread::sleep(boost::posix_time::microseconds((boost::int64_t)((bscanTime - elapsed) / 1000)));
+			}
+		}
+
+		if (!inRegion)
+		{
+			continue;
+		}
+
+		//Straight out of the acquisition buffer, the only copy the spectra take on their way to the network
+		uint8_t* bscanVoxels = &result[volumeStart + (i - ystart) * bscanBytes];
+		{
+			OCT_Trace::Scope trace("copyRaw", "bscan", i);
+			OCT_Voxel::copyRawWindow(&raw[0], pixels, xstart, xcount, zstart, zcount, bscanVoxels);
+		}
+
+		if (onBScan)
+		{
+			onBScan(bscanVoxels, bscanBytes);
+		}
+	}
+}
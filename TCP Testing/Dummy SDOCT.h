@@ -8,9 +8,20 @@
 #include "iterator"
 #include <stdint.h>
 
+#include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include "OCT_Averager.h"
+#include "OCT_Buffer.h"
+#include "OCT_Processor.h"
+#include "OCT_Quantize.h"
+
 
 using namespace std;
 
+//Called by captureVolScan for every B-scan as soon as it is processed, with a pointer to its voxels and their size in bytes, whatever the voxel format. The rest of the volume is still being acquired while it runs
+typedef boost::function<void (const uint8_t*, size_t)> BScanHandler;
+
 
 class SDOCT
 {
@@ -44,10 +55,27 @@ public:
 	void setXOffset(double);
 	void setYOffset(double);
 
-	void captureVolScan(std::vector<uint8_t>&);
+	void captureVolScan(OCT_Buffer&);
+	void captureVolScan(OCT_Buffer&, const BScanHandler&);
 
 	void setAScanProperties(double Contrast, double Brightness, double dBRange, double fMaxSigAmplitude);
 
+	//One of OCT_Voxel::Format. captureVolScan converts every B-scan into it while the next one is being acquired
+	uint32_t getVoxelFormat();
+	void setVoxelFormat(uint32_t);
+
+	//Region of interest captureVolScan cuts out of the scan before converting anything: count voxels from start on along each axis, where a count of 0 means up to the end. Y picks B-scans, X A-scans within them and Z depths within those
+	//With raw spectra Z picks camera pixels instead
+	void setCrop(uint32_t xstart, uint32_t xcount, uint32_t ystart, uint32_t ycount, uint32_t zstart, uint32_t zcount);
+
+	//B-scans captureVolScan acquires at every Y position and averages into the one it converts. Raw spectra are never averaged
+	uint32_t getAveraging();
+	void setAveraging(uint32_t);
+
+	//Pixels of the made up camera and the bits of each one it fills, which is what every raw spectrum holds
+	uint32_t getCameraPixels();
+	uint32_t getCameraBitDepth();
+
 
 private:
 	//Daten Pointer
@@ -70,9 +98,43 @@ private:
 	bool BScanAttitudeFlag;
 	bool BScanSpokesFlag;
 
+	//Float to 8 bit voxel mapping set by setAScanProperties: voxel = clamp(value * windowScale + windowOffset, 0, 255)
+	float windowScale;
+	float windowOffset;
+
+	//Voxel type captureVolScan produces
+	uint32_t voxelFormat;
+
+	//B-scans per Y position set by setAveraging, and the sum they are averaged in
+	uint32_t averaging;
+	OCT_Averager averager;
+
+	//Stands in for the processed float B-scan of the SDK. Kept across captures so it only gets allocated for the first one of its size
+	std::vector<float> bscanBuffer;
+
+	//Region of interest set by setCrop. Fitted into the steps only when the capture starts, as they might change after it
+	uint32_t cropXStart, cropXCount;
+	uint32_t cropYStart, cropYCount;
+	uint32_t cropZStart, cropZCount;
+
+	//Built-in processing, turned on by OCT_PROCESSING=builtin when Init runs. captureVolScan then synthesizes raw spectra behind a made up chirp and processes them like the real device would, instead of making up the processed data
+	boost::scoped_ptr<OCT_Processor> processor;
+
+	//Chirp of the made up camera, for the raw spectra of both the built-in processing and raw captures
+	std::vector<float> chirp;
+
+	//Raw B-scans, one being acquired while the other is processed. Raw captures only need the first
+	std::vector<uint16_t> rawBuffers[2];
+
 	//Methoden
 	void UpdateBScanProperties();
 	void UpdateBScanAttitude();
+
+	//The B-scan loop of captureVolScan for raw spectra, copied as they are into the region of interest it already fitted into the camera
+	void captureRaw(OCT_Buffer& result, size_t volumeStart, size_t bscanBytes, uint32_t xstart, uint32_t xcount, uint32_t ystart, uint32_t ycount, uint32_t zstart, uint32_t zcount, const BScanHandler& onBScan);
+
+	//The B-scan loop of captureVolScan with the built-in processing, for the region of interest it already fitted into the steps
+	void captureWithProcessor(OCT_Buffer& result, size_t volumeStart, size_t bscanBytes, uint32_t xstart, uint32_t xcount, uint32_t ystart, uint32_t ycount, uint32_t zstart, uint32_t zcount, const BScanHandler& onBScan);
 };
 
 #endif
\ No newline at end of file
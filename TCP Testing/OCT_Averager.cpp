@@ -0,0 +1,106 @@
+#include <OCT_Averager.h>
+
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+#include <OCT_FastMath.h>
+
+namespace
+{
+    //log2(10) / 10, for powers of 2 out of dB, its inverse and ln 2, for the plain C++ tails
+    const float OctavesPerDecibel = 0.332192809f;
+    const float DecibelsPerOctave = 3.01029996f;
+    const float Ln2 = 0.693147181f;
+}
+
+OCT_Averager::OCT_Averager() : m_repeats(1), m_zsteps(0), m_xstart(0), m_xcount(0)
+{
+}
+
+void OCT_Averager::reset(uint32_t repeats, uint32_t zsteps, uint32_t xstart, uint32_t xcount)
+{
+    m_repeats = std::max(repeats, 1u);
+    m_zsteps = zsteps;
+    m_xstart = xstart;
+    m_xcount = xcount;
+
+    //Kept across captures, so they only get allocated for the first one of their size
+    if (m_repeats > 1)
+    {
+        m_first.resize((size_t)xcount * zsteps);
+        m_sum.resize((size_t)xcount * zsteps);
+    }
+}
+
+const float* OCT_Averager::add(const float* bscan, uint32_t repeat)
+{
+    const float* kept = bscan + (size_t)m_xstart * m_zsteps;
+    if (m_repeats == 1)
+    {
+        return kept;
+    }
+
+    //The first repeat is its own reference, so its relative power is 1 everywhere
+    const size_t count = m_first.size();
+    if (repeat == 0)
+    {
+        memcpy(&m_first[0], kept, count * sizeof(float));
+        std::fill(m_sum.begin(), m_sum.end(), 1.0f);
+        return 0;
+    }
+    if (repeat + 1 < m_repeats)
+    {
+        accumulate(kept, &m_first[0], &m_sum[0], count);
+        return 0;
+    }
+
+    finish(kept, &m_first[0], &m_sum[0], count, m_repeats);
+    return &m_first[0];
+}
+
+uint32_t OCT_Averager::repeats() const
+{
+    return m_repeats;
+}
+
+void OCT_Averager::accumulate(const float* in, const float* first, float* sum, size_t count)
+{
+    size_t i = 0;
+#ifdef OCT_SSE2
+    const __m128 octaves = _mm_set1_ps(OctavesPerDecibel);
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128 power = OCT_FastMath::exp2Lanes(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(in + i), _mm_loadu_ps(first + i)), octaves));
+        _mm_storeu_ps(sum + i, _mm_add_ps(_mm_loadu_ps(sum + i), power));
+    }
+#endif
+    for (; i < count; i++)
+    {
+        sum[i] += expf((in[i] - first[i]) * OctavesPerDecibel * Ln2);
+    }
+}
+
+void OCT_Averager::finish(const float* in, float* first, const float* sum, size_t count, uint32_t repeats)
+{
+    const float divisor = (float)repeats;
+
+    size_t i = 0;
+#ifdef OCT_SSE2
+    const __m128 octaves = _mm_set1_ps(OctavesPerDecibel);
+    const __m128 decibels = _mm_set1_ps(DecibelsPerOctave);
+    const __m128 vdivisor = _mm_set1_ps(divisor);
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128 reference = _mm_loadu_ps(first + i);
+        const __m128 power = OCT_FastMath::exp2Lanes(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(in + i), reference), octaves));
+        const __m128 mean = _mm_div_ps(_mm_add_ps(_mm_loadu_ps(sum + i), power), vdivisor);
+        _mm_storeu_ps(first + i, _mm_add_ps(reference, _mm_mul_ps(OCT_FastMath::log2Lanes(mean), decibels)));
+    }
+#endif
+    for (; i < count; i++)
+    {
+        const float mean = (sum[i] + expf((in[i] - first[i]) * OctavesPerDecibel * Ln2)) / divisor;
+        first[i] += logf(mean) / Ln2 * DecibelsPerOctave;
+    }
+}
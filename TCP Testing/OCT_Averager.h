@@ -0,0 +1,42 @@
+#ifndef OCT_AVERAGER
+#define OCT_AVERAGER
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+//Averages the B-scans captureVolScan acquires over and over at every Y position into one, for speckle reduction, so only the average gets converted and sent
+//The processed values are 10 log10 of the power, and the average is taken over the power itself, not over the dB, which would give the geometric mean and come out too dark wherever the speckle varies
+//Every repeat is added in place onto the region of interest of the first one, so memory stays the same however many repeats there are
+class OCT_Averager
+{
+private:
+    //dB of the first repeat of the position, which becomes the average, and the sum of the power of every repeat relative to it
+    std::vector<float> m_first;
+    std::vector<float> m_sum;
+    uint32_t m_repeats;
+    uint32_t m_zsteps;
+    uint32_t m_xstart;
+    uint32_t m_xcount;
+
+public:
+    OCT_Averager();
+
+    //Starts averaging repeats B-scans per position, of A-scans zsteps deep, of which the xcount from xstart on are kept. There has to be at least one of them
+    void reset(uint32_t repeats, uint32_t zsteps, uint32_t xstart, uint32_t xcount);
+
+    //Adds bscan, every A-scan of it one after the other, as the repeat-th B-scan of its position. Returns the average in dB once the last repeat is in, as the xcount A-scans of zsteps values, and 0 before
+    //Without repeats that is the A-scans of bscan itself, nothing gets copied
+    const float* add(const float* bscan, uint32_t repeat);
+
+    uint32_t repeats() const;
+
+    //sum += the power of in relative to first, over count values
+    static void accumulate(const float* in, const float* first, float* sum, size_t count);
+
+    //first = the dB of the mean power, sum and in included, over count values, so the last repeat leaves the average in the same pass
+    //Relative to first the power of equal values is exactly 1, so their average is exactly that value again
+    static void finish(const float* in, float* first, const float* sum, size_t count, uint32_t repeats);
+};
+
+#endif
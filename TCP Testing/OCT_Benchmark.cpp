@@ -0,0 +1,470 @@
+//Microbenchmarks of the hot paths of the server: header construction, param parsing, the built-in processing of raw spectra, the float to voxel conversion of captureVolScan and the chunked send of a volume through a real TCP_Connection over loopback
+//Results go to stdout as CSV, or JSON with "json" as the first argument, one row per kernel and size, so they can be kept next to each version and compared. Progress goes to stderr
+//Usage: OCT_Benchmark [csv|json] [seconds per case, 0.5 by default]
+//
+//Not part of OCTserver.vcxproj, it has a main of its own. Builds on Linux against the Dummy SDOCT backend from this directory with:
+//  g++ -O2 -I. -DSDOCT_H -include "Dummy SDOCT.h" OCT_Benchmark.cpp "Dummy SDOCT.cpp" OCT_Averager.cpp OCT_BufferPool.cpp OCT_Compression.cpp OCT_Processor.cpp OCT_Protocol.cpp OCT_Publisher.cpp OCT_Pyramid.cpp OCT_Quantize.cpp OCT_Recorder.cpp OCT_Scheduler.cpp OCT_Trace.cpp OCT_VolumeCache.cpp OCT_WorkerPool.cpp TCP_Connection.cpp TCP_Server.cpp -o OCT_Benchmark -lboost_thread -lboost_system -lpthread
+//SDOCT_H keeps the real SDOCT.h, and with it the SpectralRadar SDK, out of the build
+
+#include <algorithm>
+#include <iostream>
+#include <math.h>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <SDOCT.h>
+#include <OCT_Buffer.h>
+#include <OCT_BufferPool.h>
+#include <OCT_Compression.h>
+#include <OCT_Params.h>
+#include <OCT_Processor.h>
+#include <OCT_Protocol.h>
+#include <OCT_Publisher.h>
+#include <OCT_Quantize.h>
+#include <OCT_Recorder.h>
+#include <OCT_Scheduler.h>
+#include <OCT_Trace.h>
+#include <OCT_VolumeCache.h>
+#include <OCT_WorkerPool.h>
+#include <TCP_Server.h>
+
+//One line of the results. Times are per operation: one header, one params frame, one B-scan or one volume
+struct BenchmarkResult
+{
+    std::string kernel;
+    std::string size;
+    uint64_t operations;
+    double meanNs;
+    double bestNs;
+
+    //Bytes each operation produces, for the throughput. 0 where it means nothing
+    double bytes;
+};
+
+//Runs body, which does the operation as many times as it is told, in batches long enough for the clock not to matter, until seconds have gone by. The best batch tells the speed the code is capable of, the mean how steady it is
+BenchmarkResult measure(const std::string& kernel, const std::string& size, const boost::function<void (size_t)>& body, double bytes, double seconds)
+{
+    std::cerr << kernel << " " << size << "\n";
+
+    //Doubles the batch until it takes a millisecond
+    size_t batch = 1;
+    while (1)
+    {
+        uint64_t start = OCT_Trace::now();
+        body(batch);
+        if (OCT_Trace::now() - start >= 1000000 || batch >= ((size_t)1 << 30))
+        {
+            break;
+        }
+        batch *= 2;
+    }
+
+    BenchmarkResult result;
+    result.kernel = kernel;
+    result.size = size;
+    result.operations = 0;
+    result.bestNs = 0.0;
+    result.bytes = bytes;
+
+    const uint64_t budget = (uint64_t)(seconds * 1000000000.0);
+    uint64_t total = 0;
+    do
+    {
+        uint64_t start = OCT_Trace::now();
+        body(batch);
+        uint64_t elapsed = OCT_Trace::now() - start;
+
+        double perOperation = (double)elapsed / batch;
+        if (result.operations == 0 || perOperation < result.bestNs)
+        {
+            result.bestNs = perOperation;
+        }
+        result.operations += batch;
+        total += elapsed;
+    } while (total < budget);
+
+    result.meanNs = (double)total / result.operations;
+    return result;
+}
+
+OCT_Params makeParams(uint32_t xsteps, uint32_t ysteps, uint32_t zsteps, uint32_t format)
+{
+    OCT_Params params;
+    params.xrange = 2.0f;
+    params.yrange = 2.0f;
+    params.zrange = 2.0f;
+    params.xsteps = xsteps;
+    params.ysteps = ysteps;
+    params.zsteps = zsteps;
+    params.format = format;
+    params.clampCrop();
+    return params;
+}
+
+std::string sizeName(uint32_t xsteps, uint32_t ysteps, uint32_t zsteps)
+{
+    std::ostringstream name;
+    name << xsteps << "x" << ysteps << "x" << zsteps;
+    return name.str();
+}
+
+//Same float data the Dummy SDOCT feeds its conversion: every depth of an A-scan gets its own value
+void fillBScan(std::vector<float>& bscan, uint32_t index, uint32_t zsteps)
+{
+    for (size_t v = 0; v < bscan.size(); v++)
+    {
+        bscan[v] = (float)(index % 16 + 10 + (v % zsteps) % 16);
+    }
+}
+
+void runHeader(size_t count, OCT_Buffer* header, const OCT_Params* params)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        //Like TCP_Connection::prepare_header, into a buffer that keeps its capacity
+        header->clear();
+        header->resize(512);
+        OCT_Protocol::writeHeader(&(*header)[0], *params);
+    }
+}
+
+void runParams(size_t count, const std::vector<char>* frame, OCT_Params* params)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        OCT_Protocol::readParams(&(*frame)[0], frame->size(), *params);
+    }
+}
+
+void runConvert(size_t count, const std::vector<float>* bscan, OCT_Buffer* out, const OCT_Params* params)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        OCT_Voxel::convertBScanWindow(params->format, &(*bscan)[0], params->zsteps, params->xstart, params->xcount, params->zstart, params->zcount, &(*out)[0], 0.5f, 3.0f);
+    }
+}
+
+void runProcess(size_t count, OCT_Processor* processor, const std::vector<uint16_t>* raw, uint32_t ascans, std::vector<float>* out)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        processor->process(&(*raw)[0], ascans, &(*out)[0]);
+    }
+}
+
+void runProcessReference(size_t count, const OCT_Processor* processor, const std::vector<uint16_t>* raw, uint32_t ascans, std::vector<float>* out)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        processor->processReference(&(*raw)[0], ascans, &(*out)[0]);
+    }
+}
+
+//Raw B-scans of synthetic spectra through the built-in processing, on one thread and on every core, and through its plain reference. The throughput is of the raw spectra read
+void benchmarkProcessing(std::vector<BenchmarkResult>& results, double seconds)
+{
+    const unsigned int cores = std::max(1u, boost::thread::hardware_concurrency());
+    const unsigned int threadCounts[] = { 1, cores };
+    const char* kernelNames[] = { "process_1thread", "process_all_threads" };
+
+    //A-scans per B-scan and camera pixels per spectrum
+    const uint32_t sizes[][2] = { { 512, 1024 }, { 512, 2048 }, { 1024, 2048 } };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        const uint32_t ascans = sizes[s][0];
+        const uint32_t pixels = sizes[s][1];
+        const uint32_t depths = pixels / 2;
+        const std::string size = sizeName(ascans, 1, pixels);
+
+        std::vector<float> chirp = OCT_Processor::syntheticChirp(pixels);
+        std::vector<uint16_t> raw((size_t)ascans * pixels);
+        OCT_Processor::synthesizeSpectra(&raw[0], pixels, ascans, OCT_Processor::fftSizeFor(pixels, depths), chirp, 0);
+        std::vector<float> out((size_t)ascans * depths);
+        const double bytes = (double)raw.size() * sizeof(uint16_t);
+
+        for (size_t t = 0; t < (cores > 1 ? 2u : 1u); t++)
+        {
+            OCT_Processor processor(threadCounts[t]);
+            processor.configure(pixels, depths, chirp);
+            processor.setBackground(&raw[0], ascans);
+
+            BenchmarkResult result = measure(kernelNames[t], size, boost::bind(&runProcess, _1, &processor, &raw, ascans, &out), bytes, seconds);
+            results.push_back(result);
+            std::cerr << "  " << 1000000000.0 / result.bestNs / threadCounts[t] << " B-scans per second per core on " << threadCounts[t] << " threads\n";
+
+            if (t == 0)
+            {
+                std::vector<float> reference(out.size());
+                results.push_back(measure("process_reference", size, boost::bind(&runProcessReference, _1, &processor, &raw, ascans, &reference), bytes, seconds));
+
+                //Depths well above the noise floor only, where float rounding can't dominate the dB
+                double maxDifference = 0.0;
+                for (size_t i = 0; i < out.size(); i++)
+                {
+                    if (reference[i] > 40.0f)
+                    {
+                        maxDifference = std::max(maxDifference, (double)fabs(out[i] - reference[i]));
+                    }
+                }
+                std::cerr << "  " << maxDifference << " dB at most off the double precision reference\n";
+            }
+        }
+    }
+}
+
+//Client side of the send benchmark: a plain blocking socket subscribed to every published volume
+struct SendClient
+{
+    boost::asio::io_service service;
+    boost::asio::ip::tcp::socket socket;
+    std::vector<uint8_t> buffer;
+
+    //Bytes read since the start of the last volume
+    uint64_t wireBytes;
+
+    SendClient() : socket(service), wireBytes(0) {}
+
+    void request(char command, const uint8_t* argument, size_t argumentSize)
+    {
+        std::vector<uint8_t> frame(OCT_Protocol::FrameHeaderSize + 1 + argumentSize);
+        uint32_t length = (uint32_t)(1 + argumentSize);
+        memcpy(&frame[0], &length, sizeof(uint32_t));
+        frame[OCT_Protocol::FrameHeaderSize] = (uint8_t)command;
+        if (argumentSize > 0)
+        {
+            memcpy(&frame[OCT_Protocol::FrameHeaderSize + 1], argument, argumentSize);
+        }
+        boost::asio::write(socket, boost::asio::buffer(frame));
+    }
+
+    const uint8_t* read(size_t size)
+    {
+        if (buffer.size() < size)
+        {
+            buffer.resize(size);
+        }
+        boost::asio::read(socket, boost::asio::buffer(&buffer[0], size));
+        wireBytes += size;
+        return &buffer[0];
+    }
+
+    //Reads one volume as the server sends it, raw or chunk by chunk
+    void readVolume()
+    {
+        wireBytes = 0;
+        const uint8_t* header = this->read(512);
+        const uint32_t ycount = OCT_HeaderLayout::YCount::read(header);
+        const uint32_t xcount = OCT_HeaderLayout::XCount::read(header);
+        const uint32_t zcount = OCT_HeaderLayout::ZCount::read(header);
+        const uint32_t codec = OCT_HeaderLayout::Codec::read(header);
+        const uint32_t chunks = OCT_HeaderLayout::Chunks::read(header);
+        const uint32_t bytesPerVoxel = OCT_HeaderLayout::BytesPerVoxel::read(header);
+
+        if (codec == OCT_Codec::None)
+        {
+            this->read((size_t)ycount * xcount * zcount * bytesPerVoxel);
+            return;
+        }
+
+        for (uint32_t i = 0; i < chunks; i++)
+        {
+            uint32_t chunkSize;
+            memcpy(&chunkSize, this->read(sizeof(uint32_t)), sizeof(uint32_t));
+            this->read(chunkSize);
+        }
+    }
+};
+
+void runSend(size_t count, OCT_Publisher* publisher, const OCT_VolumePtr* volume, SendClient* client)
+{
+    //One at a time, so the publisher never drops a volume for a subscriber that fell behind
+    for (size_t i = 0; i < count; i++)
+    {
+        publisher->publish(*volume, 0);
+        client->readVolume();
+    }
+}
+
+void benchmarkSend(std::vector<BenchmarkResult>& results, double seconds)
+{
+    //The whole server as main.cpp puts it together, on the port after the usual one so a running server doesn't get in the way
+    boost::asio::io_service service;
+    SDOCT oct;
+    OCT_Publisher publisher;
+    OCT_BufferPool pool(OCT_Protocol::PooledBuffersPerClass, OCT_Protocol::CacheBudget + OCT_Protocol::PoolBudget);
+    OCT_WorkerPool encoder(std::max(1u, boost::thread::hardware_concurrency()));
+    OCT_Scheduler scheduler(oct, 0);
+    OCT_Recorder recorder("");
+    OCT_VolumeCache cache(OCT_Protocol::CachedVolumes, OCT_Protocol::CacheBudget);
+    TCP_Server server(service, scheduler, publisher, encoder, pool, recorder, cache, OCT_Protocol::Port + 1);
+
+    boost::thread_group serviceThreads;
+    boost::scoped_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(service));
+    for (int i = 0; i < 2; i++)
+    {
+        serviceThreads.create_thread(boost::bind(&boost::asio::io_service::run, &service));
+    }
+
+    const uint32_t sizes[][3] = { { 128, 32, 512 }, { 512, 128, 1024 } };
+    const uint32_t codecs[] = { OCT_Codec::None, OCT_Codec::LZ, OCT_Codec::DeltaLZ };
+    const char* codecNames[] = { "raw", "lz", "deltalz" };
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        OCT_Params params = makeParams(sizes[s][0], sizes[s][1], sizes[s][2], OCT_Voxel::UInt8);
+
+        boost::shared_ptr<OCT_Volume> volume = boost::make_shared<OCT_Volume>();
+        volume->params = params;
+        volume->message.resize(512 + params.volumeSize());
+        OCT_Protocol::writeHeader(&volume->message[0], params);
+
+        std::vector<float> bscan((size_t)params.xsteps * params.zsteps);
+        for (uint32_t y = 0; y < params.ysteps; y++)
+        {
+            fillBScan(bscan, y, params.zsteps);
+            OCT_Voxel::convertBScan(params.format, &bscan[0], &volume->message[512 + y * params.bscanSize()], bscan.size(), 1.0f, 0.0f);
+        }
+        OCT_VolumePtr published = volume;
+
+        for (size_t c = 0; c < sizeof(codecs) / sizeof(codecs[0]); c++)
+        {
+            SendClient client;
+            client.socket.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), OCT_Protocol::Port + 1));
+
+            //Negotiates the codec and subscribes. The reply to the 'Q' only comes once the 'U' before it has been run
+            uint8_t argument = (uint8_t)codecs[c];
+            client.request('Z', &argument, 1);
+            client.read(1);
+            argument = 1;
+            client.request('U', &argument, 1);
+            client.request('Q', 0, 0);
+            client.read(512);
+
+            BenchmarkResult result = measure(std::string("send_") + codecNames[c], sizeName(params.xsteps, params.ysteps, params.zsteps),
+                boost::bind(&runSend, _1, &publisher, &published, &client), (double)params.volumeSize(), seconds);
+            results.push_back(result);
+
+            std::cerr << "  " << (double)client.wireBytes / (512.0 + params.volumeSize()) * 100.0 << "% of the raw volume on the wire\n";
+        }
+    }
+
+    work.reset();
+    service.stop();
+    serviceThreads.join_all();
+}
+
+void writeCsv(const std::vector<BenchmarkResult>& results)
+{
+    std::cout << "kernel,size,operations,mean_ns,best_ns,best_mb_per_s\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchmarkResult& r = results[i];
+        std::cout << r.kernel << "," << r.size << "," << r.operations << "," << r.meanNs << "," << r.bestNs << "," << (r.bytes > 0 ? r.bytes / r.bestNs * 1000.0 : 0.0) << "\n";
+    }
+}
+
+void writeJson(const std::vector<BenchmarkResult>& results)
+{
+    std::cout << "{\"benchmarks\":[";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchmarkResult& r = results[i];
+        std::cout << (i ? "," : "") << "\n{\"kernel\":\"" << r.kernel << "\",\"size\":\"" << r.size << "\",\"operations\":" << r.operations
+            << ",\"mean_ns\":" << r.meanNs << ",\"best_ns\":" << r.bestNs << ",\"best_mb_per_s\":" << (r.bytes > 0 ? r.bytes / r.bestNs * 1000.0 : 0.0) << "}";
+    }
+    std::cout << "\n]}\n";
+}
+
+int main(int argc, char* argv[])
+{
+    bool json = argc > 1 && std::string(argv[1]) == "json";
+    double seconds = 0.5;
+    if (argc > 2)
+    {
+        seconds = boost::lexical_cast<double>(argv[2]);
+    }
+
+    //Spans of the send benchmark would only fill the trace ring
+    OCT_Trace::setEnabled(false);
+
+    //The server logs every request and transfer to std::cout, so it is muted until the results are written
+    std::streambuf* output = std::cout.rdbuf();
+    std::cout.rdbuf(0);
+
+    std::vector<BenchmarkResult> results;
+
+    //Header of every volume, level and 'Q' reply. The same whatever the size
+    {
+        OCT_Params params = makeParams(512, 128, 1024, OCT_Voxel::UInt8);
+        params.xstart = 64;
+        params.xcount = 256;
+        params.clampCrop();
+        OCT_Buffer header;
+        results.push_back(measure("prepare_header", "512", boost::bind(&runHeader, _1, &header, &params), 512.0, seconds));
+    }
+
+    //Params of every 'P', 'S', 'R' and 'B', without and with the region of interest
+    {
+        const size_t frameSizes[] = { OCT_Protocol::ParamsFrameSize, OCT_Protocol::CropParamsFrameSize };
+        for (size_t i = 0; i < 2; i++)
+        {
+            std::vector<char> frame(frameSizes[i], 0);
+            frame[0] = 'P';
+            OCT_Params source = makeParams(512, 128, 1024, OCT_Voxel::UInt8);
+            OCT_ParamsLayout::XRange::write(&frame[0], source.xrange);
+            OCT_ParamsLayout::XSteps::write(&frame[0], source.xsteps);
+            OCT_ParamsLayout::YSteps::write(&frame[0], source.ysteps);
+            OCT_ParamsLayout::ZSteps::write(&frame[0], source.zsteps);
+
+            OCT_Params params;
+            results.push_back(measure("set_oct_params", boost::lexical_cast<std::string>(frameSizes[i]), boost::bind(&runParams, _1, &frame, &params), 0.0, seconds));
+        }
+    }
+
+    //Conversion of every processed B-scan, in every voxel format. The throughput is of the voxels written
+    {
+        const uint32_t sizes[][2] = { { 256, 512 }, { 512, 1024 }, { 1024, 2048 } };
+        const char* formatNames[] = { "convert_uint8", "convert_uint16", "convert_float32" };
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        {
+            std::vector<float> bscan((size_t)sizes[s][0] * sizes[s][1]);
+            fillBScan(bscan, 0, sizes[s][1]);
+
+            for (uint32_t format = OCT_Voxel::UInt8; format <= OCT_Voxel::Float32; format++)
+            {
+                OCT_Params params = makeParams(sizes[s][0], 1, sizes[s][1], format);
+                OCT_Buffer out(params.bscanSize());
+                results.push_back(measure(formatNames[format], sizeName(params.xsteps, 1, params.zsteps), boost::bind(&runConvert, _1, &bscan, &out, &params), (double)params.bscanSize(), seconds));
+            }
+        }
+    }
+
+    //Raw spectra to processed A-scans, when the server does the processing itself
+    benchmarkProcessing(results, seconds);
+
+    //Whole volumes from the publisher to a subscriber's socket, raw and compressed. The throughput is of the raw voxels
+    benchmarkSend(results, seconds);
+
+    std::cout.rdbuf(output);
+    if (json)
+    {
+        writeJson(results);
+    }
+    else
+    {
+        writeCsv(results);
+    }
+
+    return 0;
+}
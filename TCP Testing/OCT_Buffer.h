@@ -0,0 +1,88 @@
+#ifndef OCT_BUFFER
+#define OCT_BUFFER
+
+#include <new>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+//Allocator handing out page aligned memory for anything of a page or more and cache line aligned memory for the rest, so the vectorized kernels and the socket writes never straddle a line they don't need to
+template <typename T>
+class OCT_AlignedAllocator
+{
+public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <typename U>
+    struct rebind
+    {
+        typedef OCT_AlignedAllocator<U> other;
+    };
+
+    static const size_t CacheLine = 64;
+    static const size_t Page = 4096;
+
+    OCT_AlignedAllocator() {}
+    template <typename U>
+    OCT_AlignedAllocator(const OCT_AlignedAllocator<U>&) {}
+
+    pointer address(reference x) const { return &x; }
+    const_pointer address(const_reference x) const { return &x; }
+    size_type max_size() const { return ((size_t)-1) / sizeof(T); }
+
+    void construct(pointer p, const T& value) { new ((void*)p) T(value); }
+    void destroy(pointer p) { p->~T(); }
+
+    pointer allocate(size_type count, const void* = 0)
+    {
+        const size_t bytes = count * sizeof(T);
+        const size_t alignment = bytes >= Page ? Page : CacheLine;
+        void* memory = 0;
+
+#ifdef _MSC_VER
+        memory = _aligned_malloc(bytes, alignment);
+#else
+        if (posix_memalign(&memory, alignment, bytes) != 0)
+        {
+            memory = 0;
+        }
+#endif
+
+        if (!memory && bytes > 0)
+        {
+            throw std::bad_alloc();
+        }
+        return (pointer)memory;
+    }
+
+    void deallocate(pointer p, size_type)
+    {
+#ifdef _MSC_VER
+        _aligned_free(p);
+#else
+        free(p);
+#endif
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const OCT_AlignedAllocator<T>&, const OCT_AlignedAllocator<U>&) { return true; }
+
+template <typename T, typename U>
+bool operator!=(const OCT_AlignedAllocator<T>&, const OCT_AlignedAllocator<U>&) { return false; }
+
+//Byte buffer of a volume message: the 512 byte header at the start of an aligned allocation, so the voxels after it are cache line aligned too
+typedef std::vector<uint8_t, OCT_AlignedAllocator<uint8_t> > OCT_Buffer;
+
+#endif
@@ -0,0 +1,129 @@
+#include <OCT_BufferPool.h>
+
+#include <boost/make_shared.hpp>
+
+OCT_BufferPool::OCT_BufferPool(size_t buffersPerClass, size_t budget) : m_buffersPerClass(buffersPerClass), m_budget(budget)
+{
+    m_stats.hits = 0;
+    m_stats.misses = 0;
+    m_stats.unpooled = 0;
+    m_stats.buffers = 0;
+    m_stats.inUse = 0;
+    m_stats.bytes = 0;
+    m_stats.budget = budget;
+    m_stats.evicted = 0;
+}
+
+boost::shared_ptr<OCT_Volume> OCT_BufferPool::acquire(size_t capacity)
+{
+    const size_t size = sizeClass(capacity);
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    std::vector<boost::shared_ptr<OCT_Volume> >& buffers = m_classes[size];
+
+    //Only the pool can hand out new references, so a volume nobody else refers to stays free until it is handed out again here
+    for (size_t i = 0; i < buffers.size(); i++)
+    {
+        if (buffers[i].unique())
+        {
+            m_stats.hits++;
+            buffers[i]->params = OCT_Params();
+            buffers[i]->message.clear();
+            return buffers[i];
+        }
+    }
+
+    m_stats.misses++;
+    boost::shared_ptr<OCT_Volume> volume = boost::make_shared<OCT_Volume>();
+    volume->message.reserve(size);
+
+    if (buffers.size() < m_buffersPerClass && this->makeRoom(size, size))
+    {
+        buffers.push_back(volume);
+        m_stats.buffers++;
+        m_stats.bytes += size;
+    }
+    else
+    {
+        m_stats.unpooled++;
+    }
+
+    return volume;
+}
+
+bool OCT_BufferPool::makeRoom(size_t size, size_t keep)
+{
+    if (size > m_budget)
+    {
+        return false;
+    }
+
+    //Largest classes first, so as few buffers as possible are given up
+    std::map<size_t, std::vector<boost::shared_ptr<OCT_Volume> > >::iterator it = m_classes.end();
+    while (m_stats.bytes + size > m_budget && it != m_classes.begin())
+    {
+        --it;
+        if (it->first == keep)
+        {
+            continue;
+        }
+
+        std::vector<boost::shared_ptr<OCT_Volume> >& buffers = it->second;
+        for (size_t i = buffers.size(); i > 0 && m_stats.bytes + size > m_budget; i--)
+        {
+            if (buffers[i - 1].unique())
+            {
+                buffers.erase(buffers.begin() + (i - 1));
+                m_stats.buffers--;
+                m_stats.bytes -= it->first;
+                m_stats.evicted++;
+            }
+        }
+    }
+
+    return m_stats.bytes + size <= m_budget;
+}
+
+OCT_BufferPool::Stats OCT_BufferPool::stats()
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    Stats stats = m_stats;
+    stats.inUse = 0;
+    for (std::map<size_t, std::vector<boost::shared_ptr<OCT_Volume> > >::const_iterator it = m_classes.begin(); it != m_classes.end(); ++it)
+    {
+        for (size_t i = 0; i < it->second.size(); i++)
+        {
+            if (!it->second[i].unique())
+            {
+                stats.inUse++;
+            }
+        }
+    }
+
+    return stats;
+}
+
+size_t OCT_BufferPool::sizeClass(size_t size)
+{
+    //Nothing smaller than a page, which also covers the header on its own
+    size_t power = 4096;
+    while (power < size)
+    {
+        power *= 2;
+    }
+
+    //Steps of a quarter between power / 2 and power
+    if (power > 4096)
+    {
+        const size_t step = power / 8;
+        size_t size4 = power / 2;
+        while (size4 < size)
+        {
+            size4 += step;
+        }
+        return size4;
+    }
+
+    return power;
+}
@@ -0,0 +1,62 @@
+#ifndef OCT_BUFFER_POOL
+#define OCT_BUFFER_POOL
+
+#include <map>
+#include <vector>
+#include <stdint.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <OCT_Volume.h>
+
+//Volumes reused across requests and connections, so steady state scanning doesn't allocate. Buffers are kept by size class and handed out again once nothing refers to them anymore, the same way the live frame ring reuses its frames
+//Size classes are powers of two split in 4 steps, so a buffer never reserves more than a quarter over what was asked for. Only the memory actually written ever gets touched
+//The buffers kept never reserve more than a budget in total. Clients choose the volume sizes, so without it every geometry ever scanned would keep its buffers for good. Free buffers of other sizes make room for new ones, largest first
+class OCT_BufferPool
+{
+public:
+    struct Stats
+    {
+        //Volumes handed out from the pool, and ones that had to be allocated
+        uint64_t hits;
+        uint64_t misses;
+
+        //Misses that didn't fit in their full size class and are freed after use
+        uint64_t unpooled;
+
+        //Buffers kept by the pool, how many of them are in use right now and the bytes they reserve
+        uint64_t buffers;
+        uint64_t inUse;
+        uint64_t bytes;
+
+        //Bytes the buffers kept may reserve, and free buffers released to stay within them
+        uint64_t budget;
+        uint64_t evicted;
+    };
+
+private:
+    boost::mutex m_mutex;
+    std::map<size_t, std::vector<boost::shared_ptr<OCT_Volume> > > m_classes;
+    size_t m_buffersPerClass;
+    size_t m_budget;
+    Stats m_stats;
+
+public:
+    //Keeps up to buffersPerClass volumes of every size class, reserving no more than budget bytes in total
+    OCT_BufferPool(size_t buffersPerClass, size_t budget);
+
+    //Returns an empty volume whose message can grow to capacity bytes without reallocating. The volume goes back to the pool when the last shared pointer to it is dropped. Thread safe
+    boost::shared_ptr<OCT_Volume> acquire(size_t capacity);
+
+    Stats stats();
+
+    //Smallest size class holding size bytes
+    static size_t sizeClass(size_t size);
+
+private:
+    //Releases free buffers of other size classes than keep, largest first, until size more bytes fit in the budget. Returns whether they do. Called with the mutex held
+    bool makeRoom(size_t size, size_t keep);
+};
+
+#endif
@@ -0,0 +1,247 @@
+#include <OCT_Compression.h>
+
+#include <string.h>
+
+#include <boost/thread/tss.hpp>
+
+namespace
+{
+    const size_t MinMatch = 4;
+    const size_t MaxOffset = 65535;
+    const int HashBits = 12;
+
+    //Deltas of the chunk being compressed, one buffer per encoder thread. It only grows to the largest B-scan, so compressing allocates nothing once every thread has seen one
+    boost::thread_specific_ptr<std::vector<uint8_t> > g_delta;
+
+    inline uint32_t read32(const uint8_t* p)
+    {
+        uint32_t value;
+        memcpy(&value, p, sizeof(uint32_t));
+        return value;
+    }
+
+    inline uint32_t hash(uint32_t sequence)
+    {
+        return (sequence * 2654435761u) >> (32 - HashBits);
+    }
+
+    //Lengths that don't fit the 4 bit field of the token continue in 255 valued bytes, LZ4 style
+    inline void writeLength(std::vector<uint8_t>& out, size_t length)
+    {
+        while (length >= 255)
+        {
+            out.push_back(255);
+            length -= 255;
+        }
+        out.push_back((uint8_t)length);
+    }
+
+    inline bool readLength(const uint8_t*& in, const uint8_t* end, size_t& length)
+    {
+        uint8_t byte;
+        do
+        {
+            if (in >= end)
+            {
+                return false;
+            }
+            byte = *in++;
+            length += byte;
+        } while (byte == 255);
+        return true;
+    }
+
+    void writeSequence(std::vector<uint8_t>& out, const uint8_t* literals, size_t literalLength, size_t offset, size_t matchLength)
+    {
+        size_t matchCode = matchLength ? matchLength - MinMatch : 0;
+        uint8_t token = (uint8_t)(((literalLength < 15 ? literalLength : 15) << 4) | (matchCode < 15 ? matchCode : 15));
+        out.push_back(token);
+
+        if (literalLength >= 15)
+        {
+            writeLength(out, literalLength - 15);
+        }
+        out.insert(out.end(), literals, literals + literalLength);
+
+        //The last sequence carries only literals
+        if (matchLength == 0)
+        {
+            return;
+        }
+
+        out.push_back((uint8_t)(offset & 0xFF));
+        out.push_back((uint8_t)(offset >> 8));
+        if (matchCode >= 15)
+        {
+            writeLength(out, matchCode - 15);
+        }
+    }
+
+    void compressLZ(const uint8_t* in, size_t size, std::vector<uint8_t>& out)
+    {
+        uint32_t table[1 << HashBits];
+        memset(table, 0, sizeof(table));
+
+        size_t anchor = 0;
+        size_t i = 1;
+
+        while (i + MinMatch <= size)
+        {
+            uint32_t sequence = read32(in + i);
+            uint32_t h = hash(sequence);
+            size_t candidate = table[h];
+            table[h] = (uint32_t)i;
+
+            if (candidate < i && i - candidate <= MaxOffset && read32(in + candidate) == sequence)
+            {
+                size_t matchLength = MinMatch;
+                while (i + matchLength < size && in[candidate + matchLength] == in[i + matchLength])
+                {
+                    matchLength++;
+                }
+
+                writeSequence(out, in + anchor, i - anchor, i - candidate, matchLength);
+                i += matchLength;
+                anchor = i;
+            }
+            else
+            {
+                //Skips faster through data that doesn't compress
+                i += 1 + ((i - anchor) >> 6);
+            }
+        }
+
+        writeSequence(out, in + anchor, size - anchor, 0, 0);
+    }
+
+    bool decompressLZ(const uint8_t* in, size_t size, uint8_t* out, size_t rawSize)
+    {
+        const uint8_t* end = in + size;
+        size_t position = 0;
+
+        while (in < end)
+        {
+            uint8_t token = *in++;
+
+            size_t literalLength = token >> 4;
+            if (literalLength == 15 && !readLength(in, end, literalLength))
+            {
+                return false;
+            }
+            if (literalLength > (size_t)(end - in) || literalLength > rawSize - position)
+            {
+                return false;
+            }
+            memcpy(out + position, in, literalLength);
+            in += literalLength;
+            position += literalLength;
+
+            if (in == end)
+            {
+                break;
+            }
+
+            if (end - in < 2)
+            {
+                return false;
+            }
+            size_t offset = in[0] | (in[1] << 8);
+            in += 2;
+
+            size_t matchLength = token & 0x0F;
+            if (matchLength == 15 && !readLength(in, end, matchLength))
+            {
+                return false;
+            }
+            matchLength += MinMatch;
+
+            if (offset == 0 || offset > position || matchLength > rawSize - position)
+            {
+                return false;
+            }
+
+            //Byte by byte, since a match may overlap the bytes it is producing
+            const uint8_t* match = out + position - offset;
+            for (size_t k = 0; k < matchLength; k++)
+            {
+                out[position + k] = match[k];
+            }
+            position += matchLength;
+        }
+
+        return position == rawSize;
+    }
+}
+
+bool OCT_Codec::isSupported(uint32_t codec)
+{
+    return codec == None || codec == LZ || codec == DeltaLZ;
+}
+
+size_t OCT_Codec::compress(uint32_t codec, const uint8_t* in, size_t size, std::vector<uint8_t>& out)
+{
+    size_t start = out.size();
+
+    if (codec == LZ)
+    {
+        compressLZ(in, size, out);
+    }
+    else if (codec == DeltaLZ)
+    {
+        std::vector<uint8_t>* buffer = g_delta.get();
+        if (!buffer)
+        {
+            buffer = new std::vector<uint8_t>();
+            g_delta.reset(buffer);
+        }
+        if (buffer->size() < size)
+        {
+            buffer->resize(size);
+        }
+
+        std::vector<uint8_t>& delta = *buffer;
+        uint8_t previous = 0;
+        for (size_t i = 0; i < size; i++)
+        {
+            delta[i] = (uint8_t)(in[i] - previous);
+            previous = in[i];
+        }
+        compressLZ(size ? &delta[0] : in, size, out);
+    }
+    else
+    {
+        out.insert(out.end(), in, in + size);
+    }
+
+    return out.size() - start;
+}
+
+bool OCT_Codec::decompress(uint32_t codec, const uint8_t* in, size_t size, uint8_t* out, size_t rawSize)
+{
+    if (codec == None)
+    {
+        if (size != rawSize)
+        {
+            return false;
+        }
+        memcpy(out, in, size);
+        return true;
+    }
+
+    if (!decompressLZ(in, size, out, rawSize))
+    {
+        return false;
+    }
+
+    if (codec == DeltaLZ)
+    {
+        uint8_t previous = 0;
+        for (size_t i = 0; i < rawSize; i++)
+        {
+            out[i] = (uint8_t)(out[i] + previous);
+            previous = out[i];
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,32 @@
+#ifndef OCT_COMPRESSION
+#define OCT_COMPRESSION
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+//Codecs a client can negotiate with a 'Z' request. Every B-scan is compressed on its own, so chunks can be encoded in parallel and streamed as soon as they are ready
+namespace OCT_Codec
+{
+    enum Codec
+    {
+        //Raw voxels, exactly the old wire format
+        None = 0,
+
+        //Byte oriented LZ77 in the LZ4 block layout. Very fast, and the long runs of dark background collapse into a few matches
+        LZ = 1,
+
+        //Each byte replaced by its difference to the previous one before LZ. Helps on smooth tissue where neighbouring voxels differ by little
+        DeltaLZ = 2
+    };
+
+    bool isSupported(uint32_t codec);
+
+    //Appends the compressed chunk to out and returns its compressed size
+    size_t compress(uint32_t codec, const uint8_t* in, size_t size, std::vector<uint8_t>& out);
+
+    //Decompresses a chunk into exactly rawSize bytes. Returns false on corrupt input
+    bool decompress(uint32_t codec, const uint8_t* in, size_t size, uint8_t* out, size_t rawSize);
+}
+
+#endif
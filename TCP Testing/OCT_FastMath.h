@@ -0,0 +1,55 @@
+#ifndef OCT_FASTMATH
+#define OCT_FASTMATH
+
+//log2 and 2^x of 4 floats at once, shared by the processing of the A-scans and the averaging of repeated B-scans so both come out of the very same dB conversion.
+//OCT_SSE2 is defined wherever SSE2 can be assumed; without it the callers fall back to plain C++
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define OCT_SSE2
+#include <emmintrin.h>
+
+namespace OCT_FastMath
+{
+    //log2 to about 1e-7: the exponent straight out of the bits, and the log of the mantissa, brought into [sqrt(0.5), sqrt(2)), from the atanh series of s = (m - 1) / (m + 1), which converges fast there. Exactly 0 at 1
+    inline __m128 log2Lanes(__m128 x)
+    {
+        const __m128i bits = _mm_castps_si128(x);
+        __m128i exponent = _mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127));
+        __m128 mantissa = _mm_or_ps(_mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(0x007FFFFF))), _mm_set1_ps(1.0f));
+
+        const __m128 big = _mm_cmpgt_ps(mantissa, _mm_set1_ps(1.41421356f));
+        mantissa = _mm_or_ps(_mm_and_ps(big, _mm_mul_ps(mantissa, _mm_set1_ps(0.5f))), _mm_andnot_ps(big, mantissa));
+        exponent = _mm_sub_epi32(exponent, _mm_castps_si128(big));
+
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 s = _mm_div_ps(_mm_sub_ps(mantissa, one), _mm_add_ps(mantissa, one));
+        const __m128 s2 = _mm_mul_ps(s, s);
+        __m128 series = _mm_add_ps(_mm_set1_ps(1.0f / 7.0f), _mm_mul_ps(s2, _mm_set1_ps(1.0f / 9.0f)));
+        series = _mm_add_ps(_mm_set1_ps(1.0f / 5.0f), _mm_mul_ps(s2, series));
+        series = _mm_add_ps(_mm_set1_ps(1.0f / 3.0f), _mm_mul_ps(s2, series));
+        series = _mm_add_ps(one, _mm_mul_ps(s2, series));
+
+        //2 s series is the natural log, and 2 / ln 2 turns it into log2
+        const __m128 log2Mantissa = _mm_mul_ps(_mm_mul_ps(s, series), _mm_set1_ps(2.88539008f));
+        return _mm_add_ps(_mm_cvtepi32_ps(exponent), log2Mantissa);
+    }
+
+    //2^x to about 1e-7 relative: the integer part of x straight into the exponent bits, and the Taylor series of the rest, within half an octave of 0 there. Exactly 1 at 0
+    inline __m128 exp2Lanes(__m128 x)
+    {
+        x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-126.0f)), _mm_set1_ps(126.0f));
+        const __m128i whole = _mm_cvtps_epi32(x);
+        const __m128 f = _mm_sub_ps(x, _mm_cvtepi32_ps(whole));
+
+        __m128 series = _mm_add_ps(_mm_set1_ps(1.33335581e-3f), _mm_mul_ps(f, _mm_set1_ps(1.54035304e-4f)));
+        series = _mm_add_ps(_mm_set1_ps(9.61812911e-3f), _mm_mul_ps(f, series));
+        series = _mm_add_ps(_mm_set1_ps(5.55041087e-2f), _mm_mul_ps(f, series));
+        series = _mm_add_ps(_mm_set1_ps(2.40226507e-1f), _mm_mul_ps(f, series));
+        series = _mm_add_ps(_mm_set1_ps(6.93147181e-1f), _mm_mul_ps(f, series));
+        series = _mm_add_ps(_mm_set1_ps(1.0f), _mm_mul_ps(f, series));
+
+        return _mm_castsi128_ps(_mm_add_epi32(_mm_castps_si128(series), _mm_slli_epi32(whole, 23)));
+    }
+}
+#endif
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef OCT_LAYOUT
+#define OCT_LAYOUT
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <boost/static_assert.hpp>
+
+//One field of a binary message: its type and where it sits. Offsets are fixed at compile time, so read and write come down to a single unaligned load or store, just like the memcpy calls they replace
+template <typename T, size_t Offset>
+struct OCT_Field
+{
+    typedef T Type;
+    static const size_t offset = Offset;
+    static const size_t end = Offset + sizeof(T);
+
+    static T read(const void* message)
+    {
+        T value;
+        memcpy(&value, (const uint8_t*)message + Offset, sizeof(T));
+        return value;
+    }
+
+    static void write(void* message, T value)
+    {
+        memcpy((uint8_t*)message + Offset, &value, sizeof(T));
+    }
+};
+
+//Fails to compile unless field B comes after field A without overlapping it
+#define OCT_LAYOUT_ORDER(A, B) BOOST_STATIC_ASSERT(A::end <= B::offset)
+
+//Params of a 'P', 'S' or 'R' frame, at their offsets in the payload, so the command byte is at 0. The region of interest is optional
+namespace OCT_ParamsLayout
+{
+    typedef OCT_Field<float, 1> XRange;
+    typedef OCT_Field<float, 5> YRange;
+    typedef OCT_Field<float, 9> ZRange;
+    typedef OCT_Field<uint32_t, 13> XSteps;
+    typedef OCT_Field<uint32_t, 17> YSteps;
+    typedef OCT_Field<uint32_t, 21> ZSteps;
+    typedef OCT_Field<float, 25> XOffset;
+    typedef OCT_Field<float, 29> YOffset;
+
+    typedef OCT_Field<uint32_t, 33> XStart;
+    typedef OCT_Field<uint32_t, 37> XCount;
+    typedef OCT_Field<uint32_t, 41> YStart;
+    typedef OCT_Field<uint32_t, 45> YCount;
+    typedef OCT_Field<uint32_t, 49> ZStart;
+    typedef OCT_Field<uint32_t, 53> ZCount;
+
+    //Payload sizes without and with the region of interest
+    const size_t Size = YOffset::end;
+    const size_t CropSize = ZCount::end;
+
+    OCT_LAYOUT_ORDER(XRange, YRange);
+    OCT_LAYOUT_ORDER(YRange, ZRange);
+    OCT_LAYOUT_ORDER(ZRange, XSteps);
+    OCT_LAYOUT_ORDER(XSteps, YSteps);
+    OCT_LAYOUT_ORDER(YSteps, ZSteps);
+    OCT_LAYOUT_ORDER(ZSteps, XOffset);
+    OCT_LAYOUT_ORDER(XOffset, YOffset);
+    OCT_LAYOUT_ORDER(YOffset, XStart);
+    OCT_LAYOUT_ORDER(XStart, XCount);
+    OCT_LAYOUT_ORDER(XCount, YStart);
+    OCT_LAYOUT_ORDER(YStart, YCount);
+    OCT_LAYOUT_ORDER(YCount, ZStart);
+    OCT_LAYOUT_ORDER(ZStart, ZCount);
+}
+
+//The 512 byte header in front of every volume. The fields up to 100 are those of the .img files of the GUI software, the rest sit in bytes it leaves unused
+namespace OCT_HeaderLayout
+{
+    //Written into Version by this server. Goes up whenever a field is added or changes meaning, so clients can tell which of them to expect
+    const uint32_t CurrentVersion = 3;
+
+    //Counts of the voxels sent along each axis: B-scans, A-scans per B-scan and depths per A-scan
+    typedef OCT_Field<uint32_t, 16> YCount;
+    typedef OCT_Field<uint32_t, 20> XCount;
+    typedef OCT_Field<uint32_t, 24> ZCount;
+
+    //Size of the scanned region and the position of its center
+    typedef OCT_Field<float, 72> ScanWidth;
+    typedef OCT_Field<float, 76> ScanLength;
+    typedef OCT_Field<float, 80> ScanDepth;
+    typedef OCT_Field<float, 84> XOffset;
+    typedef OCT_Field<float, 88> YOffset;
+
+    //Compression of the voxels that follow: one of OCT_Codec, the number of chunks and the raw bytes per chunk
+    typedef OCT_Field<uint32_t, 100> Codec;
+    typedef OCT_Field<uint32_t, 104> Chunks;
+    typedef OCT_Field<uint32_t, 108> ChunkSize;
+
+    //One of OCT_Voxel::Format and its size
+    typedef OCT_Field<uint32_t, 112> Format;
+    typedef OCT_Field<uint32_t, 116> BytesPerVoxel;
+
+    //Where the region of interest lies in the full scan
+    typedef OCT_Field<uint32_t, 120> XStart;
+    typedef OCT_Field<uint32_t, 124> YStart;
+    typedef OCT_Field<uint32_t, 128> ZStart;
+    typedef OCT_Field<uint32_t, 132> XSteps;
+    typedef OCT_Field<uint32_t, 136> YSteps;
+    typedef OCT_Field<uint32_t, 140> ZSteps;
+
+    //Level of a progressive volume and how many of them there are
+    typedef OCT_Field<uint32_t, 144> Level;
+    typedef OCT_Field<uint32_t, 148> LevelCount;
+
+    //Live B mode: frame number, frames dropped so far and capture time in microseconds since 1970
+    typedef OCT_Field<uint32_t, 152> FrameNumber;
+    typedef OCT_Field<uint32_t, 156> DroppedFrames;
+    typedef OCT_Field<uint64_t, 160> CaptureTime;
+
+    //ID the volume can be fetched again by, and the offset a resumed transfer starts at
+    typedef OCT_Field<uint32_t, 168> VolumeId;
+    typedef OCT_Field<uint64_t, 172> ResumeOffset;
+
+    typedef OCT_Field<uint32_t, 180> Version;
+
+    //Raw spectra only, 0 otherwise: pixels of the camera, spectra in every B-scan that follows and the bits of each 16 bit pixel the camera fills. Added in version 2
+    typedef OCT_Field<uint32_t, 184> CameraPixels;
+    typedef OCT_Field<uint32_t, 188> LineCount;
+    typedef OCT_Field<uint32_t, 192> BitDepth;
+
+    //B-scans acquired at every Y position that each B-scan sent is the average of. Added in version 3
+    typedef OCT_Field<uint32_t, 196> Averaged;
+
+    const size_t Size = 512;
+
+    OCT_LAYOUT_ORDER(YCount, XCount);
+    OCT_LAYOUT_ORDER(XCount, ZCount);
+    OCT_LAYOUT_ORDER(ZCount, ScanWidth);
+    OCT_LAYOUT_ORDER(ScanWidth, ScanLength);
+    OCT_LAYOUT_ORDER(ScanLength, ScanDepth);
+    OCT_LAYOUT_ORDER(ScanDepth, XOffset);
+    OCT_LAYOUT_ORDER(XOffset, YOffset);
+    OCT_LAYOUT_ORDER(YOffset, Codec);
+    OCT_LAYOUT_ORDER(Codec, Chunks);
+    OCT_LAYOUT_ORDER(Chunks, ChunkSize);
+    OCT_LAYOUT_ORDER(ChunkSize, Format);
+    OCT_LAYOUT_ORDER(Format, BytesPerVoxel);
+    OCT_LAYOUT_ORDER(BytesPerVoxel, XStart);
+    OCT_LAYOUT_ORDER(XStart, YStart);
+    OCT_LAYOUT_ORDER(YStart, ZStart);
+    OCT_LAYOUT_ORDER(ZStart, XSteps);
+    OCT_LAYOUT_ORDER(XSteps, YSteps);
+    OCT_LAYOUT_ORDER(YSteps, ZSteps);
+    OCT_LAYOUT_ORDER(ZSteps, Level);
+    OCT_LAYOUT_ORDER(Level, LevelCount);
+    OCT_LAYOUT_ORDER(LevelCount, FrameNumber);
+    OCT_LAYOUT_ORDER(FrameNumber, DroppedFrames);
+    OCT_LAYOUT_ORDER(DroppedFrames, CaptureTime);
+    OCT_LAYOUT_ORDER(CaptureTime, VolumeId);
+    OCT_LAYOUT_ORDER(VolumeId, ResumeOffset);
+    OCT_LAYOUT_ORDER(ResumeOffset, Version);
+    OCT_LAYOUT_ORDER(Version, CameraPixels);
+    OCT_LAYOUT_ORDER(CameraPixels, LineCount);
+    OCT_LAYOUT_ORDER(LineCount, BitDepth);
+    OCT_LAYOUT_ORDER(BitDepth, Averaged);
+    BOOST_STATIC_ASSERT(Averaged::end <= Size);
+}
+
+#endif
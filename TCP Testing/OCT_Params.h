@@ -0,0 +1,124 @@
+#ifndef OCT_PARAMS
+#define OCT_PARAMS
+
+#include <stdint.h>
+
+#include <SDOCT.h>
+#include <OCT_Quantize.h>
+
+//Scan geometry requested by one client. Every TCP_Connection keeps its own copy, and it only gets applied to the shared SDOCT right before that client's scan runs
+struct OCT_Params
+{
+    float xrange;
+    float yrange;
+    float zrange;
+    uint32_t xsteps;
+    uint32_t ysteps;
+    uint32_t zsteps;
+    float xoffset;
+    float yoffset;
+
+    //One of OCT_Voxel::Format. Not part of the 'P' and 'S' params, it is the one this client last set with an 'F' request
+    uint32_t format;
+
+    //B-scans acquired at every Y position and averaged into the one sent, for speckle reduction. Not part of the params either, it is the one this client last set with a 'Y' request
+    uint32_t averaging;
+
+    //Region of interest, in voxels of the full scan. Only this part of the scan gets converted and sent, as xcount * ycount * zcount voxels. Optional in the 'P' and 'S' params, where a count of 0 means up to the end
+    uint32_t xstart, xcount;
+    uint32_t ystart, ycount;
+    uint32_t zstart, zcount;
+
+    //Camera the raw spectra come from: its pixels and the bits of each 16 bit pixel it fills. Set by fitToCamera for RawSpectra, 0 for every other format
+    uint32_t cameraPixels;
+    uint32_t bitDepth;
+
+    OCT_Params() : xrange(0), yrange(0), zrange(0), xsteps(0), ysteps(0), zsteps(0), xoffset(0), yoffset(0), format(OCT_Voxel::UInt8), averaging(1),
+        xstart(0), xcount(0), ystart(0), ycount(0), zstart(0), zcount(0), cameraPixels(0), bitDepth(0) {}
+
+    //Fits the region of interest into the steps, so the counts are what the volume will actually hold. Must be called whenever the steps or the region change
+    void clampCrop()
+    {
+        OCT_Voxel::clampWindow(xsteps, xstart, xcount);
+        OCT_Voxel::clampWindow(ysteps, ystart, ycount);
+        OCT_Voxel::clampWindow(zsteps, zstart, zcount);
+    }
+
+    //Number of voxel bytes one B-scan with these params takes
+    size_t bscanSize() const
+    {
+        return (size_t)xcount * zcount * OCT_Voxel::size(format);
+    }
+
+    //Number of voxel bytes a volume scan with these params produces
+    size_t volumeSize() const
+    {
+        return bscanSize() * ycount;
+    }
+
+    //Same scan, geometry, voxel format and region alike
+    bool operator==(const OCT_Params& other) const
+    {
+        return xrange == other.xrange && yrange == other.yrange && zrange == other.zrange && xsteps == other.xsteps && ysteps == other.ysteps && zsteps == other.zsteps && xoffset == other.xoffset && yoffset == other.yoffset && format == other.format && averaging == other.averaging
+            && xstart == other.xstart && xcount == other.xcount && ystart == other.ystart && ycount == other.ycount && zstart == other.zstart && zcount == other.zcount
+            && cameraPixels == other.cameraPixels && bitDepth == other.bitDepth;
+    }
+
+    //Raw spectra have a voxel per camera pixel along z instead of one per depth, so for them zsteps becomes the camera's pixels. A region spanning all depths spans the whole spectra, any other is taken in camera pixels
+    //They are sent as acquired, so they are never averaged either
+    //Does nothing for the other formats. Must only be called while holding the scanner, i.e. from an OCT_Scheduler job, and before the volume gets sized
+    void fitToCamera(SDOCT& oct)
+    {
+        if (format != OCT_Voxel::RawSpectra)
+        {
+            return;
+        }
+
+        const bool wholeDepth = zstart == 0 && zcount == zsteps;
+        cameraPixels = oct.getCameraPixels();
+        bitDepth = oct.getCameraBitDepth();
+        zsteps = cameraPixels;
+        averaging = 1;
+        if (wholeDepth)
+        {
+            zcount = 0;
+        }
+        clampCrop();
+    }
+
+    //Sets the params into the oct. Must only be called while holding the scanner, i.e. from an OCT_Scheduler job
+    void applyTo(SDOCT& oct) const
+    {
+        oct.setXRange(xrange);
+        oct.setYRange(yrange);
+        oct.setZRange(zrange);
+        oct.setXSteps(xsteps);
+        oct.setYSteps(ysteps);
+        oct.setZSteps(zsteps);
+        oct.setXOffset(xoffset);
+        oct.setYOffset(yoffset);
+        oct.setVoxelFormat(format);
+        oct.setAveraging(averaging);
+        oct.setCrop(xstart, xcount, ystart, ycount, zstart, zcount);
+    }
+};
+
+//How one client wants the processed float data mapped onto 8 bit voxels, and onto 16 bit ones scaled up from those. Kept apart from OCT_Params because it persists across scans until the client changes it with an 'A' request
+struct OCT_Window
+{
+    float contrast;
+    float brightness;
+    float dBRange;
+    float maxSigAmplitude;
+
+    //Maps 0..255 dB straight onto 0..255, which is what the plain float to char conversion used to do
+    OCT_Window() : contrast(1.0f), brightness(0.0f), dBRange(255.0f), maxSigAmplitude(255.0f) {}
+
+    //Sets the window into the oct. Must only be called while holding the scanner, i.e. from an OCT_Scheduler job
+    void applyTo(SDOCT& oct) const
+    {
+        oct.setAScanProperties(contrast, brightness, dBRange, maxSigAmplitude);
+    }
+};
+
+#endif
@@ -0,0 +1,528 @@
+#include <OCT_Processor.h>
+
+#include <algorithm>
+#include <complex>
+#include <fstream>
+#include <math.h>
+
+#include <boost/bind.hpp>
+
+#include <OCT_FastMath.h>
+#include <OCT_Trace.h>
+
+namespace
+{
+    const double Pi = 3.14159265358979323846;
+
+    //A-scans per group: 4 lanes, each holding the real and imaginary part of one FFT
+    const uint32_t GroupSize = 8;
+
+    //10 log10(2), for dB out of log2 of the power, and 10 log10(4), for the factor 2 every half of a shared FFT comes out with
+    const float DecibelsPerOctave = 3.01029996f;
+    const float SharedFFTGain = 6.02059991f;
+
+    //Keeps the log of empty frequencies finite
+    const float MinPower = 1e-20f;
+
+#ifdef OCT_SSE2
+    //4 A-scans side by side, one per lane
+    typedef __m128 Lanes;
+
+    inline Lanes lanesSet(float value) { return _mm_set1_ps(value); }
+    inline Lanes lanesSet(float a, float b, float c, float d) { return _mm_setr_ps(a, b, c, d); }
+    inline Lanes lanesLoad(const float* in) { return _mm_loadu_ps(in); }
+    inline void lanesStore(float* out, Lanes value) { _mm_storeu_ps(out, value); }
+    inline Lanes lanesAdd(Lanes a, Lanes b) { return _mm_add_ps(a, b); }
+    inline Lanes lanesSub(Lanes a, Lanes b) { return _mm_sub_ps(a, b); }
+    inline Lanes lanesMul(Lanes a, Lanes b) { return _mm_mul_ps(a, b); }
+    inline void lanesTranspose(Lanes& a, Lanes& b, Lanes& c, Lanes& d) { _MM_TRANSPOSE4_PS(a, b, c, d); }
+
+    inline Lanes lanesLog2(Lanes x) { return OCT_FastMath::log2Lanes(x); }
+#else
+    struct Lanes
+    {
+        float v[4];
+    };
+
+    inline Lanes lanesSet(float a, float b, float c, float d) { Lanes r = { { a, b, c, d } }; return r; }
+    inline Lanes lanesSet(float value) { return lanesSet(value, value, value, value); }
+    inline Lanes lanesLoad(const float* in) { return lanesSet(in[0], in[1], in[2], in[3]); }
+    inline void lanesStore(float* out, Lanes value) { for (int i = 0; i < 4; i++) out[i] = value.v[i]; }
+    inline Lanes lanesAdd(Lanes a, Lanes b) { for (int i = 0; i < 4; i++) a.v[i] += b.v[i]; return a; }
+    inline Lanes lanesSub(Lanes a, Lanes b) { for (int i = 0; i < 4; i++) a.v[i] -= b.v[i]; return a; }
+    inline Lanes lanesMul(Lanes a, Lanes b) { for (int i = 0; i < 4; i++) a.v[i] *= b.v[i]; return a; }
+    inline Lanes lanesLog2(Lanes x) { for (int i = 0; i < 4; i++) x.v[i] = (float)(log(x.v[i]) / log(2.0)); return x; }
+
+    inline void lanesTranspose(Lanes& a, Lanes& b, Lanes& c, Lanes& d)
+    {
+        Lanes rows[4] = { a, b, c, d };
+        a = lanesSet(rows[0].v[0], rows[1].v[0], rows[2].v[0], rows[3].v[0]);
+        b = lanesSet(rows[0].v[1], rows[1].v[1], rows[2].v[1], rows[3].v[1]);
+        c = lanesSet(rows[0].v[2], rows[1].v[2], rows[2].v[2], rows[3].v[2]);
+        d = lanesSet(rows[0].v[3], rows[1].v[3], rows[2].v[3], rows[3].v[3]);
+    }
+#endif
+
+    //dB of the two A-scans sharing the FFT at frequency k, out of it and its mirror frequency. The real part's spectrum is (Z[k] + conj(Z[n - k])) / 2, the imaginary part's (Z[k] - conj(Z[n - k])) / 2i
+    inline void unpack(const float* real, const float* imag, uint32_t k, uint32_t mirror, Lanes& first, Lanes& second)
+    {
+        const Lanes zr = lanesLoad(real + k * 4);
+        const Lanes zi = lanesLoad(imag + k * 4);
+        const Lanes cr = lanesLoad(real + mirror * 4);
+        const Lanes ci = lanesLoad(imag + mirror * 4);
+
+        const Lanes ar = lanesAdd(zr, cr);
+        const Lanes ai = lanesSub(zi, ci);
+        const Lanes br = lanesSub(zr, cr);
+        const Lanes bi = lanesAdd(zi, ci);
+
+        const Lanes minPower = lanesSet(MinPower);
+        const Lanes scale = lanesSet(DecibelsPerOctave);
+        const Lanes gain = lanesSet(SharedFFTGain);
+        first = lanesSub(lanesMul(lanesLog2(lanesAdd(lanesAdd(lanesMul(ar, ar), lanesMul(ai, ai)), minPower)), scale), gain);
+        second = lanesSub(lanesMul(lanesLog2(lanesAdd(lanesAdd(lanesMul(br, br), lanesMul(bi, bi)), minPower)), scale), gain);
+    }
+
+    //Stores 4 depths of 4 A-scans, given one depth per register, as 4 depths per A-scan. Only the A-scans that exist are written
+    inline void storeDepths(Lanes d0, Lanes d1, Lanes d2, Lanes d3, float* const* rows, uint32_t k)
+    {
+        lanesTranspose(d0, d1, d2, d3);
+        const Lanes depths[4] = { d0, d1, d2, d3 };
+        for (int lane = 0; lane < 4; lane++)
+        {
+            if (rows[lane])
+            {
+                lanesStore(rows[lane] + k, depths[lane]);
+            }
+        }
+    }
+
+    //Stores 1 depth of 4 A-scans
+    inline void storeDepth(Lanes value, float* const* rows, uint32_t k)
+    {
+        float lanes[4];
+        lanesStore(lanes, value);
+        for (int lane = 0; lane < 4; lane++)
+        {
+            if (rows[lane])
+            {
+                rows[lane][k] = lanes[lane];
+            }
+        }
+    }
+
+    uint32_t reverseBits(uint32_t value, uint32_t bits)
+    {
+        uint32_t reversed = 0;
+        for (uint32_t i = 0; i < bits; i++)
+        {
+            reversed = (reversed << 1) | ((value >> i) & 1);
+        }
+        return reversed;
+    }
+}
+
+OCT_Processor::OCT_Processor(unsigned int numThreads) : m_pool(std::max(1u, numThreads), "processing"), m_numThreads(std::max(1u, numThreads)),
+    m_pixels(0), m_depths(0), m_fftSize(0), m_fftBits(0), m_pending(0)
+{
+}
+
+OCT_Processor::~OCT_Processor()
+{
+    this->wait();
+}
+
+uint32_t OCT_Processor::fftSizeFor(uint32_t pixels, uint32_t depths)
+{
+    uint32_t size = 2;
+    while (size < pixels || size < 2 * depths)
+    {
+        size *= 2;
+    }
+    return size;
+}
+
+void OCT_Processor::configure(uint32_t pixels, uint32_t depths, const std::vector<float>& chirp)
+{
+    this->wait();
+
+    //Interpolation needs two pixels to go between
+    m_pixels = std::max(pixels, 2u);
+    m_depths = depths;
+    m_fftSize = fftSizeFor(m_pixels, m_depths);
+    m_fftBits = 0;
+    while ((1u << m_fftBits) < m_fftSize)
+    {
+        m_fftBits++;
+    }
+
+    //A chirp for another camera would read past the end of the spectra, so it counts as none
+    const bool linear = chirp.size() != m_pixels;
+    m_index.resize(m_pixels);
+    m_fraction.resize(m_pixels);
+    m_window.resize(m_pixels);
+    for (uint32_t j = 0; j < m_pixels; j++)
+    {
+        float position = linear ? (float)j : chirp[j];
+        position = std::min(std::max(position, 0.0f), (float)(m_pixels - 1));
+        m_index[j] = std::min((uint32_t)position, m_pixels - 2);
+        m_fraction[j] = position - m_index[j];
+
+        //Hann, so the edges of the spectrum don't ring into the neighbouring depths
+        m_window[j] = (float)(0.5 - 0.5 * cos(2.0 * Pi * j / (m_pixels - 1)));
+    }
+
+    m_background.assign(m_pixels, 0.0f);
+    this->updateBackground();
+
+    m_cos.resize(m_fftSize / 2);
+    m_sin.resize(m_fftSize / 2);
+    for (uint32_t k = 0; k < m_fftSize / 2; k++)
+    {
+        m_cos[k] = (float)cos(2.0 * Pi * k / m_fftSize);
+        m_sin[k] = (float)-sin(2.0 * Pi * k / m_fftSize);
+    }
+
+    m_reversed.resize(m_fftSize);
+    for (uint32_t j = 0; j < m_fftSize; j++)
+    {
+        m_reversed[j] = reverseBits(j, m_fftBits);
+    }
+
+    m_zeros.assign(m_pixels, 0);
+
+    m_scratch.resize(m_numThreads);
+    for (size_t i = 0; i < m_scratch.size(); i++)
+    {
+        m_scratch[i].real.assign((size_t)m_fftSize * 4, 0.0f);
+        m_scratch[i].imag.assign((size_t)m_fftSize * 4, 0.0f);
+    }
+}
+
+void OCT_Processor::setBackground(const uint16_t* raw, uint32_t ascans)
+{
+    this->wait();
+
+    if (ascans == 0 || m_pixels == 0)
+    {
+        return;
+    }
+
+    std::vector<double> sums(m_pixels, 0.0);
+    for (uint32_t a = 0; a < ascans; a++)
+    {
+        const uint16_t* spectrum = raw + (size_t)a * m_pixels;
+        for (uint32_t p = 0; p < m_pixels; p++)
+        {
+            sums[p] += spectrum[p];
+        }
+    }
+
+    for (uint32_t p = 0; p < m_pixels; p++)
+    {
+        m_background[p] = (float)(sums[p] / ascans);
+    }
+    this->updateBackground();
+}
+
+void OCT_Processor::updateBackground()
+{
+    m_windowedBackground.resize(m_pixels);
+    for (uint32_t j = 0; j < m_pixels; j++)
+    {
+        const float low = m_background[m_index[j]];
+        const float high = m_background[m_index[j] + 1];
+        m_windowedBackground[j] = (low + (high - low) * m_fraction[j]) * m_window[j];
+    }
+}
+
+uint32_t OCT_Processor::pixels() const
+{
+    return m_pixels;
+}
+
+uint32_t OCT_Processor::depths() const
+{
+    return m_depths;
+}
+
+void OCT_Processor::start(const uint16_t* raw, uint32_t ascans, float* out)
+{
+    this->wait();
+
+    const uint32_t groups = (ascans + GroupSize - 1) / GroupSize;
+    const unsigned int jobs = std::min(m_numThreads, groups);
+    if (jobs == 0 || m_depths == 0)
+    {
+        return;
+    }
+
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        m_pending = jobs;
+    }
+
+    //Contiguous runs of groups, so every thread writes its own stretch of the B-scan
+    for (unsigned int job = 0; job < jobs; job++)
+    {
+        const uint32_t first = (uint32_t)((uint64_t)groups * job / jobs);
+        const uint32_t last = (uint32_t)((uint64_t)groups * (job + 1) / jobs);
+        m_pool.post(boost::bind(&OCT_Processor::run, this, job, raw, ascans, out, first, last));
+    }
+}
+
+void OCT_Processor::wait()
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    while (m_pending > 0)
+    {
+        m_done.wait(lock);
+    }
+}
+
+void OCT_Processor::process(const uint16_t* raw, uint32_t ascans, float* out)
+{
+    this->start(raw, ascans, out);
+    this->wait();
+}
+
+void OCT_Processor::run(unsigned int job, const uint16_t* raw, uint32_t ascans, float* out, uint32_t first, uint32_t last)
+{
+    {
+        OCT_Trace::Scope trace("process", "ascans", (uint64_t)(last - first) * GroupSize);
+        for (uint32_t group = first; group < last; group++)
+        {
+            this->processGroup(m_scratch[job], raw, ascans, group * GroupSize, out);
+        }
+    }
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (--m_pending == 0)
+    {
+        m_done.notify_all();
+    }
+}
+
+void OCT_Processor::processGroup(Scratch& scratch, const uint16_t* raw, uint32_t ascans, uint32_t first, float* out)
+{
+    const uint32_t n = m_fftSize;
+    float* real = &scratch.real[0];
+    float* imag = &scratch.imag[0];
+
+    //Spectra of the group, 0 to 3 going into the real parts and 4 to 7 into the imaginary parts. Missing ones read as zeros and aren't stored
+    const uint16_t* spectra[GroupSize];
+    float* rows[GroupSize];
+    for (uint32_t i = 0; i < GroupSize; i++)
+    {
+        const bool exists = first + i < ascans;
+        spectra[i] = exists ? raw + (size_t)(first + i) * m_pixels : &m_zeros[0];
+        rows[i] = exists ? out + (size_t)(first + i) * m_depths : 0;
+    }
+
+    //Resampled to linear k, background subtracted and windowed, straight into bit reversed order for the FFT
+    for (uint32_t j = 0; j < m_pixels; j++)
+    {
+        const uint32_t p = m_index[j];
+        const Lanes fraction = lanesSet(m_fraction[j]);
+        const Lanes window = lanesSet(m_window[j]);
+        const Lanes background = lanesSet(m_windowedBackground[j]);
+
+        const Lanes lowReal = lanesSet(spectra[0][p], spectra[1][p], spectra[2][p], spectra[3][p]);
+        const Lanes highReal = lanesSet(spectra[0][p + 1], spectra[1][p + 1], spectra[2][p + 1], spectra[3][p + 1]);
+        const Lanes lowImag = lanesSet(spectra[4][p], spectra[5][p], spectra[6][p], spectra[7][p]);
+        const Lanes highImag = lanesSet(spectra[4][p + 1], spectra[5][p + 1], spectra[6][p + 1], spectra[7][p + 1]);
+
+        const uint32_t to = m_reversed[j] * 4;
+        lanesStore(real + to, lanesSub(lanesMul(lanesAdd(lowReal, lanesMul(lanesSub(highReal, lowReal), fraction)), window), background));
+        lanesStore(imag + to, lanesSub(lanesMul(lanesAdd(lowImag, lanesMul(lanesSub(highImag, lowImag), fraction)), window), background));
+    }
+
+    //Zero padding up to the FFT size
+    const Lanes zero = lanesSet(0.0f);
+    for (uint32_t j = m_pixels; j < n; j++)
+    {
+        const uint32_t to = m_reversed[j] * 4;
+        lanesStore(real + to, zero);
+        lanesStore(imag + to, zero);
+    }
+
+    //Radix 2 decimation in time, in place. Every butterfly works on the 4 FFTs of the group at once
+    for (uint32_t size = 2, step = n / 2; size <= n; size *= 2, step /= 2)
+    {
+        const uint32_t half = size / 2;
+        for (uint32_t k = 0; k < half; k++)
+        {
+            const Lanes wr = lanesSet(m_cos[k * step]);
+            const Lanes wi = lanesSet(m_sin[k * step]);
+            for (uint32_t start = k; start < n; start += size)
+            {
+                float* ar = real + start * 4;
+                float* ai = imag + start * 4;
+                float* br = real + (start + half) * 4;
+                float* bi = imag + (start + half) * 4;
+
+                const Lanes xr = lanesLoad(br);
+                const Lanes xi = lanesLoad(bi);
+                const Lanes tr = lanesSub(lanesMul(xr, wr), lanesMul(xi, wi));
+                const Lanes ti = lanesAdd(lanesMul(xr, wi), lanesMul(xi, wr));
+                const Lanes ur = lanesLoad(ar);
+                const Lanes ui = lanesLoad(ai);
+
+                lanesStore(ar, lanesAdd(ur, tr));
+                lanesStore(ai, lanesAdd(ui, ti));
+                lanesStore(br, lanesSub(ur, tr));
+                lanesStore(bi, lanesSub(ui, ti));
+            }
+        }
+    }
+
+    //Log magnitude of the depths asked for, 4 at a time so they can be stored as rows of the A-scans
+    uint32_t k = 0;
+    for (; k + 4 <= m_depths; k += 4)
+    {
+        Lanes a[4], b[4];
+        for (uint32_t i = 0; i < 4; i++)
+        {
+            unpack(real, imag, k + i, (n - (k + i)) & (n - 1), a[i], b[i]);
+        }
+        storeDepths(a[0], a[1], a[2], a[3], rows, k);
+        storeDepths(b[0], b[1], b[2], b[3], rows + 4, k);
+    }
+
+    for (; k < m_depths; k++)
+    {
+        Lanes a, b;
+        unpack(real, imag, k, (n - k) & (n - 1), a, b);
+        storeDepth(a, rows, k);
+        storeDepth(b, rows + 4, k);
+    }
+}
+
+void OCT_Processor::processReference(const uint16_t* raw, uint32_t ascans, float* out) const
+{
+    const uint32_t n = m_fftSize;
+    std::vector<std::complex<double> > spectrum(n);
+
+    for (uint32_t a = 0; a < ascans; a++)
+    {
+        const uint16_t* camera = raw + (size_t)a * m_pixels;
+        std::fill(spectrum.begin(), spectrum.end(), std::complex<double>(0.0, 0.0));
+        for (uint32_t j = 0; j < m_pixels; j++)
+        {
+            const uint32_t p = m_index[j];
+            const double value = camera[p] - m_background[p] + (camera[p + 1] - m_background[p + 1] - camera[p] + m_background[p]) * (double)m_fraction[j];
+            spectrum[reverseBits(j, m_fftBits)] = value * m_window[j];
+        }
+
+        for (uint32_t size = 2; size <= n; size *= 2)
+        {
+            for (uint32_t k = 0; k < size / 2; k++)
+            {
+                const std::complex<double> w = std::polar(1.0, -2.0 * Pi * k / size);
+                for (uint32_t start = k; start < n; start += size)
+                {
+                    const std::complex<double> t = w * spectrum[start + size / 2];
+                    spectrum[start + size / 2] = spectrum[start] - t;
+                    spectrum[start] += t;
+                }
+            }
+        }
+
+        for (uint32_t k = 0; k < m_depths; k++)
+        {
+            out[(size_t)a * m_depths + k] = (float)(10.0 * log10(std::norm(spectrum[k]) + MinPower / 4.0));
+        }
+    }
+}
+
+std::vector<float> OCT_Processor::readChirp(const std::string& path)
+{
+    std::vector<float> chirp;
+    std::ifstream file(path.c_str());
+    float position;
+    while (file >> position)
+    {
+        chirp.push_back(position);
+    }
+    return chirp;
+}
+
+std::vector<float> OCT_Processor::syntheticChirp(uint32_t pixels)
+{
+    //Bends by up to 2.5% of the spectrum in the middle and stays put at both ends, never folding back on itself
+    std::vector<float> chirp(pixels);
+    const double last = pixels > 1 ? pixels - 1 : 1;
+    for (uint32_t j = 0; j < pixels; j++)
+    {
+        chirp[j] = (float)(j + 0.1 * j * (last - j) / last);
+    }
+    return chirp;
+}
+
+void OCT_Processor::synthesizeSpectra(uint16_t* raw, uint32_t pixels, uint32_t ascans, uint32_t fftSize, const std::vector<float>& chirp, uint32_t bscan)
+{
+    //Linear k sample every camera pixel lies at, by walking the chirp backwards, and the source spectrum there
+    std::vector<double> k(pixels);
+    std::vector<double> source(pixels);
+    const bool linear = chirp.size() != pixels;
+    uint32_t j = 0;
+    for (uint32_t p = 0; p < pixels; p++)
+    {
+        if (linear)
+        {
+            k[p] = p;
+        }
+        else
+        {
+            while (j + 2 < pixels && chirp[j + 1] <= p)
+            {
+                j++;
+            }
+            const double width = chirp[j + 1] - chirp[j];
+            k[p] = j + (width > 0.0 ? (p - chirp[j]) / width : 0.0);
+        }
+
+        const double envelope = (k[p] - pixels * 0.5) / (pixels * 0.25);
+        source[p] = 1500.0 * exp(-envelope * envelope);
+    }
+
+    //Depths of the layers below the surface as fractions of all depths, and how much each one reflects
+    const double layers[3] = { 0.0, 0.1, 0.25 };
+    const double reflectivity[3] = { 0.3, 0.15, 0.08 };
+    const double depthRange = fftSize / 2.0;
+
+    //The surface lies at whole depths between these. The interference of all layers for each of them is only worked out the first time an A-scan needs it, which saves most of the cosines
+    const uint32_t shallowest = (uint32_t)(0.1 * depthRange);
+    const uint32_t deepest = (uint32_t)(0.2 * depthRange + 1.0);
+    std::vector<float> interference((size_t)(deepest - shallowest + 1) * pixels);
+    std::vector<bool> computed(deepest - shallowest + 1, false);
+
+    for (uint32_t a = 0; a < ascans; a++)
+    {
+        //A wavy surface that drifts from one B-scan to the next
+        const uint32_t surface = (uint32_t)((0.15 + 0.05 * sin(2.0 * Pi * a / std::max(ascans, 1u) + bscan * 0.1)) * depthRange + 0.5);
+        float* modulation = &interference[(size_t)(surface - shallowest) * pixels];
+        if (!computed[surface - shallowest])
+        {
+            for (uint32_t p = 0; p < pixels; p++)
+            {
+                double value = 1.0;
+                for (int l = 0; l < 3; l++)
+                {
+                    const double depth = surface + (uint32_t)(layers[l] * depthRange);
+                    value += reflectivity[l] * cos(2.0 * Pi * depth * k[p] / fftSize);
+                }
+                modulation[p] = (float)value;
+            }
+            computed[surface - shallowest] = true;
+        }
+
+        //200 counts of dark offset, on a 12 bit camera
+        uint16_t* spectrum = raw + (size_t)a * pixels;
+        for (uint32_t p = 0; p < pixels; p++)
+        {
+            const double counts = 200.0 + source[p] * modulation[p];
+            spectrum[p] = (uint16_t)std::min(std::max(counts + 0.5, 0.0), 4095.0);
+        }
+    }
+}
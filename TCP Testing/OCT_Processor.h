@@ -0,0 +1,112 @@
+#ifndef OCT_PROCESSOR
+#define OCT_PROCESSOR
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <OCT_WorkerPool.h>
+
+//Turns raw camera spectra into the processed dB A-scans captureVolScan converts into voxels, in place of the SDK's executeProcessing: background subtraction, resampling from camera pixels to linear k, windowing, FFT and log magnitude
+//A-scans go through in groups of 8. Two of them share each complex FFT, one as its real part and one as its imaginary part, and every stage works on the 4 pairs of a group at once, one per SSE2 lane, so the FFT butterflies never have to shuffle anything. Plain C++ takes over on CPUs without SSE2
+//The groups of a B-scan are split over a pool of threads of its own, and start returns right away, so the device can acquire the next B-scan while the last one is being processed on every core
+class OCT_Processor
+{
+private:
+    //Per job buffers, so the threads never share anything they write
+    struct Scratch
+    {
+        //Spectra of the group in bit reversed order, then their FFT, 4 lanes per frequency
+        std::vector<float> real;
+        std::vector<float> imag;
+    };
+
+    OCT_WorkerPool m_pool;
+    unsigned int m_numThreads;
+
+    uint32_t m_pixels;
+    uint32_t m_depths;
+    uint32_t m_fftSize;
+    uint32_t m_fftBits;
+
+    //Per linear k sample: camera pixel interpolated from and its weight, window and the windowed background interpolated the same way
+    std::vector<uint32_t> m_index;
+    std::vector<float> m_fraction;
+    std::vector<float> m_window;
+    std::vector<float> m_background;
+    std::vector<float> m_windowedBackground;
+
+    //cos and -sin of 2 pi k / m_fftSize for the first half of k, and where each sample goes in the bit reversed order
+    std::vector<float> m_cos;
+    std::vector<float> m_sin;
+    std::vector<uint32_t> m_reversed;
+
+    //Stands in for the A-scans missing from the last group of a B-scan
+    std::vector<uint16_t> m_zeros;
+
+    std::vector<Scratch> m_scratch;
+
+    //Jobs of the B-scan being processed still running
+    boost::mutex m_mutex;
+    boost::condition_variable m_done;
+    unsigned int m_pending;
+
+public:
+    //Starts numThreads processing threads
+    OCT_Processor(unsigned int numThreads);
+
+    //Waits for the B-scan being processed
+    ~OCT_Processor();
+
+    //Prepares for spectra of pixels camera pixels, turned into A-scans of depths voxels. The FFT is the next power of two that fits both, zero padded
+    //chirp gives for each linear k sample the fractional camera pixel it lies at, as calibrated for the spectrometer. Empty means the camera is linear in k already. The background starts out at 0
+    void configure(uint32_t pixels, uint32_t depths, const std::vector<float>& chirp);
+
+    //Sets the background to the mean of the ascans spectra at raw, which is what the fixed pattern of the reference arm looks like once the sample averages out. Waits for the B-scan being processed first
+    void setBackground(const uint16_t* raw, uint32_t ascans);
+
+    uint32_t pixels() const;
+    uint32_t depths() const;
+
+    //Starts processing ascans spectra of pixels values each, one after the other at raw, into ascans A-scans of depths values each at out. Both have to stay untouched until wait returns
+    //Waits for the B-scan started before, if there is one
+    void start(const uint16_t* raw, uint32_t ascans, float* out);
+
+    //Blocks until the B-scan given to start is done. Returns at once if there is none
+    void wait();
+
+    //start and wait in one
+    void process(const uint16_t* raw, uint32_t ascans, float* out);
+
+    //The same processing one A-scan at a time in plain double precision C++, as reference for the fast version
+    void processReference(const uint16_t* raw, uint32_t ascans, float* out) const;
+
+    //Reads a chirp for configure from a text file of one camera pixel position per linear k sample. Returns an empty chirp if the file can't be read
+    static std::vector<float> readChirp(const std::string& path);
+
+    //Chirp of a made up spectrometer, a mild quadratic away from linear k, for synthesizeSpectra
+    static std::vector<float> syntheticChirp(uint32_t pixels);
+
+    //Fills raw with ascans spectra of pixels values each as a camera behind chirp would see them: a gaussian source spectrum over a background offset, modulated by a few layers whose depth changes with the A-scan and with bscan
+    //Layers are placed in voxels of an FFT of fftSize, so the processed A-scans show them at known depths
+    static void synthesizeSpectra(uint16_t* raw, uint32_t pixels, uint32_t ascans, uint32_t fftSize, const std::vector<float>& chirp, uint32_t bscan);
+
+    //FFT size configure picks for pixels and depths
+    static uint32_t fftSizeFor(uint32_t pixels, uint32_t depths);
+
+private:
+    //Job of one thread: groups first to last of the B-scan
+    void run(unsigned int job, const uint16_t* raw, uint32_t ascans, float* out, uint32_t first, uint32_t last);
+
+    //Processes the A-scans of one group, from first on, of which there may be less than 8 at the end of a B-scan
+    void processGroup(Scratch& scratch, const uint16_t* raw, uint32_t ascans, uint32_t first, float* out);
+
+    //Windows the background into m_windowedBackground
+    void updateBackground();
+};
+
+#endif
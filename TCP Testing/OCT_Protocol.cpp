@@ -0,0 +1,72 @@
+#include <OCT_Protocol.h>
+
+#include <string.h>
+
+void OCT_Protocol::readParams(const char* paramMessage, size_t length, OCT_Params& params)
+{
+    //Stored in the params, they only reach the oct when this request's scan runs
+    params.xrange = OCT_ParamsLayout::XRange::read(paramMessage);
+    params.yrange = OCT_ParamsLayout::YRange::read(paramMessage);
+    params.zrange = OCT_ParamsLayout::ZRange::read(paramMessage);
+    params.xsteps = OCT_ParamsLayout::XSteps::read(paramMessage);
+    params.ysteps = OCT_ParamsLayout::YSteps::read(paramMessage);
+    params.zsteps = OCT_ParamsLayout::ZSteps::read(paramMessage);
+    params.xoffset = OCT_ParamsLayout::XOffset::read(paramMessage);
+    params.yoffset = OCT_ParamsLayout::YOffset::read(paramMessage);
+
+    //The region of interest is optional. Without it the whole scan is sent
+    if (length == OCT_Protocol::CropParamsFrameSize)
+    {
+        params.xstart = OCT_ParamsLayout::XStart::read(paramMessage);
+        params.xcount = OCT_ParamsLayout::XCount::read(paramMessage);
+        params.ystart = OCT_ParamsLayout::YStart::read(paramMessage);
+        params.ycount = OCT_ParamsLayout::YCount::read(paramMessage);
+        params.zstart = OCT_ParamsLayout::ZStart::read(paramMessage);
+        params.zcount = OCT_ParamsLayout::ZCount::read(paramMessage);
+    }
+    params.clampCrop();
+}
+
+void OCT_Protocol::writeHeader(uint8_t* header, const OCT_Params& params)
+{
+    //Header size is 512 bytes in total. Everything not filled below stays NULL
+    memset(header, 0, OCT_HeaderLayout::Size);
+ 
+    //Only the counts and sizes are used by the client application, but the 512 byte size is kept in case other parameters start being used in the future
+    //They describe the region of interest that is actually sent, so a cropped volume reads like a smaller scan of just that region
+    OCT_HeaderLayout::YCount::write(header, params.ycount);
+    OCT_HeaderLayout::XCount::write(header, params.xcount);
+    OCT_HeaderLayout::ZCount::write(header, params.zcount);
+    OCT_HeaderLayout::ScanWidth::write(header, params.xsteps ? params.xrange * params.xcount / params.xsteps : params.xrange);
+    OCT_HeaderLayout::ScanLength::write(header, params.ysteps ? params.yrange * params.ycount / params.ysteps : params.yrange);
+ 
+    //These aren't built by the standard .img files, but are also packed for sake of completeness
+    //The offsets are those of the center of the scan, so they move along with the center of the region
+    OCT_HeaderLayout::ScanDepth::write(header, params.zsteps ? params.zrange * params.zcount / params.zsteps : params.zrange);
+    OCT_HeaderLayout::XOffset::write(header, params.xsteps ? params.xoffset + params.xrange * ((params.xstart + params.xcount * 0.5f) / params.xsteps - 0.5f) : params.xoffset);
+    OCT_HeaderLayout::YOffset::write(header, params.ysteps ? params.yoffset + params.yrange * ((params.ystart + params.ycount * 0.5f) / params.ysteps - 0.5f) : params.yoffset);
+
+    //Voxel type, so the header describes the data that follows. Nothing the GUI software writes uses these bytes
+    OCT_HeaderLayout::Format::write(header, params.format);
+    OCT_HeaderLayout::BytesPerVoxel::write(header, (uint32_t)OCT_Voxel::size(params.format));
+
+    //Where the region of interest lies in the full scan
+    OCT_HeaderLayout::XStart::write(header, params.xstart);
+    OCT_HeaderLayout::YStart::write(header, params.ystart);
+    OCT_HeaderLayout::ZStart::write(header, params.zstart);
+    OCT_HeaderLayout::XSteps::write(header, params.xsteps);
+    OCT_HeaderLayout::YSteps::write(header, params.ysteps);
+    OCT_HeaderLayout::ZSteps::write(header, params.zsteps);
+
+    //What a client needs to process the raw spectra on its own. ZStart and ZCount already say which of the camera's pixels were sent
+    if (params.format == OCT_Voxel::RawSpectra)
+    {
+        OCT_HeaderLayout::CameraPixels::write(header, params.cameraPixels);
+        OCT_HeaderLayout::LineCount::write(header, params.xcount);
+        OCT_HeaderLayout::BitDepth::write(header, params.bitDepth);
+    }
+
+    OCT_HeaderLayout::Averaged::write(header, params.averaging);
+
+    OCT_HeaderLayout::Version::write(header, OCT_HeaderLayout::CurrentVersion);
+}
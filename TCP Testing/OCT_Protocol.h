@@ -0,0 +1,155 @@
+#ifndef OCT_PROTOCOL
+#define OCT_PROTOCOL
+
+#include <vector>
+#include <stdint.h>
+
+#include <OCT_Layout.h>
+#include <OCT_Params.h>
+
+//Every request from a client is a frame: a 4 byte length (native byte order, like the rest of the params) followed by that many bytes of payload. The payload starts with the command byte
+//Clients can send several frames back to back without waiting for the replies. They are run in order and their replies are sent in the same order
+//Every field of the params and of the volume header is described in OCT_Layout.h. Headers carry the version of that layout in bytes 180 to 184
+//  'P' + 32 bytes of params: Volume scan, sent once complete as 512 byte header + voxels
+//                            The params may be followed by 24 more bytes: the region of interest as x start, x count, y start, y count, z start and z count, all uint32 in voxels, where a count of 0 means up to the end
+//                            Only that region is converted and sent. The header then has its counts as steps and the ranges and offsets of the region, with the start and the full steps of each axis in bytes 120 to 140
+//  'S' + 32 bytes of params: Volume scan, streamed B-scan by B-scan while it is being acquired. Same bytes on the wire as 'P'
+//  'N' + 1 byte count + that many 57 byte 'P' payloads: Batch of volume scans, each one the command byte 'P', params and region of interest like a 'P' with a region, where counts of 0 mean the whole scan
+//                            The scans run back to back on the scanner without waiting for any of them to be sent, so parameter changes cost no round trip and leave the device no idle gap. Every volume goes out like the reply to its 'P', in order, as soon as it is captured and the one before it is sent
+//                            A client that falls more than 512 MB of volumes behind pauses the rest of its batch until it catches up, so the device only idles for clients that don't keep up
+//  'R' + params like 'P'    : Progressive volume scan. Once captured, the volume goes out as several levels, coarsest first, each one a volume of its own (512 byte header + voxels, compressed like any other) averaging 2x2x2 voxels of the next
+//                            The header of every level has its level and the number of levels in bytes 144 and 148. Level 0, the full volume, always comes last
+//                            Every 'P', 'S' and 'R' volume, each of its levels included, carries an ID in bytes 168 to 172 of its header, by which it can be fetched again with a 'G'
+//  'G' + 4 byte ID         : Fetches a volume captured earlier from the cache instead of scanning, as 512 byte header + voxels like a 'P'. An ID of 0 fetches the newest volume. Only the last few volumes are kept. One that isn't there anymore gets a header with steps of 0
+//                            The ID may be followed by params like those of a 'P', in which case only a volume captured with exactly those params, and the voxel format set by 'F', is sent
+//  'V' + 4 byte ID + 8 byte offset: Resumes a transfer that broke off, like that of a dropped connection, by fetching a cached volume from a byte offset on. Offsets count the bytes of the volume as 512 byte header + voxels, uncompressed, and only the bytes from the offset on are sent, after the header
+//                            The header always comes first again, with the offset the voxels start at in bytes 172 to 180 (uint64). That is the offset asked for, except with compression, where it goes back to the start of its B-scan so the first chunk is a whole one, and the chunk count only counts the chunks sent
+//                            A volume that isn't cached anymore gets a header with steps of 0, like a 'G'
+//  'X'                     : Cancels the rest of the progressive volume being sent, if there is one. It is not queued but acted on right away. The level being sent is finished, then an empty level 0, with steps of 0, ends the reply
+//                            A volume still being acquired counts too. None of its levels are sent then, only the empty level 0 once the scan is done
+//  'Q'                     : Query. Replies with the 512 byte header for the params set by the last 'P' or 'S'
+//  'M'                     : Replies with the statistics of the buffer pool as 8 uint64: hits, misses, misses not kept in the pool, buffers kept, buffers in use, the bytes they reserve, the bytes they may reserve and the free buffers released to stay within that
+//  'T'                     : Replies with the timeline of the last few thousand B-scans as a 4 byte length followed by that many bytes of Chrome trace JSON, to be saved and opened in chrome://tracing or ui.perfetto.dev
+//  'D'                     : Replies with the statistics of the recorder as 8 uint64: volumes recorded, skipped because the disk fell behind, and lost to write errors, volumes being written, bytes written, bytes waiting to be written, the most that ever waited and microseconds spent writing
+//  'Z' + 1 byte codec      : Asks for every later volume of this client to be compressed with one of OCT_Codec. Replies with 1 byte, the codec granted, which is None if the requested one isn't supported
+//                            A compressed volume keeps the 512 byte header, with the codec, the number of chunks and the raw bytes per chunk in the otherwise unused bytes 100, 104 and 108. Then follows one chunk per B-scan: its compressed size as 4 bytes and the compressed bytes
+//  'F' + 1 byte format      : Asks for every later volume of this client to be captured as one of OCT_Voxel::Format. Replies with 1 byte, the format granted, which is UInt8 if the requested one isn't supported
+//                            Every volume header carries its format and bytes per voxel in the otherwise unused bytes 112 and 116, so voxels are ysteps * xsteps * zsteps of the header * that many bytes
+//                            RawSpectra sends the camera's spectra unprocessed, for clients that process them on their own. z then counts camera pixels: a region spanning all depths of the params gets the whole spectra, any other picks pixels
+//                            Their headers have the camera pixels, the spectra per B-scan and the bits used of each 16 bit pixel in bytes 184, 188 and 192. A 'G' with params never matches them, as the pixels are only known once scanned, so they are fetched by ID
+//  'Y' + 1 byte count       : Asks for every later volume of this client to have that many B-scans acquired at every Y position and averaged on the server, for speckle reduction, so only one of them is sent. 0 counts as 1. Replies with 1 byte, the count granted
+//                            The power of the B-scans is averaged, which is then sent in dB like any other B-scan. The scan takes count times as long, but the volume is as large as without averaging. Headers carry the count in bytes 196 to 200. Raw spectra are never averaged
+//  'U' + 1 byte flag       : Subscribes (1) or unsubscribes (0). A subscriber also receives every volume captured for the other clients, as 512 byte header + voxels, in between the replies to its own requests
+//  'A' + 16 bytes         : Contrast, brightness, dB range and max signal amplitude as 4 floats, used by every later scan of this client to map the processed data onto 8 and 16 bit voxels
+//  'O'                     : Opens the device ahead of the next scan. It then stays open until the idle timeout
+//  'C'                     : Closes the device now instead of waiting for the idle timeout
+//  'B' + 4 byte float rate + params like 'P': Live B mode. Captures single B-scans over and over at the rate in frames per second, or as fast as the device allows, until a 'B' with a rate of 0 or less, or NaN, stops it. Other rates are clamped to 0.01 to 1000. ysteps is always 1, the rest of the params and the crop apply as for 'P'
+//                            Every frame goes out as 512 byte header + voxels in between the replies to other requests, which keep working meanwhile. The voxel window and format are those set when the stream was started
+//                            A client that can't keep up only ever gets the newest frame, the older ones waiting are dropped. The socket's send buffer shrinks to about a frame meanwhile, and live clients should keep their receive buffer small too, or frames wait in there instead. Headers carry the frame number, the frames dropped so far and the capture time in microseconds since 1970 (server clock, uint64) in bytes 152, 156 and 160
+namespace OCT_Protocol
+{
+    //TCP port the server listens on
+    const unsigned short Port = 12345;
+
+    //Size of the length prefix of every frame
+    const size_t FrameHeaderSize = sizeof(uint32_t);
+
+    //Largest payload accepted. Anything bigger is treated as a corrupt stream and drops the connection
+    const size_t MaxFrameSize = 64 * 1024;
+
+    //Size of the payload of a 'P' or 'S' frame: the command byte plus the 8 4-byte params, optionally followed by 6 4-byte values for the region of interest
+    const size_t ParamsFrameSize = OCT_ParamsLayout::Size;
+    const size_t CropParamsFrameSize = OCT_ParamsLayout::CropSize;
+
+    //Scans an 'N' frame may hold
+    const size_t MaxBatchScans = 64;
+
+    //Bytes of captured 'N' volumes that may wait to be sent to a client. Once there are more, the scanner leaves the rest of the batch until the client has caught up and serves the other clients meanwhile. At least one volume is always captured
+    const size_t MaxBatchAhead = 512 * 1024 * 1024;
+
+    //Size of the rate that comes before the params in a 'B' frame
+    const size_t RateSize = sizeof(float);
+
+    //Rates a 'B' is kept within, in frames per second. Slower ones get one frame every 100 s, faster ones, infinity included, a frame every millisecond at most
+    const float MinLiveRate = 0.01f;
+    const float MaxLiveRate = 1000.0f;
+
+    //Size of the payload of an 'A' frame: the command byte plus 4 floats
+    const size_t WindowFrameSize = 1 + 16;
+
+    //Requests a connection queues before it stops reading from its socket until some of them are done
+    const size_t MaxPendingRequests = 64;
+
+    //Published volumes a subscriber may have waiting. When a slow subscriber falls further behind, its oldest waiting volume is dropped so it never holds up the scanner or the other clients
+    const size_t MaxQueuedVolumes = 2;
+
+    //Initial size of the reusable read buffer of each connection
+    const size_t ReadBufferSize = 4096;
+
+    //A progressive volume gets levels until the coarsest one is no larger than this along any axis, but never more than MaxLevels of them
+    const uint32_t PreviewSize = 64;
+    const unsigned int MaxLevels = 8;
+
+    //Frame buffers of each live stream: the one being sent, the newest one waiting and the one being captured. Frames are only ever captured into a free one, so no frame is allocated while streaming
+    const size_t LiveFrameRing = 3;
+
+    //Entries of the lock-free ring handing streamed B-scans from the scanner thread to the connection. Each entry is a run of consecutive B-scans, so a full ring only means longer runs
+    const size_t ChunkRingSize = 64;
+
+    //Volumes the buffer pool keeps of every size class. Enough for a volume being captured, one being sent and a couple waiting for slow subscribers
+    const size_t PooledBuffersPerClass = 8;
+
+    //Bytes the buffer pool may keep on top of the cache budget, as the cached volumes are pool buffers too. Covers the volumes being captured and sent and those waiting for slow subscribers
+    const size_t PoolBudget = 512 * 1024 * 1024;
+
+    //Spans kept by the trace ring. A handful are recorded per B-scan, so this covers the last few thousand B-scans of every client. A power of two
+    const size_t TraceEvents = 64 * 1024;
+
+    //Size of the ID that comes before the optional params in a 'G' frame
+    const size_t VolumeIdSize = sizeof(uint32_t);
+
+    //Size of the payload of a 'V' frame: the command byte, the ID and the offset
+    const size_t ResumeFrameSize = 1 + VolumeIdSize + sizeof(uint64_t);
+
+    //Volumes kept by the cache, and the bytes their buffers may reserve unless another budget is passed to the server
+    const size_t CachedVolumes = 8;
+    const size_t CacheBudget = 1024 * 1024 * 1024;
+
+    //Captured bytes the recorder may have waiting for the disk. Volumes that would go past it are not recorded
+    const size_t MaxRecordQueue = 512 * 1024 * 1024;
+
+    //Bytes the recorder writes at once. The scanner thread only wakes it up once this much is captured
+    const size_t RecordWriteSize = 4 * 1024 * 1024;
+
+    //Reads the params of a 'P', 'S' or 'R' frame of length bytes, command byte included, with or without the region of interest, and fits the region into the steps
+    void readParams(const char* message, size_t length, OCT_Params& params);
+
+    //Writes the 512 byte header of a volume captured with the params, according to the specifications of the .img files produced by the GUI software, with the intent on using the same pipelines. Only the necessary parameters are filled, the rest is populated with NULLs
+    void writeHeader(uint8_t* header, const OCT_Params& params);
+}
+
+//A parsed request waiting for its turn on its connection
+struct OCT_Request
+{
+    char command;
+    OCT_Params params;
+    OCT_Window window;
+
+    //Single byte argument of the requests that take one, like the flag of a 'U'
+    uint8_t argument;
+
+    //Frames per second of a 'B'
+    float rate;
+
+    //Volume a 'G' or 'V' fetches, and whether it also has to match params
+    uint32_t volumeId;
+    bool matchParams;
+
+    //Byte of the volume a 'V' resumes from
+    uint64_t offset;
+
+    //Params of every scan of an 'N'
+    std::vector<OCT_Params> batch;
+};
+
+#endif
@@ -0,0 +1,59 @@
+#include <OCT_Publisher.h>
+
+#include <TCP_Connection.h>
+
+void OCT_Publisher::subscribe(const boost::shared_ptr<TCP_Connection>& connection)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    unsubscribe_locked(connection.get());
+    m_subscribers.push_back(connection);
+}
+
+void OCT_Publisher::unsubscribe(const TCP_Connection* connection)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    unsubscribe_locked(connection);
+}
+
+void OCT_Publisher::publish(const OCT_VolumePtr& volume, const TCP_Connection* source)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    for (size_t i = 0; i < m_subscribers.size(); )
+    {
+        boost::shared_ptr<TCP_Connection> subscriber = m_subscribers[i].lock();
+
+        //Prunes the clients that have disconnected since the last volume
+        if (!subscriber)
+        {
+            m_subscribers.erase(m_subscribers.begin() + i);
+            continue;
+        }
+
+        if (subscriber.get() != source)
+        {
+            subscriber->deliver_volume(volume);
+        }
+
+        i++;
+    }
+}
+
+void OCT_Publisher::unsubscribe_locked(const TCP_Connection* connection)
+{
+    for (size_t i = 0; i < m_subscribers.size(); )
+    {
+        boost::shared_ptr<TCP_Connection> subscriber = m_subscribers[i].lock();
+
+        if (!subscriber || subscriber.get() == connection)
+        {
+            m_subscribers.erase(m_subscribers.begin() + i);
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef OCT_PUBLISHER
+#define OCT_PUBLISHER
+
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <OCT_Volume.h>
+
+class TCP_Connection;
+
+//Fans every captured volume out to the connections that subscribed with a 'U' request, so one acquisition serves any number of clients. Subscribers get the same OCT_Volume, never a copy, and each one sends it at its own pace
+class OCT_Publisher
+{
+private:
+    boost::mutex m_mutex;
+
+    //Weak, so a dropped client just disappears from the list
+    std::vector<boost::weak_ptr<TCP_Connection> > m_subscribers;
+
+public:
+    void subscribe(const boost::shared_ptr<TCP_Connection>&);
+    void unsubscribe(const TCP_Connection*);
+
+    //Hands the volume to every subscriber except the connection that requested it, which already sends it as its reply. Called from the scanner thread, returns without waiting for any client
+    void publish(const OCT_VolumePtr&, const TCP_Connection* source);
+
+private:
+    //Removes the connection, and any expired one along the way. m_mutex must be held
+    void unsubscribe_locked(const TCP_Connection*);
+};
+
+#endif
@@ -0,0 +1,191 @@
+#include <OCT_Pyramid.h>
+
+#include <algorithm>
+#include <string.h>
+
+#include <OCT_Quantize.h>
+#include <OCT_Trace.h>
+
+OCT_Pyramid::OCT_Pyramid(OCT_BufferPool& pool) : m_pool(pool), m_levelCount(0)
+{
+}
+
+void OCT_Pyramid::reset(const OCT_Params& params, unsigned int levelCount)
+{
+    m_params = params;
+    m_levelCount = levelCount > 0 ? levelCount - 1 : 0;
+    this->release();
+
+    //Only ever grows, so the sums of earlier levels are reused
+    if (m_levels.size() < m_levelCount)
+    {
+        m_levels.resize(m_levelCount);
+    }
+
+    OCT_Params levelParams = params;
+    for (size_t i = 0; i < m_levelCount; i++)
+    {
+        levelParams = downsample(levelParams);
+
+        Level& level = m_levels[i];
+        level.params = levelParams;
+        level.sums.assign((size_t)levelParams.xcount * levelParams.zcount, 0.0f);
+        level.bscan.resize(level.sums.size());
+        level.summed = 0;
+        level.written = 0;
+        level.volume = m_pool.acquire(512 + levelParams.volumeSize());
+        level.volume->params = levelParams;
+        level.volume->message.resize(512 + levelParams.volumeSize());
+    }
+}
+
+void OCT_Pyramid::addBScan(const uint8_t* voxels, size_t size)
+{
+    if (m_levelCount == 0 || size != m_params.bscanSize() || size == 0)
+    {
+        return;
+    }
+
+    OCT_Trace::Scope trace("pyramid");
+
+    //Raw spectra are 16 bit values too. Their averages are coarser spectra, which is as much of a preview as they can have
+    if (m_params.format == OCT_Voxel::UInt16 || m_params.format == OCT_Voxel::RawSpectra)
+    {
+        this->accumulate(0, (const uint16_t*)voxels, m_params.xcount, m_params.zcount);
+    }
+    else if (m_params.format == OCT_Voxel::Float32)
+    {
+        this->accumulate(0, (const float*)voxels, m_params.xcount, m_params.zcount);
+    }
+    else
+    {
+        this->accumulate(0, voxels, m_params.xcount, m_params.zcount);
+    }
+}
+
+void OCT_Pyramid::finish()
+{
+    //Going up, so a B-scan finished here still reaches the level above before that one is checked
+    for (size_t i = 0; i < m_levelCount; i++)
+    {
+        if (m_levels[i].summed > 0)
+        {
+            this->flush(i);
+        }
+    }
+}
+
+void OCT_Pyramid::release()
+{
+    for (size_t i = 0; i < m_levels.size(); i++)
+    {
+        m_levels[i].volume.reset();
+    }
+}
+
+const boost::shared_ptr<OCT_Volume>& OCT_Pyramid::level(unsigned int index) const
+{
+    return m_levels[index - 1].volume;
+}
+
+unsigned int OCT_Pyramid::levelsFor(const OCT_Params& params, uint32_t previewSize, unsigned int maxLevels)
+{
+    if (params.volumeSize() == 0)
+    {
+        return 1;
+    }
+
+    unsigned int levels = 1;
+    OCT_Params levelParams = params;
+    while (levels < maxLevels && std::max(levelParams.xcount, std::max(levelParams.ycount, levelParams.zcount)) > previewSize)
+    {
+        levelParams = downsample(levelParams);
+        levels++;
+    }
+
+    return levels;
+}
+
+OCT_Params OCT_Pyramid::downsample(const OCT_Params& params)
+{
+    OCT_Params level = params;
+    level.xsteps = (params.xsteps + 1) / 2;
+    level.ysteps = (params.ysteps + 1) / 2;
+    level.zsteps = (params.zsteps + 1) / 2;
+    level.xstart = params.xstart / 2;
+    level.ystart = params.ystart / 2;
+    level.zstart = params.zstart / 2;
+    level.xcount = (params.xcount + 1) / 2;
+    level.ycount = (params.ycount + 1) / 2;
+    level.zcount = (params.zcount + 1) / 2;
+    return level;
+}
+
+template <typename T>
+void OCT_Pyramid::accumulate(size_t index, const T* bscan, uint32_t xcount, uint32_t zcount)
+{
+    Level& level = m_levels[index];
+    const uint32_t levelZ = level.params.zcount;
+
+    //Straight through the B-scan, one A-scan after the other. Pairs of depths get added into one sum and pairs of A-scans into the same row of sums. The last A-scan or depth of an odd count counts twice, so every sum always holds 8 voxels
+    for (uint32_t x = 0; x < xcount; x++)
+    {
+        float* sums = &level.sums[(size_t)(x / 2) * levelZ];
+        const T* ascan = bscan + (size_t)x * zcount;
+        const int passes = (x == xcount - 1 && (xcount & 1)) ? 2 : 1;
+
+        for (int pass = 0; pass < passes; pass++)
+        {
+            uint32_t z = 0;
+            for (; z + 1 < zcount; z += 2)
+            {
+                sums[z / 2] += (float)ascan[z] + (float)ascan[z + 1];
+            }
+            if (z < zcount)
+            {
+                sums[z / 2] += 2.0f * (float)ascan[z];
+            }
+        }
+    }
+
+    if (++level.summed == 2)
+    {
+        this->flush(index);
+    }
+}
+
+void OCT_Pyramid::flush(size_t index)
+{
+    Level& level = m_levels[index];
+
+    //A single B-scan left over at the end counts twice, like the odd A-scans and depths
+    const float scale = level.summed == 2 ? 0.125f : 0.25f;
+    const size_t count = level.bscan.size();
+    for (size_t i = 0; i < count; i++)
+    {
+        level.bscan[i] = level.sums[i] * scale;
+    }
+    std::fill(level.sums.begin(), level.sums.end(), 0.0f);
+    level.summed = 0;
+
+    //The averages are voxel values already, so the integer formats only need rounding
+    uint8_t* out = &level.volume->message[512 + level.written * level.params.bscanSize()];
+    if (level.params.format == OCT_Voxel::UInt16 || level.params.format == OCT_Voxel::RawSpectra)
+    {
+        quantizeBScan16(&level.bscan[0], (uint16_t*)out, count, 1.0f, 0.5f);
+    }
+    else if (level.params.format == OCT_Voxel::Float32)
+    {
+        memcpy(out, &level.bscan[0], count * sizeof(float));
+    }
+    else
+    {
+        quantizeBScan(&level.bscan[0], out, count, 1.0f, 0.5f);
+    }
+    level.written++;
+
+    if (index + 1 < m_levelCount)
+    {
+        this->accumulate(index + 1, &level.bscan[0], level.params.xcount, level.params.zcount);
+    }
+}
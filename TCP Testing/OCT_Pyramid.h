@@ -0,0 +1,69 @@
+#ifndef OCT_PYRAMID
+#define OCT_PYRAMID
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <boost/shared_ptr.hpp>
+
+#include <OCT_BufferPool.h>
+#include <OCT_Params.h>
+#include <OCT_Volume.h>
+
+//Builds decimated copies of a volume while it is being captured, for progressive 'R' requests. Every level halves the one below it along x, y and z by averaging 2x2x2 voxels, level 0 being the volume itself
+//Each connection keeps one and resets it for every 'R', so the running sums keep their memory, and the level volumes come from the buffer pool
+//Fed every B-scan straight from captureVolScan, while it is still in cache. Each one is read once and reduced into a running sum a quarter of its size, and a level's B-scan is finished as soon as the two below it are, so the whole pyramid costs about one pass over the volume
+class OCT_Pyramid
+{
+private:
+    //One level above 0. sums gathers the B-scans of the level below until two have arrived, then bscan holds their average to be converted into volume and fed to the next level
+    struct Level
+    {
+        OCT_Params params;
+        std::vector<float> sums;
+        std::vector<float> bscan;
+        uint32_t summed;
+        uint32_t written;
+        boost::shared_ptr<OCT_Volume> volume;
+    };
+
+    OCT_BufferPool& m_pool;
+    OCT_Params m_params;
+    std::vector<Level> m_levels;
+    size_t m_levelCount;
+
+public:
+    OCT_Pyramid(OCT_BufferPool& pool);
+
+    //Prepares levels 1 to levelCount - 1 for a volume captured with params, dropping the levels of the last one
+    void reset(const OCT_Params& params, unsigned int levelCount);
+
+    //Reduces the next B-scan of the volume, in the voxel format of the params, into level 1 and whatever levels above it that completes. Matches BScanHandler
+    void addBScan(const uint8_t* voxels, size_t size);
+
+    //Finishes the B-scans left over by an odd number of them below. Call once captureVolScan has returned
+    void finish();
+
+    //Lets go of the level volumes once they have been handed over, so they can go back to the pool after being sent
+    void release();
+
+    //Volume of level 1 to levelCount - 1, coarsest last. The first 512 bytes of every message are left for the header
+    const boost::shared_ptr<OCT_Volume>& level(unsigned int index) const;
+
+    //Number of levels, counting the volume itself, for the coarsest one to be no bigger than previewSize along any axis. Never more than maxLevels
+    static unsigned int levelsFor(const OCT_Params&, uint32_t previewSize, unsigned int maxLevels);
+
+    //Params of the level above the one captured with params
+    static OCT_Params downsample(const OCT_Params&);
+
+private:
+    //Adds one B-scan of the level below, of xcount A-scans of zcount voxels, to the sums of m_levels[index]
+    template <typename T>
+    void accumulate(size_t index, const T* bscan, uint32_t xcount, uint32_t zcount);
+
+    //Averages the sums of m_levels[index] into its next B-scan, converts it into the level volume and feeds it to the level above
+    void flush(size_t index);
+};
+
+#endif
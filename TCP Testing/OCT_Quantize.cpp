@@ -0,0 +1,292 @@
+#include <OCT_Quantize.h>
+
+#include <string.h>
+
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define OCT_QUANTIZE_SSE2
+#include <emmintrin.h>
+#endif
+
+//AVX2 needs VS2013 or a compiler that can target it per function, and gets picked at runtime
+#if defined(OCT_QUANTIZE_SSE2) && ((defined(_MSC_VER) && _MSC_VER >= 1800) || defined(__GNUC__))
+#define OCT_QUANTIZE_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define OCT_TARGET_AVX2
+#else
+#define OCT_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+void quantizeBScanScalar(const float* in, uint8_t* out, size_t count, float scale, float offset)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        float value = in[i] * scale + offset;
+        value = value < 0.0f ? 0.0f : (value > 255.0f ? 255.0f : value);
+        out[i] = (uint8_t)value;
+    }
+}
+
+void quantizeBScan16Scalar(const float* in, uint16_t* out, size_t count, float scale, float offset)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        float value = in[i] * scale + offset;
+        value = value < 0.0f ? 0.0f : (value > 65535.0f ? 65535.0f : value);
+        out[i] = (uint16_t)value;
+    }
+}
+
+#ifdef OCT_QUANTIZE_SSE2
+//16 voxels per iteration: 4 registers of floats get scaled, clamped, truncated to int32 and packed down to one register of bytes
+static void quantizeBScanSSE2(const float* in, uint8_t* out, size_t count, float scale, float offset)
+{
+    const __m128 vscale = _mm_set1_ps(scale);
+    const __m128 voffset = _mm_set1_ps(offset);
+    const __m128 vmin = _mm_setzero_ps();
+    const __m128 vmax = _mm_set1_ps(255.0f);
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128 a = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(in + i), vscale), voffset);
+        __m128 b = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(in + i + 4), vscale), voffset);
+        __m128 c = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(in + i + 8), vscale), voffset);
+        __m128 d = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(in + i + 12), vscale), voffset);
+
+        a = _mm_min_ps(_mm_max_ps(a, vmin), vmax);
+        b = _mm_min_ps(_mm_max_ps(b, vmin), vmax);
+        c = _mm_min_ps(_mm_max_ps(c, vmin), vmax);
+        d = _mm_min_ps(_mm_max_ps(d, vmin), vmax);
+
+        __m128i ab = _mm_packs_epi32(_mm_cvttps_epi32(a), _mm_cvttps_epi32(b));
+        __m128i cd = _mm_packs_epi32(_mm_cvttps_epi32(c), _mm_cvttps_epi32(d));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(ab, cd));
+    }
+
+    quantizeBScanScalar(in + i, out + i, count - i, scale, offset);
+}
+
+//8 voxels per iteration. SSE2 only packs int32 to signed 16 bit, so the values get shifted down by 32768 before packing and flipped back up afterwards
+static void quantizeBScan16SSE2(const float* in, uint16_t* out, size_t count, float scale, float offset)
+{
+    const __m128 vscale = _mm_set1_ps(scale);
+    const __m128 voffset = _mm_set1_ps(offset);
+    const __m128 vmin = _mm_setzero_ps();
+    const __m128 vmax = _mm_set1_ps(65535.0f);
+    const __m128i bias = _mm_set1_epi32(32768);
+    const __m128i flip = _mm_set1_epi16((short)0x8000);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128 a = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(in + i), vscale), voffset);
+        __m128 b = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(in + i + 4), vscale), voffset);
+
+        a = _mm_min_ps(_mm_max_ps(a, vmin), vmax);
+        b = _mm_min_ps(_mm_max_ps(b, vmin), vmax);
+
+        __m128i ia = _mm_sub_epi32(_mm_cvttps_epi32(a), bias);
+        __m128i ib = _mm_sub_epi32(_mm_cvttps_epi32(b), bias);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_xor_si128(_mm_packs_epi32(ia, ib), flip));
+    }
+
+    quantizeBScan16Scalar(in + i, out + i, count - i, scale, offset);
+}
+#endif
+
+#ifdef OCT_QUANTIZE_AVX2
+//32 voxels per iteration. The packs work within 128 bit lanes, so the 32 bit groups come out as a0 b0 c0 d0 a1 b1 c1 d1 and get put back in order by a final permute
+OCT_TARGET_AVX2 static void quantizeBScanAVX2(const float* in, uint8_t* out, size_t count, float scale, float offset)
+{
+    const __m256 vscale = _mm256_set1_ps(scale);
+    const __m256 voffset = _mm256_set1_ps(offset);
+    const __m256 vmin = _mm256_setzero_ps();
+    const __m256 vmax = _mm256_set1_ps(255.0f);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256 a = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i), vscale), voffset);
+        __m256 b = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i + 8), vscale), voffset);
+        __m256 c = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i + 16), vscale), voffset);
+        __m256 d = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i + 24), vscale), voffset);
+
+        a = _mm256_min_ps(_mm256_max_ps(a, vmin), vmax);
+        b = _mm256_min_ps(_mm256_max_ps(b, vmin), vmax);
+        c = _mm256_min_ps(_mm256_max_ps(c, vmin), vmax);
+        d = _mm256_min_ps(_mm256_max_ps(d, vmin), vmax);
+
+        __m256i ab = _mm256_packs_epi32(_mm256_cvttps_epi32(a), _mm256_cvttps_epi32(b));
+        __m256i cd = _mm256_packs_epi32(_mm256_cvttps_epi32(c), _mm256_cvttps_epi32(d));
+        __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(ab, cd), order);
+        _mm256_storeu_si256((__m256i*)(out + i), bytes);
+    }
+
+    quantizeBScanSSE2(in + i, out + i, count - i, scale, offset);
+}
+
+//16 voxels per iteration, with the same bias as the SSE2 version. The pack leaves the 64 bit groups as a0 b0 a1 b1, put back in order by a permute
+OCT_TARGET_AVX2 static void quantizeBScan16AVX2(const float* in, uint16_t* out, size_t count, float scale, float offset)
+{
+    const __m256 vscale = _mm256_set1_ps(scale);
+    const __m256 voffset = _mm256_set1_ps(offset);
+    const __m256 vmin = _mm256_setzero_ps();
+    const __m256 vmax = _mm256_set1_ps(65535.0f);
+    const __m256i bias = _mm256_set1_epi32(32768);
+    const __m256i flip = _mm256_set1_epi16((short)0x8000);
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256 a = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i), vscale), voffset);
+        __m256 b = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i + 8), vscale), voffset);
+
+        a = _mm256_min_ps(_mm256_max_ps(a, vmin), vmax);
+        b = _mm256_min_ps(_mm256_max_ps(b, vmin), vmax);
+
+        __m256i ia = _mm256_sub_epi32(_mm256_cvttps_epi32(a), bias);
+        __m256i ib = _mm256_sub_epi32(_mm256_cvttps_epi32(b), bias);
+        __m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(ia, ib), 0xD8);
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_xor_si256(words, flip));
+    }
+
+    quantizeBScan16SSE2(in + i, out + i, count - i, scale, offset);
+}
+
+static bool cpuHasAVX2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+    {
+        return false;
+    }
+
+    //AVX2 also needs the OS to save the ymm registers
+    __cpuid(info, 1);
+    if ((info[2] & (1 << 27)) == 0 || (_xgetbv(0) & 6) != 6)
+    {
+        return false;
+    }
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+#endif
+
+void quantizeBScan(const float* in, uint8_t* out, size_t count, float scale, float offset)
+{
+#if defined(OCT_QUANTIZE_AVX2)
+    static const bool hasAVX2 = cpuHasAVX2();
+    if (hasAVX2)
+    {
+        quantizeBScanAVX2(in, out, count, scale, offset);
+        return;
+    }
+#endif
+
+#if defined(OCT_QUANTIZE_SSE2)
+    quantizeBScanSSE2(in, out, count, scale, offset);
+#else
+    quantizeBScanScalar(in, out, count, scale, offset);
+#endif
+}
+
+void quantizeBScan16(const float* in, uint16_t* out, size_t count, float scale, float offset)
+{
+#if defined(OCT_QUANTIZE_AVX2)
+    static const bool hasAVX2 = cpuHasAVX2();
+    if (hasAVX2)
+    {
+        quantizeBScan16AVX2(in, out, count, scale, offset);
+        return;
+    }
+#endif
+
+#if defined(OCT_QUANTIZE_SSE2)
+    quantizeBScan16SSE2(in, out, count, scale, offset);
+#else
+    quantizeBScan16Scalar(in, out, count, scale, offset);
+#endif
+}
+
+bool OCT_Voxel::isSupported(uint32_t format)
+{
+    return format == UInt8 || format == UInt16 || format == Float32 || format == RawSpectra;
+}
+
+size_t OCT_Voxel::size(uint32_t format)
+{
+    switch (format)
+    {
+    case UInt16:
+    case RawSpectra:
+        return sizeof(uint16_t);
+    case Float32:
+        return sizeof(float);
+    default:
+        return sizeof(uint8_t);
+    }
+}
+
+void OCT_Voxel::convertBScan(uint32_t format, const float* in, uint8_t* out, size_t count, float scale, float offset)
+{
+    switch (format)
+    {
+    case UInt16:
+        //The voxels of a volume message start at byte 512 and every B-scan is a whole number of voxels, so out is always aligned for 16 bit
+        quantizeBScan16(in, (uint16_t*)out, count, scale * 257.0f, offset * 257.0f);
+        break;
+    case Float32:
+        memcpy(out, in, count * sizeof(float));
+        break;
+    default:
+        quantizeBScan(in, out, count, scale, offset);
+        break;
+    }
+}
+
+void OCT_Voxel::convertBScanWindow(uint32_t format, const float* in, uint32_t zsteps, uint32_t xstart, uint32_t xcount, uint32_t zstart, uint32_t zcount, uint8_t* out, float scale, float offset)
+{
+    //Whole A-scans are contiguous, so they go through in one call
+    if (zstart == 0 && zcount == zsteps)
+    {
+        convertBScan(format, in + (size_t)xstart * zsteps, out, (size_t)xcount * zsteps, scale, offset);
+        return;
+    }
+
+    const size_t rowSize = zcount * size(format);
+    for (uint32_t x = 0; x < xcount; x++)
+    {
+        convertBScan(format, in + (size_t)(xstart + x) * zsteps + zstart, out + x * rowSize, zcount, scale, offset);
+    }
+}
+
+void OCT_Voxel::copyRawWindow(const uint16_t* in, uint32_t pixels, uint32_t xstart, uint32_t xcount, uint32_t zstart, uint32_t zcount, uint8_t* out)
+{
+    if (zstart == 0 && zcount == pixels)
+    {
+        memcpy(out, in + (size_t)xstart * pixels, (size_t)xcount * pixels * sizeof(uint16_t));
+        return;
+    }
+
+    const size_t rowSize = zcount * sizeof(uint16_t);
+    for (uint32_t x = 0; x < xcount; x++)
+    {
+        memcpy(out + x * rowSize, in + (size_t)(xstart + x) * pixels + zstart, rowSize);
+    }
+}
+
+void OCT_Voxel::clampWindow(uint32_t steps, uint32_t& start, uint32_t& count)
+{
+    start = start < steps ? start : steps;
+    count = (count == 0 || count > steps - start) ? steps - start : count;
+}
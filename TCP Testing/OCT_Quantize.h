@@ -0,0 +1,56 @@
+#ifndef OCT_QUANTIZE
+#define OCT_QUANTIZE
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Converts processed float voxels to 8 bit in one pass: out = clamp(in * scale + offset, 0, 255), truncated like the plain float to char conversion it replaces
+//scale and offset come from SDOCT::setAScanProperties, which folds the dB window, contrast and brightness into them. Uses AVX2 when the CPU has it, SSE2 otherwise and plain C++ on anything else
+void quantizeBScan(const float* in, uint8_t* out, size_t count, float scale, float offset);
+
+//The plain C++ version, used for the tails of the vectorized ones and as reference
+void quantizeBScanScalar(const float* in, uint8_t* out, size_t count, float scale, float offset);
+
+//Same as quantizeBScan for 16 bit voxels: out = clamp(in * scale + offset, 0, 65535)
+void quantizeBScan16(const float* in, uint16_t* out, size_t count, float scale, float offset);
+void quantizeBScan16Scalar(const float* in, uint16_t* out, size_t count, float scale, float offset);
+
+//Voxel types a client can ask its volumes to be captured as. The value is written into the header, so a volume always says what it holds
+namespace OCT_Voxel
+{
+    enum Format
+    {
+        //The 8 bit window of setAScanProperties. The default, and all that existed before the format could be chosen
+        UInt8 = 0,
+
+        //The same window spread over 0..65535, 257 steps for every 8 bit one
+        UInt16 = 1,
+
+        //The processed dB values as the SDK delivers them, without any window, for quantitative work
+        Float32 = 2,
+
+        //The camera's spectra as acquired, 16 bits per pixel, for clients that do the processing themselves. Along z a volume then has camera pixels instead of depths, and nothing gets processed or converted
+        RawSpectra = 3
+    };
+
+    //Whether format is one of the above
+    bool isSupported(uint32_t format);
+
+    //Bytes per voxel of format
+    size_t size(uint32_t format);
+
+    //Converts one B-scan of processed float data into count voxels of format at out, in a single pass. scale and offset are the 8 bit window. Raw spectra never come from processed data, so RawSpectra isn't one of the formats it takes
+    void convertBScan(uint32_t format, const float* in, uint8_t* out, size_t count, float scale, float offset);
+
+    //Same as convertBScan for only part of the B-scan: xcount A-scans from xstart on, and of each of them zcount voxels from zstart on. in holds every A-scan of zsteps voxels one after the other, out gets the window packed the same way
+    //Nothing outside the window gets read or converted
+    void convertBScanWindow(uint32_t format, const float* in, uint32_t zsteps, uint32_t xstart, uint32_t xcount, uint32_t zstart, uint32_t zcount, uint8_t* out, float scale, float offset);
+
+    //Copies the window of convertBScanWindow out of a B-scan of raw spectra of pixels values each, as they are and in a single memcpy when the spectra are whole. Nothing outside the window gets read
+    void copyRawWindow(const uint16_t* in, uint32_t pixels, uint32_t xstart, uint32_t xcount, uint32_t zstart, uint32_t zcount, uint8_t* out);
+
+    //Makes a window along one axis fit into steps. start is moved back to steps at most, and a count of 0 or one reaching past the end becomes everything from start on
+    void clampWindow(uint32_t steps, uint32_t& start, uint32_t& count);
+}
+
+#endif
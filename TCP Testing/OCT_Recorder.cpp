@@ -0,0 +1,401 @@
+#include <OCT_Recorder.h>
+
+#include <algorithm>
+#include <iostream>
+#include <string.h>
+#include <time.h>
+
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <OCT_Layout.h>
+#include <OCT_Protocol.h>
+#include <OCT_Trace.h>
+
+namespace
+{
+    const std::string PartSuffix = ".part";
+
+    //Makes sure what was written survives a power cut too, not just a crash of the server
+    void syncFile(FILE* file)
+    {
+#ifdef _WIN32
+        _commit(_fileno(file));
+#else
+        fsync(fileno(file));
+#endif
+    }
+
+    bool truncateFile(FILE* file, uint64_t size)
+    {
+#ifdef _WIN32
+        return _chsize_s(_fileno(file), (__int64)size) == 0;
+#else
+        return ftruncate(fileno(file), (off_t)size) == 0;
+#endif
+    }
+
+    uint64_t fileSize(FILE* file)
+    {
+#ifdef _WIN32
+        const __int64 size = _filelengthi64(_fileno(file));
+        return size < 0 ? 0 : (uint64_t)size;
+#else
+        struct stat info;
+        return fstat(fileno(file), &info) == 0 ? (uint64_t)info.st_size : 0;
+#endif
+    }
+
+    //Names of the .part files in directory
+    std::vector<std::string> partFiles(const std::string& directory)
+    {
+        std::vector<std::string> names;
+#ifdef _WIN32
+        WIN32_FIND_DATAA found;
+        HANDLE search = FindFirstFileA((directory + "/*.img" + PartSuffix).c_str(), &found);
+        if (search != INVALID_HANDLE_VALUE)
+        {
+            do
+            {
+                names.push_back(found.cFileName);
+            } while (FindNextFileA(search, &found));
+            FindClose(search);
+        }
+#else
+        DIR* dir = opendir(directory.c_str());
+        if (dir)
+        {
+            while (dirent* entry = readdir(dir))
+            {
+                std::string name = entry->d_name;
+                if (name.size() > PartSuffix.size() + 4 && name.compare(name.size() - PartSuffix.size() - 4, std::string::npos, ".img" + PartSuffix) == 0)
+                {
+                    names.push_back(name);
+                }
+            }
+            closedir(dir);
+        }
+#endif
+        return names;
+    }
+}
+
+OCT_Recorder::OCT_Recorder(const std::string& directory) : m_directory(directory), m_writer(1), m_sequence(0),
+    m_recorded(0), m_skipped(0), m_failed(0), m_active(0), m_bytesReady(0), m_bytesDone(0), m_bytesWritten(0), m_peakQueued(0), m_writeTime(0)
+{
+    if (this->enabled())
+    {
+        std::cout << "Recording every volume to " << m_directory << "\n";
+        this->recover();
+    }
+}
+
+OCT_Recorder::~OCT_Recorder()
+{
+}
+
+bool OCT_Recorder::enabled() const
+{
+    return !m_directory.empty();
+}
+
+OCT_RecordingPtr OCT_Recorder::begin(const boost::shared_ptr<OCT_Volume>& volume)
+{
+    if (!this->enabled())
+    {
+        return OCT_RecordingPtr();
+    }
+
+    //Memory is all the queue has, so once too much of it waits for the disk new volumes go unrecorded rather than unsent
+    const size_t total = 512 + volume->params.volumeSize();
+    if (m_bytesReady - m_bytesDone + total > OCT_Protocol::MaxRecordQueue)
+    {
+        m_skipped++;
+        std::cout << "Recorder " << (m_bytesReady - m_bytesDone) / (1024 * 1024) << " MB behind, not recording this volume (" << m_skipped << " so far)\n";
+        return OCT_RecordingPtr();
+    }
+
+    char stamp[32];
+    time_t now = time(0);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+    char name[64];
+    sprintf(name, "/%s_%06llu.img", stamp, (unsigned long long)m_sequence++);
+
+    OCT_RecordingPtr recording = boost::make_shared<OCT_Recording>();
+    recording->volume = volume;
+    recording->data = &volume->message[0];
+    recording->total = total;
+    recording->bscanSize = volume->params.bscanSize();
+    recording->path = m_directory + name;
+    recording->partPath = recording->path + PartSuffix;
+    recording->ready = 512;
+    recording->finished = false;
+    recording->posted = false;
+    recording->postedAt = 0;
+    recording->file = 0;
+    recording->written = 0;
+    recording->bscansInHeader = 0;
+    recording->start = OCT_Trace::now();
+    recording->failed = false;
+
+    m_active++;
+    m_bytesReady += 512;
+    return recording;
+}
+
+BScanHandler OCT_Recorder::record(const OCT_RecordingPtr& recording, const BScanHandler& next)
+{
+    if (!recording)
+    {
+        return next;
+    }
+
+    return boost::bind(&OCT_Recorder::bscan_ready, this, recording, next, _1, _2);
+}
+
+void OCT_Recorder::finish(const OCT_RecordingPtr& recording)
+{
+    if (!recording)
+    {
+        return;
+    }
+
+    recording->finished = true;
+    m_writer.post(boost::bind(&OCT_Recorder::write, this, recording));
+}
+
+OCT_Recorder::Stats OCT_Recorder::stats()
+{
+    Stats stats;
+    stats.recorded = m_recorded;
+    stats.skipped = m_skipped;
+    stats.failed = m_failed;
+    stats.active = m_active;
+    stats.bytesWritten = m_bytesWritten;
+    stats.bytesQueued = m_bytesReady - m_bytesDone;
+    stats.peakQueued = m_peakQueued;
+    stats.writeMicroseconds = m_writeTime / 1000;
+    return stats;
+}
+
+void OCT_Recorder::bscan_ready(OCT_RecordingPtr recording, const BScanHandler& next, const uint8_t* bscan, size_t size)
+{
+    //B-scans are captured in order, so everything up to the end of this one is in the volume
+    const size_t end = (bscan + size) - recording->data;
+    const size_t before = recording->ready.exchange(end);
+    m_bytesReady += end - before;
+
+    uint64_t queued = m_bytesReady - m_bytesDone;
+    uint64_t peak = m_peakQueued;
+    while (queued > peak && !m_peakQueued.compare_exchange_weak(peak, queued))
+    {
+    }
+
+    //Large writes only, the rest waits for the next B-scans or the end of the capture
+    if (end - recording->postedAt >= OCT_Protocol::RecordWriteSize && !recording->posted.exchange(true))
+    {
+        recording->postedAt = end;
+        m_writer.post(boost::bind(&OCT_Recorder::write, this, recording));
+    }
+
+    if (next)
+    {
+        next(bscan, size);
+    }
+}
+
+void OCT_Recorder::write(OCT_RecordingPtr recording)
+{
+    OCT_Recording& r = *recording;
+
+    //Cleared first, so B-scans reported from here on get a job of their own. finished is read before ready, so a finished capture is always written to its end
+    r.posted = false;
+    const bool finished = r.finished;
+    const size_t ready = r.ready;
+
+    if (!r.volume)
+    {
+        return;
+    }
+
+    if (!r.failed && !r.file)
+    {
+        r.file = fopen(r.partPath.c_str(), "wb");
+        if (r.file)
+        {
+            //Straight to the file, the writes are large enough and the header has to be on disk the moment it is written
+            setvbuf(r.file, 0, _IONBF, 0);
+            r.failed = !this->write_header(r, 0);
+            r.written = 512;
+            m_bytesWritten += 512;
+            m_bytesDone += 512;
+        }
+        else
+        {
+            std::cout << "Recorder couldn't create " << r.partPath << "\n";
+            r.failed = true;
+        }
+    }
+
+    while (!r.failed && r.written < ready)
+    {
+        const size_t size = std::min(ready - r.written, OCT_Protocol::RecordWriteSize);
+        const uint64_t start = OCT_Trace::now();
+        const size_t written = fwrite(r.data + r.written, 1, size, r.file);
+        const uint64_t end = OCT_Trace::now();
+        OCT_Trace::record("record write", start, end, "bytes", written);
+
+        m_writeTime += end - start;
+        m_bytesWritten += written;
+        m_bytesDone += written;
+        r.written += written;
+
+        if (written != size)
+        {
+            std::cout << "Recorder couldn't write " << r.partPath << ". Leaving what is there for the next start to recover\n";
+            r.failed = true;
+        }
+    }
+
+    if (!r.failed && r.bscanSize > 0)
+    {
+        //Only once the B-scans are in the file, so the header never claims more than there is
+        const uint32_t bscans = (uint32_t)((r.written - 512) / r.bscanSize);
+        if (bscans != r.bscansInHeader)
+        {
+            r.failed = !this->write_header(r, bscans);
+        }
+    }
+
+    if (finished)
+    {
+        this->finalize(r);
+    }
+}
+
+bool OCT_Recorder::write_header(OCT_Recording& recording, uint32_t bscans)
+{
+    uint8_t header[512];
+    memcpy(header, recording.data, 512);
+    OCT_HeaderLayout::YCount::write(header, bscans);
+
+    if (fseek(recording.file, 0, SEEK_SET) != 0 || fwrite(header, 1, 512, recording.file) != 512 || fseek(recording.file, (long)0, SEEK_END) != 0)
+    {
+        std::cout << "Recorder couldn't update the header of " << recording.partPath << "\n";
+        return false;
+    }
+
+    recording.bscansInHeader = bscans;
+    return true;
+}
+
+void OCT_Recorder::finalize(OCT_Recording& recording)
+{
+    //After a write error, whatever is left of the capture will never be written, so it leaves the queue too
+    m_bytesDone += recording.ready - recording.written;
+
+    if (recording.file)
+    {
+        if (!recording.failed)
+        {
+            syncFile(recording.file);
+        }
+        fclose(recording.file);
+        recording.file = 0;
+    }
+
+    if (!recording.failed && rename(recording.partPath.c_str(), recording.path.c_str()) != 0)
+    {
+        std::cout << "Recorder couldn't rename " << recording.partPath << "\n";
+        recording.failed = true;
+    }
+
+    if (recording.failed)
+    {
+        m_failed++;
+    }
+    else
+    {
+        //A capture that failed halfway is kept as the shorter volume its header already describes
+        if (recording.written != recording.total)
+        {
+            std::cout << "Recorder got only " << recording.bscansInHeader << " B-scans of " << recording.path << "\n";
+        }
+
+        m_recorded++;
+        double seconds = (OCT_Trace::now() - recording.start) / 1000000000.0;
+        Stats stats = this->stats();
+        std::cout << "Recorded " << recording.path << ": " << recording.total / (1024.0 * 1024.0) << " MB in " << seconds << " s. Disk at " << (stats.writeMicroseconds ? stats.bytesWritten / (double)stats.writeMicroseconds : 0.0) << " MB/s, "
+            << stats.bytesQueued / (1024.0 * 1024.0) << " MB queued, " << stats.peakQueued / (1024.0 * 1024.0) << " MB at most\n";
+    }
+
+    //Hands the buffer back to the pool
+    recording.volume.reset();
+    m_active--;
+}
+
+void OCT_Recorder::recover()
+{
+    std::vector<std::string> names = partFiles(m_directory);
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        const std::string partPath = m_directory + "/" + names[i];
+        const std::string path = partPath.substr(0, partPath.size() - PartSuffix.size());
+
+        FILE* file = fopen(partPath.c_str(), "r+b");
+        uint8_t header[512];
+        if (!file || fread(header, 1, 512, file) != 512)
+        {
+            std::cout << "Recorder couldn't recover " << partPath << ", it has no header\n";
+            if (file)
+            {
+                fclose(file);
+            }
+            continue;
+        }
+
+        //The header counts the B-scans that were written. Anything after them was cut off halfway.
+        //The header page can reach the disk before the data it counts, so the file size bounds it too
+        const uint32_t xcount = OCT_HeaderLayout::XCount::read(header);
+        const uint32_t zcount = OCT_HeaderLayout::ZCount::read(header);
+        const uint32_t bytesPerVoxel = OCT_HeaderLayout::BytesPerVoxel::read(header);
+        const uint64_t bscanBytes = (uint64_t)xcount * zcount * std::max(bytesPerVoxel, 1u);
+        const uint64_t onDisk = bscanBytes > 0 ? (std::max<uint64_t>(fileSize(file), 512) - 512) / bscanBytes : 0;
+        const uint32_t bscansInHeader = OCT_HeaderLayout::YCount::read(header);
+        const uint32_t bscans = (uint32_t)std::min<uint64_t>(bscansInHeader, onDisk);
+        const uint64_t size = 512 + bscans * bscanBytes;
+
+        if (bscans != bscansInHeader)
+        {
+            OCT_HeaderLayout::YCount::write(header, bscans);
+            if (fseek(file, 0, SEEK_SET) != 0 || fwrite(header, 1, 512, file) != 512)
+            {
+                std::cout << "Recorder couldn't correct the header of " << partPath << "\n";
+                fclose(file);
+                continue;
+            }
+        }
+
+        bool recovered = truncateFile(file, size);
+        fclose(file);
+        recovered = recovered && rename(partPath.c_str(), path.c_str()) == 0;
+
+        if (recovered)
+        {
+            std::cout << "Recovered " << path << " with the " << bscans << " B-scans written before the last run stopped\n";
+        }
+        else
+        {
+            std::cout << "Recorder couldn't recover " << partPath << "\n";
+        }
+    }
+}
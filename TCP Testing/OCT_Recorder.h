@@ -0,0 +1,129 @@
+#ifndef OCT_RECORDER
+#define OCT_RECORDER
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <SDOCT.h>
+#include <OCT_Volume.h>
+#include <OCT_WorkerPool.h>
+
+//One volume being written to disk. Shared by the scanner thread, which reports how much of the volume is captured, and the recorder thread, which writes it
+struct OCT_Recording
+{
+    //Keeps the volume, and so its buffer, alive until it is on disk
+    boost::shared_ptr<const OCT_Volume> volume;
+
+    //Start of the message. The pool reserved the whole volume, so it never moves while captureVolScan fills it
+    const uint8_t* data;
+    size_t total;
+    size_t bscanSize;
+
+    //Final path, and the one it is written to until finished
+    std::string path;
+    std::string partPath;
+
+    //Bytes of the message captured so far and whether the capture is done. Set by the scanner thread
+    boost::atomic<size_t> ready;
+    boost::atomic<bool> finished;
+
+    //Set while a write job is on its way, and what ready was when the scanner thread last posted one. Scanner thread only
+    boost::atomic<bool> posted;
+    size_t postedAt;
+
+    //Recorder thread only
+    FILE* file;
+    size_t written;
+    uint32_t bscansInHeader;
+    uint64_t start;
+    bool failed;
+};
+
+typedef boost::shared_ptr<OCT_Recording> OCT_RecordingPtr;
+
+//Writes every captured volume to its own .img file (512 byte header + voxels, exactly as sent) while it is being captured, so scans get archived without the client having to save them
+//Writing happens on a thread of its own in large sequential writes, and the scanner thread only ever publishes how far the capture got, so a slow disk never holds up captureVolScan. Volumes waiting to be written just stay in memory, up to OCT_Protocol::MaxRecordQueue
+//Files are written as .img.part and renamed once complete. After every write the header's B-scan count is brought up to what is on disk, so a .part left behind by a crash always reads as a valid, shorter volume. The next start truncates those to their last complete B-scan and renames them to .img
+class OCT_Recorder
+{
+public:
+    struct Stats
+    {
+        //Volumes completely written, not recorded because the queue was full, and lost to a write error
+        uint64_t recorded;
+        uint64_t skipped;
+        uint64_t failed;
+
+        //Volumes being written right now
+        uint64_t active;
+
+        //Bytes on disk so far, bytes captured but not written yet and the most there ever were
+        uint64_t bytesWritten;
+        uint64_t bytesQueued;
+        uint64_t peakQueued;
+
+        //Microseconds spent in writes, for the bandwidth of the disk
+        uint64_t writeMicroseconds;
+    };
+
+private:
+    std::string m_directory;
+    OCT_WorkerPool m_writer;
+    uint64_t m_sequence;
+
+    boost::atomic<uint64_t> m_recorded;
+    boost::atomic<uint64_t> m_skipped;
+    boost::atomic<uint64_t> m_failed;
+    boost::atomic<uint64_t> m_active;
+
+    //Bytes captured for all recordings, and those of them written or given up on. What waits in memory is the difference
+    boost::atomic<uint64_t> m_bytesReady;
+    boost::atomic<uint64_t> m_bytesDone;
+
+    boost::atomic<uint64_t> m_bytesWritten;
+    boost::atomic<uint64_t> m_peakQueued;
+    boost::atomic<uint64_t> m_writeTime;
+
+public:
+    //Records into directory, finishing the .part files a crash left there first. An empty directory turns recording off
+    OCT_Recorder(const std::string& directory);
+
+    //Waits for the volumes still queued to be written
+    ~OCT_Recorder();
+
+    bool enabled() const;
+
+    //Starts recording a volume about to be captured, whose header is already in its message. Returns an empty pointer if recording is off or too much is queued already. Scanner thread only
+    OCT_RecordingPtr begin(const boost::shared_ptr<OCT_Volume>& volume);
+
+    //Wraps the B-scan handler of a capture so every B-scan also goes to the recording. Returns next itself for an empty recording
+    BScanHandler record(const OCT_RecordingPtr& recording, const BScanHandler& next);
+
+    //Called once captureVolScan has returned, or has thrown, in which case only the B-scans captured are kept. The recording is finished on the recorder thread. Does nothing for an empty recording
+    void finish(const OCT_RecordingPtr& recording);
+
+    Stats stats();
+
+private:
+    //Runs as a wrapped B-scan handler on the scanner thread. Publishes the end of the B-scan and hands the writing over once enough has piled up
+    void bscan_ready(OCT_RecordingPtr recording, const BScanHandler& next, const uint8_t*, size_t);
+
+    //Recorder thread job. Writes everything captured so far, updates the header and renames the file once the capture is done and written
+    void write(OCT_RecordingPtr recording);
+
+    //Writes the header at the start of the file with the B-scans it holds so far
+    bool write_header(OCT_Recording& recording, uint32_t bscans);
+
+    //Closes and renames the file of a finished recording
+    void finalize(OCT_Recording& recording);
+
+    //Truncates the .part files of a crashed run to their last complete B-scan and renames them
+    void recover();
+};
+
+#endif
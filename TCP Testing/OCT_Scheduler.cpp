@@ -0,0 +1,111 @@
+#include <OCT_Scheduler.h>
+
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <OCT_Trace.h>
+
+OCT_Scheduler::OCT_Scheduler(SDOCT& oct, int idleTimeout) : m_oct(oct), m_work(new boost::asio::io_service::work(m_scanService)), m_sessionOpen(false), m_idleTimeout(idleTimeout), m_idleTimer(m_scanService)
+{
+    m_scanThread = boost::thread(boost::bind(&OCT_Scheduler::run, this));
+}
+
+OCT_Scheduler::~OCT_Scheduler()
+{
+    //The last job closes the device, and the idle timer mustn't keep the scanner thread alive
+    post(boost::bind(&OCT_Scheduler::closeSession, this));
+    m_work.reset();
+    m_scanThread.join();
+}
+
+SDOCT& OCT_Scheduler::oct()
+{
+    return m_oct;
+}
+
+void OCT_Scheduler::post(const boost::function<void ()>& job)
+{
+    m_scanService.post(job);
+}
+
+boost::asio::io_service& OCT_Scheduler::service()
+{
+    return m_scanService;
+}
+
+double OCT_Scheduler::openSession()
+{
+    m_idleTimer.cancel();
+
+    if (m_sessionOpen)
+    {
+        return 0.0;
+    }
+
+    uint64_t start = OCT_Trace::now();
+    m_oct.Init();
+    m_sessionOpen = true;
+    uint64_t end = OCT_Trace::now();
+    OCT_Trace::record("openSession", start, end);
+    double startup = (end - start) / 1000000000.0;
+
+    std::cout << "Device session opened in " << startup << " s\n";
+    return startup;
+}
+
+void OCT_Scheduler::releaseSession()
+{
+    if (m_idleTimeout <= 0)
+    {
+        closeSession();
+        return;
+    }
+
+    m_idleTimer.expires_from_now(boost::posix_time::seconds(m_idleTimeout));
+    m_idleTimer.async_wait(boost::bind(&OCT_Scheduler::handle_idle_timeout, this, boost::asio::placeholders::error));
+}
+
+void OCT_Scheduler::closeSession()
+{
+    m_idleTimer.cancel();
+
+    if (!m_sessionOpen)
+    {
+        return;
+    }
+
+    m_sessionOpen = false;
+    m_oct.Close();
+    std::cout << "Device session closed\n";
+}
+
+void OCT_Scheduler::handle_idle_timeout(const boost::system::error_code& error)
+{
+    //Cancelled or re-armed because a job picked the session up again
+    if (error == boost::asio::error::operation_aborted || m_idleTimer.expires_at() > boost::asio::deadline_timer::traits_type::now())
+    {
+        return;
+    }
+
+    std::cout << "Device idle for " << m_idleTimeout << " s\n";
+    closeSession();
+}
+
+void OCT_Scheduler::run()
+{
+    OCT_Trace::nameThread("scanner");
+
+    while (1)
+    {
+        try
+        {
+            m_scanService.run();
+            return;
+        }
+        catch(...)
+        {
+            //A failed job must not take the scanner thread down with it, otherwise no other client could scan anymore
+            std::cout << "Exception in a scanner job. Carrying on with the next one\n";
+        }
+    }
+}
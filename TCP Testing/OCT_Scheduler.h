@@ -0,0 +1,61 @@
+#ifndef OCT_SCHEDULER
+#define OCT_SCHEDULER
+
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <SDOCT.h>
+
+//Arbitrates access to the single SDOCT shared by every TCP_Connection. Jobs that need the scanner are queued here and run one at a time, in order, on a dedicated scanner thread, so the io_service threads serving the clients never block on an acquisition
+//It also owns the device session. Bringing the device up takes seconds, so it is opened by the first job that needs it and kept warm across requests until it has been idle for the idle timeout. An idle timeout of 0 falls back to opening and closing the device around every request
+class OCT_Scheduler
+{
+private:
+    SDOCT& m_oct;
+
+    //Queue of pending scanner jobs, drained by m_scanThread
+    boost::asio::io_service m_scanService;
+    boost::scoped_ptr<boost::asio::io_service::work> m_work;
+    boost::thread m_scanThread;
+
+    //Device session state. Only touched from the scanner thread
+    bool m_sessionOpen;
+    int m_idleTimeout;
+    boost::asio::deadline_timer m_idleTimer;
+
+public:
+    //Starts the scanner thread. idleTimeout is in seconds
+    OCT_Scheduler(SDOCT& oct, int idleTimeout);
+
+    //Lets the already queued jobs finish, closes the device and joins the scanner thread
+    ~OCT_Scheduler();
+
+    //The shared oct. Only to be used from inside a posted job, between openSession and releaseSession
+    SDOCT& oct();
+
+    //Queues a job that needs exclusive access to the oct. Returns immediately
+    void post(const boost::function<void ()>& job);
+
+    //The io_service running the jobs, for timers whose handlers are scanner jobs themselves, like the frames of a live stream. They run in between the other jobs
+    boost::asio::io_service& service();
+
+    //Opens the device unless the session is still warm, and cancels the idle timer. Returns the seconds spent bringing the device up, 0 when it was already open. Only from a job
+    double openSession();
+
+    //Called by every job once it is done with the device. Closes it right away with an idle timeout of 0, otherwise (re)arms the idle timer. Only from a job
+    void releaseSession();
+
+    //Closes the device if it is open. Only from a job
+    void closeSession();
+
+private:
+    //Body of the scanner thread
+    void run();
+
+    //Closes the session once it has gone unused for the whole idle timeout
+    void handle_idle_timeout(const boost::system::error_code&);
+};
+
+#endif
@@ -0,0 +1,166 @@
+#include <OCT_Trace.h>
+
+#include <stdio.h>
+#include <utility>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include <OCT_Protocol.h>
+
+namespace
+{
+    //One span in the ring. sequence is 0 while the event is being written and its index in the ring + 1 once it is complete, so a dump can tell a finished event from a torn one
+    struct Event
+    {
+        boost::atomic<uint64_t> sequence;
+        const char* name;
+        const char* argName;
+        uint64_t arg;
+        uint64_t start;
+        uint64_t duration;
+        uint32_t thread;
+    };
+
+    Event g_events[OCT_Protocol::TraceEvents];
+    boost::atomic<uint64_t> g_next(0);
+    boost::atomic<bool> g_enabled(true);
+
+    //Small ids for the threads, handed out as they record their first span, and the names some of them gave themselves
+    boost::atomic<uint32_t> g_nextThread(1);
+    boost::thread_specific_ptr<uint32_t> g_thread;
+    boost::mutex g_namesMutex;
+    std::vector<std::pair<uint32_t, std::string> > g_names;
+
+    uint32_t threadId()
+    {
+        uint32_t* id = g_thread.get();
+        if (!id)
+        {
+            id = new uint32_t(g_nextThread++);
+            g_thread.reset(id);
+        }
+        return *id;
+    }
+}
+
+uint64_t OCT_Trace::now()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    if (frequency.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000 + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000 / frequency.QuadPart;
+#else
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+#endif
+}
+
+void OCT_Trace::record(const char* name, uint64_t start, uint64_t end, const char* argName, uint64_t arg)
+{
+    if (!g_enabled.load(boost::memory_order_relaxed))
+    {
+        return;
+    }
+
+    const uint32_t thread = threadId();
+    const uint64_t index = g_next.fetch_add(1, boost::memory_order_relaxed);
+    Event& event = g_events[index % OCT_Protocol::TraceEvents];
+
+    event.sequence.store(0, boost::memory_order_relaxed);
+    boost::atomic_thread_fence(boost::memory_order_release);
+    event.name = name;
+    event.argName = argName;
+    event.arg = arg;
+    event.start = start;
+    event.duration = end > start ? end - start : 0;
+    event.thread = thread;
+    event.sequence.store(index + 1, boost::memory_order_release);
+}
+
+void OCT_Trace::nameThread(const char* name)
+{
+    boost::mutex::scoped_lock lock(g_namesMutex);
+    g_names.push_back(std::make_pair(threadId(), std::string(name)));
+}
+
+void OCT_Trace::setEnabled(bool enabled)
+{
+    g_enabled = enabled;
+}
+
+bool OCT_Trace::enabled()
+{
+    return g_enabled.load(boost::memory_order_relaxed);
+}
+
+void OCT_Trace::dump(std::string& out)
+{
+    char line[256];
+    bool first = true;
+    out += "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+    {
+        boost::mutex::scoped_lock lock(g_namesMutex);
+        for (size_t i = 0; i < g_names.size(); i++)
+        {
+            sprintf(line, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%.64s\"}}", first ? "" : ",", g_names[i].first, g_names[i].second.c_str());
+            out += line;
+            first = false;
+        }
+    }
+
+    //Oldest first. Anything older than a full ring has been overwritten already
+    const uint64_t end = g_next.load(boost::memory_order_acquire);
+    const uint64_t begin = end > OCT_Protocol::TraceEvents ? end - OCT_Protocol::TraceEvents : 0;
+    for (uint64_t index = begin; index < end; index++)
+    {
+        Event& event = g_events[index % OCT_Protocol::TraceEvents];
+        if (event.sequence.load(boost::memory_order_acquire) != index + 1)
+        {
+            continue;
+        }
+
+        const char* name = event.name;
+        const char* argName = event.argName;
+        const uint64_t arg = event.arg;
+        const uint64_t start = event.start;
+        const uint64_t duration = event.duration;
+        const uint32_t thread = event.thread;
+
+        //Rewritten while it was being copied
+        boost::atomic_thread_fence(boost::memory_order_acquire);
+        if (event.sequence.load(boost::memory_order_relaxed) != index + 1)
+        {
+            continue;
+        }
+
+        //Chrome wants microseconds, the nanoseconds go in as the fractional part. Names are short literals, so a line always fits
+        int length = sprintf(line, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%llu.%03u,\"dur\":%llu.%03u", first ? "" : ",", name, thread,
+            (unsigned long long)(start / 1000), (unsigned int)(start % 1000), (unsigned long long)(duration / 1000), (unsigned int)(duration % 1000));
+        if (argName)
+        {
+            length += sprintf(line + length, ",\"args\":{\"%s\":%llu}", argName, (unsigned long long)arg);
+        }
+        out.append(line, length);
+        out += "}";
+        first = false;
+    }
+
+    out += "\n]}\n";
+}
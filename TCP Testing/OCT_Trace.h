@@ -0,0 +1,56 @@
+#ifndef OCT_TRACE
+#define OCT_TRACE
+
+#include <string>
+#include <stdint.h>
+
+//Timeline of where the time of every scan goes, stage by stage: device reads, processing, conversion, compression, socket writes and so on
+//Spans are recorded from every thread into one fixed ring of events, so tracing never allocates and the oldest events are simply overwritten. Recording a span costs two clock reads and an atomic increment
+//The ring can be dumped at any time as a Chrome trace, to be opened in chrome://tracing or ui.perfetto.dev
+namespace OCT_Trace
+{
+    //Nanoseconds on a monotonic high resolution clock, for timing spans and anything else that needs it
+    uint64_t now();
+
+    //Records a span of the calling thread from start to end. name and argName have to be string literals, only their pointers are kept. argName may be 0 for spans without an argument
+    void record(const char* name, uint64_t start, uint64_t end, const char* argName = 0, uint64_t arg = 0);
+
+    //Names the calling thread in the dumped trace
+    void nameThread(const char* name);
+
+    //Recording is on from the start. While it is off, spans cost one flag check
+    void setEnabled(bool enabled);
+    bool enabled();
+
+    //Appends the events still in the ring to out as Chrome trace event JSON. Safe while other threads keep recording, events overwritten meanwhile are skipped
+    void dump(std::string& out);
+
+    //Records a span from its construction to its destruction
+    class Scope
+    {
+    private:
+        const char* m_name;
+        const char* m_argName;
+        uint64_t m_arg;
+        uint64_t m_start;
+
+    public:
+        Scope(const char* name, const char* argName = 0, uint64_t arg = 0) : m_name(name), m_argName(argName), m_arg(arg), m_start(enabled() ? now() : 0)
+        {
+        }
+
+        ~Scope()
+        {
+            if (m_start != 0)
+            {
+                record(m_name, m_start, now(), m_argName, m_arg);
+            }
+        }
+
+    private:
+        Scope(const Scope&);
+        Scope& operator=(const Scope&);
+    };
+}
+
+#endif
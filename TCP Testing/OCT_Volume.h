@@ -0,0 +1,24 @@
+#ifndef OCT_VOLUME
+#define OCT_VOLUME
+
+#include <vector>
+#include <stdint.h>
+
+#include <boost/shared_ptr.hpp>
+
+#include <OCT_Buffer.h>
+#include <OCT_Params.h>
+
+//One volume scan as it goes on the wire: the 512 byte header followed by the voxels. Only the scanner thread writes into it, while capturing. Once published it is never modified again, so any number of connections can send it straight out of the same memory, each one holding a shared pointer until its write is done
+struct OCT_Volume
+{
+    //Params the volume was captured with
+    OCT_Params params;
+
+    //Header + voxels
+    OCT_Buffer message;
+};
+
+typedef boost::shared_ptr<const OCT_Volume> OCT_VolumePtr;
+
+#endif
@@ -0,0 +1,100 @@
+#include <OCT_VolumeCache.h>
+
+#include <iostream>
+
+OCT_VolumeCache::OCT_VolumeCache(size_t maxVolumes, size_t budget) : m_maxVolumes(maxVolumes), m_budget(budget), m_nextId(1)
+{
+    m_stats.hits = 0;
+    m_stats.misses = 0;
+    m_stats.evicted = 0;
+    m_stats.oversized = 0;
+    m_stats.volumes = 0;
+    m_stats.bytes = 0;
+}
+
+uint32_t OCT_VolumeCache::nextId()
+{
+    uint32_t id = m_nextId++;
+
+    //Skips 0 once the IDs wrap around
+    if (id == 0)
+    {
+        id = m_nextId++;
+    }
+
+    return id;
+}
+
+void OCT_VolumeCache::insert(uint32_t id, const OCT_VolumePtr& volume)
+{
+    if (m_budget == 0 || m_maxVolumes == 0)
+    {
+        return;
+    }
+
+    //What the buffer reserves, not just what the volume fills, as that is what stays out of the pool
+    const size_t bytes = volume->message.capacity();
+
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    if (bytes > m_budget)
+    {
+        m_stats.oversized++;
+        std::cout << "Volume " << id << " is larger than the whole cache, not caching it\n";
+        return;
+    }
+
+    while (!m_entries.empty() && (m_entries.size() >= m_maxVolumes || m_stats.bytes + bytes > m_budget))
+    {
+        m_stats.bytes -= m_entries.front().bytes;
+        m_stats.volumes--;
+        m_stats.evicted++;
+        m_entries.pop_front();
+    }
+
+    Entry entry;
+    entry.id = id;
+    entry.volume = volume;
+    entry.bytes = bytes;
+    m_entries.push_back(entry);
+
+    m_stats.bytes += bytes;
+    m_stats.volumes++;
+}
+
+OCT_VolumePtr OCT_VolumeCache::find(uint32_t id)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    return find_locked(id, 0);
+}
+
+OCT_VolumePtr OCT_VolumeCache::find(uint32_t id, const OCT_Params& params)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    return find_locked(id, &params);
+}
+
+OCT_VolumeCache::Stats OCT_VolumeCache::stats()
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    return m_stats;
+}
+
+OCT_VolumePtr OCT_VolumeCache::find_locked(uint32_t id, const OCT_Params* params)
+{
+    //Newest first, so an ID of 0 takes the newest volume that matches
+    for (std::deque<Entry>::const_reverse_iterator it = m_entries.rbegin(); it != m_entries.rend(); ++it)
+    {
+        if ((id == 0 || it->id == id) && (!params || it->volume->params == *params))
+        {
+            m_stats.hits++;
+            return it->volume;
+        }
+    }
+
+    m_stats.misses++;
+    return OCT_VolumePtr();
+}
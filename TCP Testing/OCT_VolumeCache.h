@@ -0,0 +1,76 @@
+#ifndef OCT_VOLUME_CACHE
+#define OCT_VOLUME_CACHE
+
+#include <deque>
+#include <stdint.h>
+
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <OCT_Params.h>
+#include <OCT_Volume.h>
+
+//The last few volumes captured, kept in memory so a client that lost its connection halfway, or any other client, can fetch them again with a 'G' request instead of rescanning
+//Every volume gets an ID, carried in its header, and is found by it, by the params it was captured with, or both. Cached volumes are the very ones that were sent, so caching copies nothing. They keep their buffers from going back to the pool until evicted
+//The oldest volumes are evicted once there are more than maxVolumes of them or their buffers reserve more than the memory budget
+class OCT_VolumeCache
+{
+public:
+    struct Stats
+    {
+        //Fetches that found their volume and ones that didn't
+        uint64_t hits;
+        uint64_t misses;
+
+        //Volumes evicted to stay within the limits, and ones never cached because they were larger than the whole budget
+        uint64_t evicted;
+        uint64_t oversized;
+
+        //Volumes cached right now and the bytes their buffers reserve
+        uint64_t volumes;
+        uint64_t bytes;
+    };
+
+private:
+    struct Entry
+    {
+        uint32_t id;
+        OCT_VolumePtr volume;
+        size_t bytes;
+    };
+
+    boost::mutex m_mutex;
+
+    //Oldest first
+    std::deque<Entry> m_entries;
+
+    size_t m_maxVolumes;
+    size_t m_budget;
+    Stats m_stats;
+
+    boost::atomic<uint32_t> m_nextId;
+
+public:
+    //Keeps up to maxVolumes volumes within budget bytes. A budget of 0 turns caching off, but volumes still get their IDs
+    OCT_VolumeCache(size_t maxVolumes, size_t budget);
+
+    //ID for the next volume captured. Never 0, which stands for the newest volume when fetching. Thread safe
+    uint32_t nextId();
+
+    //Caches a complete volume, evicting the oldest ones as needed. Called from the scanner thread once the volume is never modified again
+    void insert(uint32_t id, const OCT_VolumePtr& volume);
+
+    //The cached volume with this ID, or the newest one for an ID of 0. Empty if there is none. Thread safe
+    OCT_VolumePtr find(uint32_t id);
+
+    //Like find, but only a volume captured with exactly these params, voxel format and region included
+    OCT_VolumePtr find(uint32_t id, const OCT_Params& params);
+
+    Stats stats();
+
+private:
+    //The search of both finds. Counts the hit or miss. m_mutex must be held
+    OCT_VolumePtr find_locked(uint32_t id, const OCT_Params* params);
+};
+
+#endif
@@ -0,0 +1,44 @@
+#include <OCT_WorkerPool.h>
+
+#include <iostream>
+
+#include <boost/bind.hpp>
+
+#include <OCT_Trace.h>
+
+OCT_WorkerPool::OCT_WorkerPool(unsigned int numThreads, const char* name) : m_work(new boost::asio::io_service::work(m_service)), m_name(name)
+{
+    for (unsigned int i = 0; i < numThreads; i++)
+    {
+        m_threads.create_thread(boost::bind(&OCT_WorkerPool::run, this));
+    }
+}
+
+OCT_WorkerPool::~OCT_WorkerPool()
+{
+    m_work.reset();
+    m_threads.join_all();
+}
+
+void OCT_WorkerPool::post(const boost::function<void ()>& job)
+{
+    m_service.post(job);
+}
+
+void OCT_WorkerPool::run()
+{
+    OCT_Trace::nameThread(m_name);
+
+    while (1)
+    {
+        try
+        {
+            m_service.run();
+            return;
+        }
+        catch(...)
+        {
+            std::cout << "Exception in a worker job. Carrying on with the next one\n";
+        }
+    }
+}
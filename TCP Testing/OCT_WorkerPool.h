@@ -0,0 +1,33 @@
+#ifndef OCT_WORKER_POOL
+#define OCT_WORKER_POOL
+
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+
+//Pool of threads for CPU heavy per B-scan work, like compression, kept apart from the io_service threads so the sockets stay responsive while the cores are busy. Jobs run in any order and in parallel
+class OCT_WorkerPool
+{
+private:
+    boost::asio::io_service m_service;
+    boost::scoped_ptr<boost::asio::io_service::work> m_work;
+    boost::thread_group m_threads;
+    const char* m_name;
+
+public:
+    //Starts numThreads worker threads, named name in the trace. name has to be a string literal
+    OCT_WorkerPool(unsigned int numThreads, const char* name = "encoder");
+
+    //Lets the already queued jobs finish and joins the worker threads
+    ~OCT_WorkerPool();
+
+    //Queues a job. Returns immediately
+    void post(const boost::function<void ()>& job);
+
+private:
+    //Body of each worker thread
+    void run();
+};
+
+#endif
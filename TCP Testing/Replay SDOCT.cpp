@@ -0,0 +1,589 @@
+#include "Replay SDOCT.h"
+#include "OCT_Layout.h"
+#include "OCT_Processor.h"
+#include "OCT_Quantize.h"
+#include "OCT_Trace.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/random/normal_distribution.hpp>
+#include <boost/thread/thread.hpp>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//A-scans per second and jitter used when the environment doesn't say. Matches the line rate of the real device
+const double ReplayDefaultLineRate = 5500.0;
+const double ReplayDefaultJitter = 0.05;
+
+//Camera made up for raw captures without a raw recording, like the one of the Dummy SDOCT
+const uint32_t ReplayCameraPixels = 2048;
+const uint32_t ReplayCameraBitDepth = 12;
+
+SDOCT::SDOCT() : xrange(0), yrange(0), zrange(0), xoffset(0), yoffset(0), xsteps(0), ysteps(0), zsteps(0), windowScale(1.0f), windowOffset(0.0f), voxelFormat(OCT_Voxel::UInt8), averaging(1), cropXStart(0), cropXCount(0), cropYStart(0), cropYCount(0), cropZStart(0), cropZCount(0),
+	nextRecording(0), nextBScan(0), lineRate(ReplayDefaultLineRate), jitter(ReplayDefaultJitter)
+{
+}
+
+SDOCT::~SDOCT()
+{
+	CleanDataHandler();
+}
+
+void SDOCT::Init()
+{
+	std::cout << "		Initializing replay probe\n";
+
+	const char* rate = getenv("OCT_REPLAY_LINE_RATE");
+	this->lineRate = rate ? atof(rate) : ReplayDefaultLineRate;
+	if (this->lineRate <= 0.0)
+	{
+		this->lineRate = ReplayDefaultLineRate;
+	}
+
+	const char* jitter = getenv("OCT_REPLAY_JITTER");
+	this->jitter = jitter ? atof(jitter) : ReplayDefaultJitter;
+	if (this->jitter < 0.0)
+	{
+		this->jitter = 0.0;
+	}
+
+	std::cout << "		Replaying at " << this->lineRate << " A-scans per second with " << this->jitter * 100.0 << "% jitter\n";
+
+	setXRange(1.0);
+	setYRange(1.0);
+	setZRange(7.0);
+	setXSteps(1);
+	setYSteps(4096);
+	setZSteps(1);
+
+	InitDataHandler();
+}
+
+void SDOCT::Close()
+{
+	CleanDataHandler();
+	std::cout << "		Closing replay probe\n";
+}
+
+//Maps the recordings, which stand in for the device's data handlers
+void SDOCT::InitDataHandler()
+{
+	std::cout << "		Mapping recordings\n";
+	CleanDataHandler();
+
+	const char* files = getenv("OCT_REPLAY_FILES");
+	std::string list = files ? files : "";
+	size_t start = 0;
+	while (start < list.size())
+	{
+		size_t end = list.find(';', start);
+		if (end == std::string::npos)
+		{
+			end = list.size();
+		}
+
+		Recording recording;
+		recording.path = list.substr(start, end - start);
+		if (!recording.path.empty() && mapRecording(recording))
+		{
+			std::cout << "		Replaying " << recording.path << ": " << recording.xsteps << "x" << recording.ysteps << "x" << recording.zsteps << ", format " << recording.format << "\n";
+			this->recordings.push_back(recording);
+		}
+
+		start = end + 1;
+	}
+
+	if (this->recordings.empty())
+	{
+		std::cout << "		No recordings to replay, falling back to the dummy pattern. Set OCT_REPLAY_FILES to some .img files\n";
+	}
+}
+
+void SDOCT::CleanDataHandler()
+{
+	for (size_t i = 0; i < this->recordings.size(); i++)
+	{
+		unmapRecording(this->recordings[i]);
+	}
+	this->recordings.clear();
+	this->nextRecording = 0;
+	this->nextBScan = 0;
+}
+
+bool SDOCT::mapRecording(Recording& recording)
+{
+	recording.voxels = 0;
+	recording.mapping = 0;
+	recording.mappingSize = 0;
+
+#ifdef _WIN32
+	recording.file = CreateFileA(recording.path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	recording.mappingHandle = NULL;
+	LARGE_INTEGER size;
+	if (recording.file == INVALID_HANDLE_VALUE || !GetFileSizeEx(recording.file, &size))
+	{
+		std::cout << "		Couldn't open " << recording.path << "\n";
+		recording.file = INVALID_HANDLE_VALUE;
+		return false;
+	}
+	recording.mappingSize = (size_t)size.QuadPart;
+	recording.mappingHandle = CreateFileMappingA(recording.file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (recording.mappingHandle)
+	{
+		recording.mapping = MapViewOfFile(recording.mappingHandle, FILE_MAP_READ, 0, 0, 0);
+	}
+#else
+	int file = open(recording.path.c_str(), O_RDONLY);
+	struct stat status;
+	if (file < 0 || fstat(file, &status) != 0)
+	{
+		std::cout << "		Couldn't open " << recording.path << "\n";
+		if (file >= 0)
+		{
+			close(file);
+		}
+		return false;
+	}
+	recording.mappingSize = (size_t)status.st_size;
+	if (recording.mappingSize > 0)
+	{
+		recording.mapping = mmap(0, recording.mappingSize, PROT_READ, MAP_PRIVATE, file, 0);
+		if (recording.mapping == MAP_FAILED)
+		{
+			recording.mapping = 0;
+		}
+		else
+		{
+			//Read front to back, B-scan after B-scan
+			madvise(recording.mapping, recording.mappingSize, MADV_SEQUENTIAL);
+		}
+	}
+	//The mapping keeps the file alive
+	close(file);
+#endif
+
+	if (!recording.mapping)
+	{
+		std::cout << "		Couldn't map " << recording.path << "\n";
+		unmapRecording(recording);
+		return false;
+	}
+
+	const uint8_t* header = (const uint8_t*)recording.mapping;
+	if (recording.mappingSize < 512)
+	{
+		std::cout << "		" << recording.path << " is too short for a header\n";
+		unmapRecording(recording);
+		return false;
+	}
+
+	//Same header the server sends. Files of the GUI software leave the format bytes at 0, which is 8 bit
+	recording.ysteps = OCT_HeaderLayout::YCount::read(header);
+	recording.xsteps = OCT_HeaderLayout::XCount::read(header);
+	recording.zsteps = OCT_HeaderLayout::ZCount::read(header);
+	recording.format = OCT_HeaderLayout::Format::read(header);
+	uint32_t bytesPerVoxel = OCT_HeaderLayout::BytesPerVoxel::read(header);
+	if (!OCT_Voxel::isSupported(recording.format) || bytesPerVoxel != OCT_Voxel::size(recording.format))
+	{
+		recording.format = OCT_Voxel::UInt8;
+	}
+	recording.cameraPixels = recording.format == OCT_Voxel::RawSpectra ? OCT_HeaderLayout::CameraPixels::read(header) : 0;
+	recording.bitDepth = recording.format == OCT_Voxel::RawSpectra ? OCT_HeaderLayout::BitDepth::read(header) : 0;
+
+	const uint64_t voxelBytes = (uint64_t)recording.xsteps * recording.ysteps * recording.zsteps * OCT_Voxel::size(recording.format);
+	if (voxelBytes == 0 || 512 + voxelBytes > recording.mappingSize)
+	{
+		std::cout << "		" << recording.path << " doesn't hold the " << recording.xsteps << "x" << recording.ysteps << "x" << recording.zsteps << " voxels its header announces\n";
+		unmapRecording(recording);
+		return false;
+	}
+
+	recording.voxels = header + 512;
+	return true;
+}
+
+void SDOCT::unmapRecording(Recording& recording)
+{
+#ifdef _WIN32
+	if (recording.mapping)
+	{
+		UnmapViewOfFile(recording.mapping);
+	}
+	if (recording.mappingHandle)
+	{
+		CloseHandle(recording.mappingHandle);
+	}
+	if (recording.file != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(recording.file);
+	}
+	recording.mappingHandle = NULL;
+	recording.file = INVALID_HANDLE_VALUE;
+#else
+	if (recording.mapping)
+	{
+		munmap(recording.mapping, recording.mappingSize);
+	}
+#endif
+	recording.mapping = 0;
+	recording.voxels = 0;
+}
+
+//Setters
+void SDOCT::setXRange(double xrange)
+{
+	this->xrange = xrange;
+	std::cout << "xrange set to " << xrange << std::endl;
+}
+
+void SDOCT::setYRange(double yrange)
+{
+	this->yrange = yrange;
+	std::cout << "yrange set to " << yrange << std::endl;
+}
+
+void SDOCT::setZRange(double zrange)
+{
+	this->zrange = zrange;
+	std::cout << "zrange set to " << zrange << std::endl;
+}
+
+void SDOCT::setXOffset(double xoffset)
+{
+	this->xoffset = xoffset;
+	std::cout << "xoffset set to " << xoffset << std::endl;
+}
+
+void SDOCT::setYOffset(double yoffset)
+{
+	this->yoffset = yoffset;
+	std::cout << "yoffset set to " << yoffset << std::endl;
+}
+
+void SDOCT::setXSteps(int xsteps)
+{
+	this->xsteps = xsteps;
+	std::cout << "xsteps set to " << xsteps << std::endl;
+}
+
+void SDOCT::setYSteps(int ysteps)
+{
+	this->ysteps = ysteps;
+	std::cout << "ysteps set to " << ysteps << std::endl;
+}
+
+void SDOCT::setZSteps(int zsteps)
+{
+	this->zsteps = zsteps;
+	std::cout << "zsteps set to " << zsteps << std::endl;
+}
+
+//Maps the dB window [fMaxSigAmplitude - dBRange, fMaxSigAmplitude] onto 0..1, applies Contrast as gain and Brightness as offset on that, and scales the result to 0..255
+//Folded into a single scale and offset so captureVolScan only does one multiply-add per voxel
+void SDOCT::setAScanProperties(double Contrast, double Brightness, double dBRange, double fMaxSigAmplitude)
+{
+	if (dBRange <= 0.0)
+	{
+		dBRange = 1.0;
+	}
+
+	this->windowScale = (float)(255.0 * Contrast / dBRange);
+	this->windowOffset = (float)(255.0 * (Brightness - Contrast * (fMaxSigAmplitude - dBRange) / dBRange));
+	std::cout << "A-scan properties set to contrast " << Contrast << ", brightness " << Brightness << ", dB range " << dBRange << ", max amplitude " << fMaxSigAmplitude << std::endl;
+}
+
+void SDOCT::setVoxelFormat(uint32_t format)
+{
+	this->voxelFormat = OCT_Voxel::isSupported(format) ? format : (uint32_t)OCT_Voxel::UInt8;
+	std::cout << "voxel format set to " << this->voxelFormat << std::endl;
+}
+
+uint32_t SDOCT::getVoxelFormat()
+{
+	return this->voxelFormat;
+}
+
+void SDOCT::setCrop(uint32_t xstart, uint32_t xcount, uint32_t ystart, uint32_t ycount, uint32_t zstart, uint32_t zcount)
+{
+	this->cropXStart = xstart;
+	this->cropXCount = xcount;
+	this->cropYStart = ystart;
+	this->cropYCount = ycount;
+	this->cropZStart = zstart;
+	this->cropZCount = zcount;
+	std::cout << "crop set to x " << xstart << "+" << xcount << ", y " << ystart << "+" << ycount << ", z " << zstart << "+" << zcount << std::endl;
+}
+
+void SDOCT::setAveraging(uint32_t averaging)
+{
+	this->averaging = std::max(averaging, 1u);
+	std::cout << "averaging set to " << this->averaging << std::endl;
+}
+
+uint32_t SDOCT::getAveraging()
+{
+	return this->averaging;
+}
+
+uint32_t SDOCT::getCameraPixels()
+{
+	for (size_t i = 0; i < this->recordings.size(); i++)
+	{
+		if (this->recordings[i].cameraPixels != 0 && this->recordings[i].zsteps == this->recordings[i].cameraPixels)
+		{
+			return this->recordings[i].cameraPixels;
+		}
+	}
+	return ReplayCameraPixels;
+}
+
+uint32_t SDOCT::getCameraBitDepth()
+{
+	for (size_t i = 0; i < this->recordings.size(); i++)
+	{
+		if (this->recordings[i].cameraPixels != 0 && this->recordings[i].zsteps == this->recordings[i].cameraPixels)
+		{
+			return this->recordings[i].bitDepth;
+		}
+	}
+	return ReplayCameraBitDepth;
+}
+
+//Getters
+int SDOCT::getXSteps()
+{
+	return this->xsteps;
+}
+
+int SDOCT::getYSteps()
+{
+	return this->ysteps;
+}
+
+int SDOCT::getZSteps()
+{
+	return this->zsteps;
+}
+
+double SDOCT::getXOffset()
+{
+	return this->xoffset;
+}
+
+double SDOCT::getYOffset()
+{
+	return this->yoffset;
+}
+
+double SDOCT::getXRange()
+{
+	return this->xrange;
+}
+
+double SDOCT::getYRange()
+{
+	return this->yrange;
+}
+
+double SDOCT::getZRange()
+{
+	return this->zrange;
+}
+
+void SDOCT::captureVolScan(OCT_Buffer& result)
+{
+	captureVolScan(result, BScanHandler());
+}
+
+void SDOCT::captureVolScan(OCT_Buffer& result, const BScanHandler& onBScan)
+{
+	//Only the region of interest is ever converted and stored
+	uint32_t xstart = this->cropXStart, xcount = this->cropXCount;
+	uint32_t ystart = this->cropYStart, ycount = this->cropYCount;
+	uint32_t zstart = this->cropZStart, zcount = this->cropZCount;
+	OCT_Voxel::clampWindow(this->xsteps, xstart, xcount);
+	OCT_Voxel::clampWindow(this->ysteps, ystart, ycount);
+	const bool raw = this->voxelFormat == OCT_Voxel::RawSpectra;
+	const uint32_t pixels = getCameraPixels();
+	OCT_Voxel::clampWindow(raw ? pixels : this->zsteps, zstart, zcount);
+
+	const size_t bscanBytes = (size_t)xcount * zcount * OCT_Voxel::size(this->voxelFormat);
+	const size_t volumeStart = result.size();
+	result.resize(volumeStart + bscanBytes * ycount);
+
+	if (bscanBytes == 0)
+	{
+		return;
+	}
+
+	if (raw)
+	{
+		this->rawBuffer.resize((size_t)this->xsteps * pixels);
+	}
+	else
+	{
+		this->bscanBuffer.resize((size_t)this->xsteps * this->zsteps);
+	}
+
+	//Every recorded B-scan is replayed as many times as there are repeats, and only their average is converted. Raw spectra are never averaged
+	this->averager.reset(raw ? 1 : this->averaging, this->zsteps, xstart, xcount);
+	const uint32_t repeats = this->averager.repeats();
+
+	//B-scans fall due on the line clock from the start of the capture. Each one arrives some random time after it is due, but the next one is due on time again, like the driver of a real device handing over frames
+	const double bscanTime = this->xsteps * 1000000000.0 / this->lineRate;
+	boost::random::normal_distribution<double> delay(0.0, this->jitter * bscanTime);
+	const uint64_t start = OCT_Trace::now();
+
+	for (uint32_t n = 0; n < this->ysteps * repeats; n++)
+	{
+		//Acquisition n is repeat n % repeats of the B-scan at position n / repeats, and the last repeat moves the recording on
+		const uint32_t i = n / repeats;
+		const bool last = n % repeats == repeats - 1;
+		{
+			OCT_Trace::Scope trace("getRawData", "bscan", i);
+			const uint64_t arrival = start + (uint64_t)((n + 1) * bscanTime + fabs(delay(this->random)));
+			const uint64_t now = OCT_Trace::now();
+			if (arrival > now)
+			{
+				boost::this_thread::sleep(boost::posix_time::microseconds((boost::int64_t)((arrival - now) / 1000)));
+			}
+		}
+
+		//B-scans outside the region of interest are taken off the recording, but aren't processed
+		if (i < ystart || i >= ystart + ycount)
+		{
+			replayBScan(false, last);
+			continue;
+		}
+
+		{
+			OCT_Trace::Scope trace("executeProcessing", "bscan", i);
+			replayBScan(true, last);
+		}
+
+		const float* average = 0;
+		if (!raw)
+		{
+			OCT_Trace::Scope trace("average", "bscan", i);
+			average = this->averager.add(&this->bscanBuffer[0], n % repeats);
+		}
+		if (!raw && !average)
+		{
+			continue;
+		}
+
+		uint8_t* bscanVoxels = &result[volumeStart + (i - ystart) * bscanBytes];
+		if (raw)
+		{
+			OCT_Trace::Scope trace("copyRaw", "bscan", i);
+			OCT_Voxel::copyRawWindow(&this->rawBuffer[0], pixels, xstart, xcount, zstart, zcount, bscanVoxels);
+		}
+		else
+		{
+			OCT_Trace::Scope trace("convert", "bscan", i);
+			OCT_Voxel::convertBScanWindow(this->voxelFormat, average, this->zsteps, 0, xcount, zstart, zcount, bscanVoxels, this->windowScale, this->windowOffset);
+		}
+
+		if (onBScan)
+		{
+			onBScan(bscanVoxels, bscanBytes);
+		}
+	}
+}
+
+//Recorded voxels are window outputs already. They go back as floats on the 0..255 scale of the default window, which maps them onto the same 8 bit voxels again, so a client's window acts on them as on processed dB values
+//Takes the nearest recorded A-scan and depth, which is every one of them when the sizes match
+template <typename T>
+static void resampleBScan(const uint8_t* voxels, uint32_t recordedX, uint32_t recordedZ, float scale, float* out, uint32_t xsteps, uint32_t zsteps)
+{
+	for (uint32_t x = 0; x < xsteps; x++)
+	{
+		const uint8_t* ascan = voxels + (size_t)((uint64_t)x * recordedX / xsteps) * recordedZ * sizeof(T);
+		for (uint32_t z = 0; z < zsteps; z++)
+		{
+			T value;
+			memcpy(&value, ascan + (size_t)((uint64_t)z * recordedZ / zsteps) * sizeof(T), sizeof(T));
+			out[z] = (float)value * scale;
+		}
+		out += zsteps;
+	}
+}
+
+void SDOCT::replayBScan(bool process, bool advance)
+{
+	std::vector<float>& bscan = this->bscanBuffer;
+
+	//Spectra for raw captures. Whole raw spectra of the camera are replayed nearest A-scan, anything else holds no spectra of it, so they are made up instead
+	if (process && this->voxelFormat == OCT_Voxel::RawSpectra)
+	{
+		const uint32_t pixels = getCameraPixels();
+		const Recording* recording = this->recordings.empty() ? 0 : &this->recordings[this->nextRecording];
+		if (recording && recording->cameraPixels == pixels && recording->zsteps == pixels)
+		{
+			const uint16_t* spectra = (const uint16_t*)recording->voxels + (size_t)this->nextBScan * recording->xsteps * pixels;
+			for (uint32_t x = 0; x < this->xsteps; x++)
+			{
+				memcpy(&this->rawBuffer[(size_t)x * pixels], spectra + (size_t)((uint64_t)x * recording->xsteps / this->xsteps) * pixels, pixels * sizeof(uint16_t));
+			}
+		}
+		else
+		{
+			OCT_Processor::synthesizeSpectra(&this->rawBuffer[0], pixels, this->xsteps, OCT_Processor::fftSizeFor(pixels, 0), std::vector<float>(), this->nextBScan);
+		}
+		process = false;
+	}
+
+	if (this->recordings.empty())
+	{
+		if (process)
+		{
+			for (size_t v = 0; v < bscan.size(); v++)
+			{
+				bscan[v] = (float)(this->nextBScan % 16 + 10 + (v % this->zsteps) % 16);
+			}
+		}
+		if (advance)
+		{
+			this->nextBScan++;
+		}
+		return;
+	}
+
+	const Recording& recording = this->recordings[this->nextRecording];
+	if (process)
+	{
+		const size_t bytesPerVoxel = OCT_Voxel::size(recording.format);
+		const uint8_t* voxels = recording.voxels + (size_t)this->nextBScan * recording.xsteps * recording.zsteps * bytesPerVoxel;
+
+		//Spectra of raw recordings show as the 16 bit values they are
+		if (recording.format == OCT_Voxel::UInt16 || recording.format == OCT_Voxel::RawSpectra)
+		{
+			resampleBScan<uint16_t>(voxels, recording.xsteps, recording.zsteps, 1.0f / 257.0f, &bscan[0], this->xsteps, this->zsteps);
+		}
+		else if (recording.format == OCT_Voxel::Float32)
+		{
+			resampleBScan<float>(voxels, recording.xsteps, recording.zsteps, 1.0f, &bscan[0], this->xsteps, this->zsteps);
+		}
+		else
+		{
+			resampleBScan<uint8_t>(voxels, recording.xsteps, recording.zsteps, 1.0f, &bscan[0], this->xsteps, this->zsteps);
+		}
+	}
+
+	//Goes on with the next file after the last B-scan of this one
+	if (advance && ++this->nextBScan >= recording.ysteps)
+	{
+		this->nextBScan = 0;
+		this->nextRecording = (this->nextRecording + 1) % this->recordings.size();
+	}
+}
@@ -0,0 +1,149 @@
+#ifndef REPLAY_SDOCT_H
+#define REPLAY_SDOCT_H
+
+#include "string"
+#include "iostream"
+#include "vector"
+#include "iterator"
+#include <stdint.h>
+
+#include <boost/function.hpp>
+#include <boost/random/mersenne_twister.hpp>
+
+#include "OCT_Averager.h"
+#include "OCT_Buffer.h"
+#include "OCT_Quantize.h"
+
+
+using namespace std;
+
+//Called by captureVolScan for every B-scan as soon as it is processed, with a pointer to its voxels and their size in bytes, whatever the voxel format. The rest of the volume is still being acquired while it runs
+typedef boost::function<void (const uint8_t*, size_t)> BScanHandler;
+
+
+//Stand-in for the device that replays recorded .img volumes (512 byte header + voxels, as the GUI software and this server write them) instead of scanning, so pipeline, compression and throughput work can be measured on real data without the SpectralRadar SDK
+//Built in place of SDOCT.cpp or Dummy SDOCT.cpp. It is configured through the environment, read by Init whenever the device session opens:
+//  OCT_REPLAY_FILES     : .img files to replay, separated by ';'. They are memory mapped and their B-scans replayed one after the other, going on where the last capture stopped and starting over after the last one
+//  OCT_REPLAY_LINE_RATE : A-scans per second, 5500 by default like the real device. Every B-scan takes xsteps of them
+//  OCT_REPLAY_JITTER    : Standard deviation of the delay of each B-scan past its due time, as a fraction of the B-scan time. 0.05 by default. B-scans stay due on the line clock, so the delays never add up
+//Recordings of another size than the one asked for are resampled to it, nearest voxel. Without any recording it falls back to the pattern of the Dummy SDOCT
+//Raw spectra are replayed from recordings of whole raw spectra, and made up like the Dummy SDOCT's when there are none
+class SDOCT
+{
+public:
+
+	SDOCT();
+	~SDOCT();
+
+	void Init();
+	void Close();
+
+	void InitDataHandler();
+	void CleanDataHandler();
+
+	int getXSteps();
+	int getYSteps();
+	int getZSteps();
+	void setXSteps(int);
+	void setYSteps(int);
+	void setZSteps(int);
+
+	double getXRange();
+	double getYRange();
+	double getZRange();
+	void setXRange(double);
+	void setYRange(double);
+	void setZRange(double);
+
+	double getXOffset();
+	double getYOffset();
+	void setXOffset(double);
+	void setYOffset(double);
+
+	void captureVolScan(OCT_Buffer&);
+	void captureVolScan(OCT_Buffer&, const BScanHandler&);
+
+	void setAScanProperties(double Contrast, double Brightness, double dBRange, double fMaxSigAmplitude);
+
+	//One of OCT_Voxel::Format. captureVolScan converts every B-scan into it while the next one is being acquired
+	uint32_t getVoxelFormat();
+	void setVoxelFormat(uint32_t);
+
+	//Region of interest captureVolScan cuts out of the scan before converting anything: count voxels from start on along each axis, where a count of 0 means up to the end. Y picks B-scans, X A-scans within them and Z depths within those
+	//With raw spectra Z picks camera pixels instead
+	void setCrop(uint32_t xstart, uint32_t xcount, uint32_t ystart, uint32_t ycount, uint32_t zstart, uint32_t zcount);
+
+	//B-scans captureVolScan replays at every Y position and averages into the one it converts. Raw spectra are never averaged
+	uint32_t getAveraging();
+	void setAveraging(uint32_t);
+
+	//Camera of the first recording of whole raw spectra, or a made up one of 2048 pixels and 12 bits
+	uint32_t getCameraPixels();
+	uint32_t getCameraBitDepth();
+
+
+private:
+	//One memory mapped .img file. voxels points right behind its header
+	struct Recording
+	{
+		std::string path;
+		const uint8_t* voxels;
+		void* mapping;
+		size_t mappingSize;
+#ifdef _WIN32
+		void* file;
+		void* mappingHandle;
+#endif
+		uint32_t xsteps, ysteps, zsteps;
+		uint32_t format;
+
+		//Camera the spectra of a raw recording came from, 0 for the other formats
+		uint32_t cameraPixels, bitDepth;
+	};
+
+	//Settings
+	double xrange, yrange, zrange;
+	double xoffset, yoffset;
+	uint32_t xsteps, ysteps, zsteps;
+
+	//Float to 8 bit voxel mapping set by setAScanProperties: voxel = clamp(value * windowScale + windowOffset, 0, 255)
+	float windowScale;
+	float windowOffset;
+
+	//Voxel type captureVolScan produces
+	uint32_t voxelFormat;
+
+	//B-scans per Y position set by setAveraging, and the sum they are averaged in
+	uint32_t averaging;
+	OCT_Averager averager;
+
+	//Region of interest set by setCrop. Fitted into the steps only when the capture starts, as they might change after it
+	uint32_t cropXStart, cropXCount;
+	uint32_t cropYStart, cropYCount;
+	uint32_t cropZStart, cropZCount;
+
+	//Recordings mapped by Init, and the one and B-scan the next capture goes on from
+	std::vector<Recording> recordings;
+	size_t nextRecording;
+	uint32_t nextBScan;
+
+	//Timing read by Init
+	double lineRate;
+	double jitter;
+	boost::random::mt19937 random;
+
+	//Processed float B-scan the recorded one is turned back into, so every capture runs the same conversion as on the real device. Kept across captures so it only gets allocated for the first one of its size
+	std::vector<float> bscanBuffer;
+
+	//Raw spectra of the B-scan being replayed, for raw captures
+	std::vector<uint16_t> rawBuffer;
+
+	//Maps the file and checks its header. Returns false, logging why, for anything that isn't a complete .img volume
+	bool mapRecording(Recording&);
+	void unmapRecording(Recording&);
+
+	//Takes the next recorded B-scan. With process set it fills bscanBuffer with it, resampled to the steps, or rawBuffer with its spectra for raw captures. Unless advance is set, the next call takes the same one again
+	void replayBScan(bool process, bool advance);
+};
+
+#endif
@@ -1,6 +1,16 @@
 #include "SDOCT.h"
+#include "OCT_Quantize.h"
+#include "OCT_Trace.h"
 
-SDOCT::SDOCT() : xrange(NULL), xsteps(NULL), yrange(NULL), ysteps(NULL)
+#include <stdexcept>
+#include <stdlib.h>
+
+#include <boost/thread/thread.hpp>
+
+//Scan patterns kept by captureVolScan. Each one holds the SDK's mirror positions for a geometry
+const size_t PatternCacheSize = 8;
+
+SDOCT::SDOCT() : xrange(NULL), xsteps(NULL), yrange(NULL), ysteps(NULL), xshift(0.0), yshift(0.0), angle(0.0), windowScale(1.0f), windowOffset(0.0f), voxelFormat(OCT_Voxel::UInt8), averaging(1), cropXStart(0), cropXCount(0), cropYStart(0), cropYCount(0), cropZStart(0), cropZCount(0), patternHits(0), patternMisses(0)
 {
 	//Init OCT device
 	//Init();
@@ -25,6 +35,23 @@ void SDOCT::Init()
 	//Setup internal data processing
 	this->proc = createProcessingForDevice(this->dev);
 
+	//Spectra get processed in here rather than by the SDK when asked for, on a thread per core unless told otherwise
+	const char* processing = getenv("OCT_PROCESSING");
+	if (processing && std::string(processing) == "builtin" && !this->processor)
+	{
+		const char* threads = getenv("OCT_PROCESSING_THREADS");
+		const unsigned int numThreads = std::max(1u, threads ? (unsigned int)atoi(threads) : boost::thread::hardware_concurrency());
+		this->processor.reset(new OCT_Processor(numThreads));
+
+		//Without a chirp the spectrometer has to be linear in k already
+		const char* chirpFile = getenv("OCT_PROCESSING_CHIRP");
+		this->chirp = chirpFile ? OCT_Processor::readChirp(chirpFile) : std::vector<float>();
+		std::cout << "		Processing spectra on " << numThreads << " threads with " << (this->chirp.empty() ? "no chirp" : "the chirp of ") << (chirpFile ? chirpFile : "") << "\n";
+	}
+
+	//The data handles live as long as the device, so every scan reuses them
+	InitDataHandler();
+
 	//Start up the probe with some valid default values
 	//setXRange(5.0);
 //	setYRange(5.0);
@@ -36,6 +63,14 @@ void SDOCT::Init()
 
 void SDOCT::Close()
 {
+	//Nothing may still be reading the raw data
+	if (this->processor)
+	{
+		this->processor->wait();
+	}
+	clearScanPatterns();
+	CleanDataHandler();
+	closeProcessing(this->proc);
 	closeProbe(this->probe);
 	closeDevice(this->dev);	
 	std::cout << "		Closing probe\n";
@@ -46,6 +81,7 @@ void SDOCT::InitDataHandler()
 {	
 	std::cout << "		Initializing data handlers\n";
 	this->rawhandle = createRawData();
+	this->rawhandle2 = createRawData();
 	this->datahandle = createData();
 	this->voldata = createData();
 	this->colorhandle = createColoredData();
@@ -58,6 +94,7 @@ void SDOCT::CleanDataHandler()
 {	
 	std::cout << "		Cleaning data handlers\n";
 	clearRawData(this->rawhandle);
+	clearRawData(this->rawhandle2);
 	clearData(this->datahandle);
 	//clearData(this->voldata);
 	clearColoredData(this->colorhandle);
@@ -114,6 +151,63 @@ void SDOCT::setZSteps(int zsteps)
 	std::cout << "zsteps set to " << zsteps << std::endl;
 }
 
+//Maps the dB window [fMaxSigAmplitude - dBRange, fMaxSigAmplitude] onto 0..1, applies Contrast as gain and Brightness as offset on that, and scales the result to 0..255
+//Folded into a single scale and offset so captureVolScan only does one multiply-add per voxel
+void SDOCT::setAScanProperties(double Contrast, double Brightness, double dBRange, double fMaxSigAmplitude)
+{
+	if (dBRange <= 0.0)
+	{
+		dBRange = 1.0;
+	}
+
+	this->windowScale = (float)(255.0 * Contrast / dBRange);
+	this->windowOffset = (float)(255.0 * (Brightness - Contrast * (fMaxSigAmplitude - dBRange) / dBRange));
+	std::cout << "A-scan properties set to contrast " << Contrast << ", brightness " << Brightness << ", dB range " << dBRange << ", max amplitude " << fMaxSigAmplitude << std::endl;
+}
+
+void SDOCT::setVoxelFormat(uint32_t format)
+{
+	this->voxelFormat = OCT_Voxel::isSupported(format) ? format : (uint32_t)OCT_Voxel::UInt8;
+	std::cout << "voxel format set to " << this->voxelFormat << std::endl;
+}
+
+uint32_t SDOCT::getVoxelFormat()
+{
+	return this->voxelFormat;
+}
+
+void SDOCT::setAveraging(uint32_t averaging)
+{
+	this->averaging = std::max(averaging, 1u);
+	std::cout << "averaging set to " << this->averaging << std::endl;
+}
+
+uint32_t SDOCT::getAveraging()
+{
+	return this->averaging;
+}
+
+uint32_t SDOCT::getCameraPixels()
+{
+	return (uint32_t)getDevicePropertyInt(this->dev, Device_SpectrumElements);
+}
+
+uint32_t SDOCT::getCameraBitDepth()
+{
+	return (uint32_t)getDevicePropertyInt(this->dev, Device_BitDepth);
+}
+
+void SDOCT::setCrop(uint32_t xstart, uint32_t xcount, uint32_t ystart, uint32_t ycount, uint32_t zstart, uint32_t zcount)
+{
+	this->cropXStart = xstart;
+	this->cropXCount = xcount;
+	this->cropYStart = ystart;
+	this->cropYCount = ycount;
+	this->cropZStart = zstart;
+	this->cropZCount = zcount;
+	std::cout << "crop set to x " << xstart << "+" << xcount << ", y " << ystart << "+" << ycount << ", z " << zstart << "+" << zcount << std::endl;
+}
+
 //Getters
 int SDOCT::getXSteps()
 {
@@ -155,63 +249,120 @@ double SDOCT::getZRange()
 	return this->zrange;
 }
 
-void SDOCT::captureVolScan(std::vector<uint8_t>& result)
+void SDOCT::captureVolScan(OCT_Buffer& result)
+{
+	captureVolScan(result, BScanHandler());
+}
+
+void SDOCT::captureVolScan(OCT_Buffer& result, const BScanHandler& onBScan)
 {	
 	try
 	{
 		std::cout << "		Capturing volume scan\n";
-		InitDataHandler();
 
-		this->pattern = createBScanStackPattern(this->probe, this->xrange, this->xsteps, this->yrange, this->ysteps);
+		//Raw spectra go out as acquired, so they never get repeats to average
+		const uint32_t repeats = this->voxelFormat == OCT_Voxel::RawSpectra ? 1 : this->averaging;
+		{
+			OCT_Trace::Scope trace("scanPattern");
+			this->pattern = getScanPattern(repeats);
+		}
 
 		setColoringBoundaries(this->color32handle, 0.0f, 70.0f);
 
-		rotateScanPattern(this->pattern, 0.0);
-		shiftScanPattern(this->pattern, 0.0, 0.0);
+		//Only the region of interest is ever converted and stored
+		const unsigned int bscansize = (this->xsteps) * (this->zsteps);
+		uint32_t xstart = this->cropXStart, xcount = this->cropXCount;
+		uint32_t ystart = this->cropYStart, ycount = this->cropYCount;
+		uint32_t zstart = this->cropZStart, zcount = this->cropZCount;
+		OCT_Voxel::clampWindow(this->xsteps, xstart, xcount);
+		OCT_Voxel::clampWindow(this->ysteps, ystart, ycount);
+		OCT_Voxel::clampWindow(this->voxelFormat == OCT_Voxel::RawSpectra ? getCameraPixels() : this->zsteps, zstart, zcount);
+
+		//The whole volume is allocated up front, so every B-scan gets converted straight into its final place in the voxel format asked for
+		const size_t bscanBytes = (size_t)xcount * zcount * OCT_Voxel::size(this->voxelFormat);
+		const size_t volumeStart = result.size();
+		result.resize(volumeStart + bscanBytes * ycount);
 
-		int size = this->xsteps*this->ysteps*this->zsteps;
-		result.reserve(size+512);
+		//Every repeat of a position is added up right after it is processed, and only their average is converted
+		this->averager.reset(repeats, this->zsteps, xstart, xcount);
 
 		std::cout << "		Measurement starting\n";
-		startMeasurement(this->dev, this->pattern, Acquisition_AsyncFinite);
+		{
+			OCT_Trace::Scope trace("startMeasurement");
+			startMeasurement(this->dev, this->pattern, Acquisition_AsyncFinite);
+		}
 		std::cout << "		Starting for loop\n";
-		
-		unsigned char temp = NULL;
-
-		const unsigned int bscansize = (this->xsteps) * (this->zsteps);
-		float* bscan = new float[bscansize];
 
-		for (int i = 0; i < this->ysteps; i++)
+		if (this->voxelFormat == OCT_Voxel::RawSpectra)
 		{
-			stringstream stream;
-			stream.width(4);
-
-			//get data from oct
-			getRawData(this->dev, this->rawhandle);
-			//set output object
-			setProcessedDataOutput(this->proc, this->datahandle);
-			setColoredDataOutput(this->proc, this->colorhandle, this->color32handle);
-			//apply fourier trafo
-			executeProcessing(this->proc, this->rawhandle);
-			
-
-			this->voldata = createData();
-			appendData(this->voldata, this->datahandle, Direction_3);
-			this->data = getDataPtr(this->voldata);
-			std::copy(this->data, this->data + bscansize, std::back_inserter(result));
-			clearData(voldata);
+			captureRaw(result, volumeStart, bscanBytes, xstart, xcount, ystart, ycount, zstart, zcount, onBScan);
+		}
+		else if (this->processor)
+		{
+			captureWithProcessor(result, volumeStart, bscanBytes, xstart, xcount, ystart, ycount, zstart, zcount, onBScan);
+		}
+		else
+		{
+			//The pattern has the repeats of every position one after the other, so acquisition n is repeat n % repeats of the B-scan at position n / repeats
+			for (uint32_t n = 0; n < this->ysteps * repeats; n++)
+			{
+				const uint32_t i = n / repeats;
+
+				//get data from oct
+				{
+					OCT_Trace::Scope trace("getRawData", "bscan", i);
+					getRawData(this->dev, this->rawhandle);
+				}
+
+				//B-scans outside the region of interest have to be taken off the device, but aren't processed
+				if (i < ystart || i >= ystart + ycount)
+				{
+					continue;
+				}
+
+				{
+					OCT_Trace::Scope trace("executeProcessing", "bscan", i);
+					//set output object
+					setProcessedDataOutput(this->proc, this->datahandle);
+					setColoredDataOutput(this->proc, this->colorhandle, this->color32handle);
+					//apply fourier trafo
+					executeProcessing(this->proc, this->rawhandle);
+				}
+
+				//Converted straight out of the processing output. Appending it to a fresh data object first only made the SDK allocate and copy every B-scan
+				this->data = getDataPtr(this->datahandle);
+				const float* average;
+				{
+					OCT_Trace::Scope trace("average", "bscan", i);
+					average = this->averager.add(this->data, n % repeats);
+				}
+				if (!average)
+				{
+					continue;
+				}
+
+				uint8_t* bscanVoxels = &result[volumeStart + (i - ystart) * bscanBytes];
+				{
+					OCT_Trace::Scope trace("convert", "bscan", i);
+					OCT_Voxel::convertBScanWindow(this->voxelFormat, average, this->zsteps, 0, xcount, zstart, zcount, bscanVoxels, this->windowScale, this->windowOffset);
+				}
+
+				//Hands the freshly processed B-scan over while the device keeps acquiring the next ones. result was sized above, so the pointer stays valid
+				if (onBScan)
+				{
+					onBScan(bscanVoxels, bscanBytes);
+				}
 			
+			}
 		}
 		std::cout << "		Measurement stopping\n";
-		stopMeasurement(this->dev);
+		{
+			OCT_Trace::Scope trace("stopMeasurement");
+			stopMeasurement(this->dev);
+		}
 		std::cout << "		Getting data pointer\n";
-		
-		//clean up data handlers and objects
-		clearScanPattern(this->pattern);
-		CleanDataHandler();		
-		closeProcessing(proc);
 
-		delete bscan;
+		//The scan pattern stays in the cache for the next scan. Data handlers and processing stay alive until Close
 	}
 	catch(...)
 	{
@@ -219,6 +370,193 @@ void SDOCT::captureVolScan(std::vector<uint8_t>& result)
 	}
 }
 
+ScanPatternHandle SDOCT::getScanPattern(uint32_t repeats)
+{
+	//The offsets are applied by the probe when a pattern is created, so they are part of its geometry
+	const double xoffset = getProbeParameterFloat(this->probe, Probe_OffsetX);
+	const double yoffset = getProbeParameterFloat(this->probe, Probe_OffsetY);
+
+	for (std::list<CachedPattern>::iterator it = this->patternCache.begin(); it != this->patternCache.end(); ++it)
+	{
+		if (it->xrange == this->xrange && it->xsteps == this->xsteps && it->yrange == this->yrange && it->ysteps == this->ysteps && it->xoffset == xoffset && it->yoffset == yoffset
+			&& it->xshift == this->xshift && it->yshift == this->yshift && it->angle == this->angle && it->repeats == repeats)
+		{
+			//Moves it to the front, as the most recently used
+			this->patternCache.splice(this->patternCache.begin(), this->patternCache, it);
+			this->patternHits++;
+			return this->patternCache.front().pattern;
+		}
+	}
+
+	CachedPattern created;
+	created.xrange = this->xrange;
+	created.xsteps = this->xsteps;
+	created.yrange = this->yrange;
+	created.ysteps = this->ysteps;
+	created.xoffset = xoffset;
+	created.yoffset = yoffset;
+	created.xshift = this->xshift;
+	created.yshift = this->yshift;
+	created.angle = this->angle;
+	created.repeats = repeats;
+
+	//The probe repeats every B-scan of the stack that many times at the same position, one right after the other
+	setProbeParameterInt(this->probe, Probe_Oversampling_SlowAxis, repeats);
+	created.pattern = createBScanStackPattern(this->probe, this->xrange, this->xsteps, this->yrange, this->ysteps);
+	rotateScanPattern(created.pattern, this->angle);
+	shiftScanPattern(created.pattern, this->xshift, this->yshift);
+
+	if (this->patternCache.size() >= PatternCacheSize)
+	{
+		clearScanPattern(this->patternCache.back().pattern);
+		this->patternCache.pop_back();
+	}
+	this->patternCache.push_front(created);
+	this->patternMisses++;
+
+	std::cout << "		Created scan pattern for " << this->xsteps << "x" << this->ysteps << " (" << this->patternHits << " scans reused one, " << this->patternMisses << " created)\n";
+	return created.pattern;
+}
+
+void SDOCT::clearScanPatterns()
+{
+	for (std::list<CachedPattern>::iterator it = this->patternCache.begin(); it != this->patternCache.end(); ++it)
+	{
+		clearScanPattern(it->pattern);
+	}
+	this->patternCache.clear();
+}
+
+void SDOCT::captureWithProcessor(OCT_Buffer& result, size_t volumeStart, size_t bscanBytes, uint32_t xstart, uint32_t xcount, uint32_t ystart, uint32_t ycount, uint32_t zstart, uint32_t zcount, const BScanHandler& onBScan)
+{
+	std::vector<float>& bscan = this->bscanBuffer;
+	bscan.resize((size_t)this->xsteps * this->zsteps);
+
+	//The device fills one raw data object while the spectra of the other are processed
+	RawDataHandle raws[2] = { this->rawhandle, this->rawhandle2 };
+
+	//Acquisition n is repeat n % repeats of the B-scan at position n / repeats
+	const int repeats = (int)this->averager.repeats();
+	const int acquisitions = (int)this->ysteps * repeats;
+
+	//Acquisition whose processing is running, averaged, converted and handed over once the next one has been acquired. -1 for none
+	int processing = -1;
+	for (int n = 0; n <= acquisitions; n++)
+	{
+		const int i = n / repeats;
+		const bool inRegion = n < acquisitions && (uint32_t)i >= ystart && (uint32_t)i < ystart + ycount;
+		RawDataHandle raw = raws[n % 2];
+
+		if (n < acquisitions)
+		{
+			OCT_Trace::Scope trace("getRawData", "bscan", i);
+			getRawData(this->dev, raw);
+		}
+
+		if (processing >= 0)
+		{
+			const int position = processing / repeats;
+			{
+				OCT_Trace::Scope trace("waitProcessing", "bscan", position);
+				this->processor->wait();
+			}
+
+			const float* average;
+			{
+				OCT_Trace::Scope trace("average", "bscan", position);
+				average = this->averager.add(&bscan[0], processing % repeats);
+			}
+
+			if (average)
+			{
+				uint8_t* bscanVoxels = &result[volumeStart + (position - ystart) * bscanBytes];
+				{
+					OCT_Trace::Scope trace("convert", "bscan", position);
+					OCT_Voxel::convertBScanWindow(this->voxelFormat, average, this->zsteps, 0, xcount, zstart, zcount, bscanVoxels, this->windowScale, this->windowOffset);
+				}
+
+				if (onBScan)
+				{
+					onBScan(bscanVoxels, bscanBytes);
+				}
+			}
+			processing = -1;
+		}
+
+		if (!inRegion)
+		{
+			continue;
+		}
+
+		//Spectra of 16 bit camera values, one after the other. The A-scans of the pattern are the last ones, anything before them, like apodization spectra, is left out
+		const uint32_t pixels = getRawDataPropertyInt(raw, RawData_Size1);
+		const uint32_t lines = getRawDataPropertyInt(raw, RawData_Size2);
+		if (lines < this->xsteps)
+		{
+			//A B-scan left out would leave a hole in the volume, a streamed one short of what its header promises and the averager adding onto the last position. So it fails like any other device error. The B-scan before it is done processing by now
+			std::cout << "		Raw B-scan " << i << " has only " << lines << " spectra, dropping the capture\n";
+			throw std::runtime_error("Raw B-scan with too few spectra");
+		}
+		const uint16_t* spectra = (const uint16_t*)getRawDataPtr(raw) + (size_t)(lines - this->xsteps) * pixels;
+
+		if (this->processor->pixels() != pixels || this->processor->depths() != this->zsteps)
+		{
+			this->processor->configure(pixels, this->zsteps, this->chirp);
+		}
+
+		//The first B-scan of every capture doubles as the background, as nothing of the sample is left once its A-scans are averaged
+		if (n == (int)ystart * repeats)
+		{
+			this->processor->setBackground(spectra, this->xsteps);
+		}
+
+		//Only the A-scans of the region are processed, into their place in the B-scan where the averager picks them up
+		this->processor->start(spectra + (size_t)xstart * pixels, xcount, &bscan[(size_t)xstart * this->zsteps]);
+		processing = n;
+	}
+}
+
+void SDOCT::captureRaw(OCT_Buffer& result, size_t volumeStart, size_t bscanBytes, uint32_t xstart, uint32_t xcount, uint32_t ystart, uint32_t ycount, uint32_t zstart, uint32_t zcount, const BScanHandler& onBScan)
+{
+	const uint32_t cameraPixels = getCameraPixels();
+
+	for (int i = 0; i < (int)this->ysteps; i++)
+	{
+		{
+			OCT_Trace::Scope trace("getRawData", "bscan", i);
+			getRawData(this->dev, this->rawhandle);
+		}
+
+		if ((uint32_t)i < ystart || (uint32_t)i >= ystart + ycount)
+		{
+			continue;
+		}
+
+		//Laid out like for the built-in processing, the A-scans of the pattern being the last spectra
+		const uint32_t pixels = getRawDataPropertyInt(this->rawhandle, RawData_Size1);
+		const uint32_t lines = getRawDataPropertyInt(this->rawhandle, RawData_Size2);
+		if (lines < this->xsteps || pixels != cameraPixels)
+		{
+			//Skipping it would leave a hole in the volume and a streamed one short of what its header promises, so it fails like any other device error
+			std::cout << "		Raw B-scan " << i << " has " << lines << " spectra of " << pixels << " pixels, dropping the capture\n";
+			throw std::runtime_error("Raw B-scan of the wrong size");
+		}
+		const uint16_t* spectra = (const uint16_t*)getRawDataPtr(this->rawhandle) + (size_t)(lines - this->xsteps) * pixels;
+
+		//The SDK owns the raw data and reuses it for the next B-scan, so the spectra are copied into the volume once, as they are
+		uint8_t* bscanVoxels = &result[volumeStart + (i - ystart) * bscanBytes];
+		{
+			OCT_Trace::Scope trace("copyRaw", "bscan", i);
+			OCT_Voxel::copyRawWindow(spectra, pixels, xstart, xcount, zstart, zcount, bscanVoxels);
+		}
+
+		if (onBScan)
+		{
+			onBScan(bscanVoxels, bscanBytes);
+		}
+	}
+}
+
 unsigned long* SDOCT::getCameraPicture(int width, int height)
 {
 	getCameraImage(this->dev, width, height, this->camerahandle);
@@ -7,10 +7,22 @@
 #include "iostream"
 #include "vector"
 #include "iterator"
+#include <list>
 #include <stdint.h>
 
+#include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include "OCT_Averager.h"
+#include "OCT_Buffer.h"
+#include "OCT_Processor.h"
+#include "OCT_Quantize.h"
+
 using namespace std;
 
+//Called by captureVolScan for every B-scan as soon as it is processed, with a pointer to its voxels and their size in bytes, whatever the voxel format. The rest of the volume is still being acquired while it runs
+typedef boost::function<void (const uint8_t*, size_t)> BScanHandler;
+
 
 class SDOCT
 {
@@ -54,12 +66,29 @@ public:
 //
 //	void setAScanProperties(double Contrast, double Brightness, double dBRange, double fMaxSigAmplitude);
 	
-	void captureVolScan(std::vector<uint8_t>&);
+	void captureVolScan(OCT_Buffer&);
+	void captureVolScan(OCT_Buffer&, const BScanHandler&);
 
 	unsigned long* getCameraPicture(int width, int height);
 
 	void setAScanProperties(double Contrast, double Brightness, double dBRange, double fMaxSigAmplitude);
 
+	//One of OCT_Voxel::Format. captureVolScan converts every B-scan into it while the next one is being acquired
+	uint32_t getVoxelFormat();
+	void setVoxelFormat(uint32_t);
+
+	//Region of interest captureVolScan cuts out of the scan before converting anything: count voxels from start on along each axis, where a count of 0 means up to the end. Y picks B-scans, X A-scans within them and Z depths within those
+	//With raw spectra Z picks camera pixels instead
+	void setCrop(uint32_t xstart, uint32_t xcount, uint32_t ystart, uint32_t ycount, uint32_t zstart, uint32_t zcount);
+
+	//B-scans captureVolScan acquires at every Y position and averages into the one it converts. Raw spectra are never averaged
+	uint32_t getAveraging();
+	void setAveraging(uint32_t);
+
+	//Pixels of the spectrometer's camera and the bits of each one it fills, as the device reports them. Only valid while the device is open
+	uint32_t getCameraPixels();
+	uint32_t getCameraBitDepth();
+
 private:
 
 	//SDK Handles
@@ -70,6 +99,8 @@ private:
 
 	//SDK Data Handles
 	RawDataHandle rawhandle;
+	//Second raw buffer for the built-in processing, so the device can fill one while the other is processed
+	RawDataHandle rawhandle2;
 	DataHandle datahandle;
 	DataHandle voldata;
 	ColoredDataHandle colorhandle;
@@ -100,10 +131,58 @@ private:
 	bool BScanAttitudeFlag;
 	bool BScanSpokesFlag;
 
+	//Float to 8 bit voxel mapping set by setAScanProperties: voxel = clamp(value * windowScale + windowOffset, 0, 255)
+	float windowScale;
+	float windowOffset;
+
+	//Voxel type captureVolScan produces
+	uint32_t voxelFormat;
+
+	//B-scans per Y position set by setAveraging, and the sum they are averaged in
+	uint32_t averaging;
+	OCT_Averager averager;
+
+	//Region of interest set by setCrop. Fitted into the steps only when the capture starts, as they might change after it
+	uint32_t cropXStart, cropXCount;
+	uint32_t cropYStart, cropYCount;
+	uint32_t cropZStart, cropZCount;
+
+	//One scan pattern created by the SDK and the geometry it was created for
+	struct CachedPattern
+	{
+		double xrange, yrange;
+		uint32_t xsteps, ysteps;
+		double xoffset, yoffset;
+		double xshift, yshift, angle;
+		uint32_t repeats;
+		ScanPatternHandle pattern;
+	};
+
+	//Patterns of the last few geometries scanned, most recently used first, so repeating a protocol doesn't create the same pattern over and over. They belong to the probe, so Close clears them all
+	std::list<CachedPattern> patternCache;
+	uint64_t patternHits, patternMisses;
+
+	//Built-in processing, turned on by OCT_PROCESSING=builtin when Init runs. It replaces executeProcessing with the chirp read from the file OCT_PROCESSING_CHIRP names, if any
+	boost::scoped_ptr<OCT_Processor> processor;
+	std::vector<float> chirp;
+
+	//Processed float B-scan the built-in processing writes into
+	std::vector<float> bscanBuffer;
+
 	//Methoden
 	void UpdateBScanProperties();
 	void UpdateBScanAttitude();
 
+	//Pattern for the current geometry, with repeats B-scans at every Y position, from the cache or created, rotated and shifted. The least recently used one is cleared once there are too many
+	ScanPatternHandle getScanPattern(uint32_t repeats);
+	void clearScanPatterns();
+
+	//The B-scan loop of captureVolScan for raw spectra, copied out of the raw data as they are into the region of interest it already fitted into the camera. The measurement has to be running
+	void captureRaw(OCT_Buffer& result, size_t volumeStart, size_t bscanBytes, uint32_t xstart, uint32_t xcount, uint32_t ystart, uint32_t ycount, uint32_t zstart, uint32_t zcount, const BScanHandler& onBScan);
+
+	//The B-scan loop of captureVolScan with the built-in processing, for the region of interest it already fitted into the steps. The measurement has to be running
+	void captureWithProcessor(OCT_Buffer& result, size_t volumeStart, size_t bscanBytes, uint32_t xstart, uint32_t xcount, uint32_t ystart, uint32_t ycount, uint32_t zstart, uint32_t zcount, const BScanHandler& onBScan);
+
 };
 
 
@@ -1,6 +1,6 @@
 #include <TCP_Connection.h>
  
-TCP_Connection::TCP_Connection(boost::asio::io_service& io_service, SDOCT& oct) : m_socket(io_service), m_oct(oct)
+TCP_Connection::TCP_Connection(boost::asio::io_service& io_service, OCT_Scheduler& scheduler, OCT_Publisher& publisher, OCT_WorkerPool& encoder, OCT_BufferPool& pool, OCT_Recorder& recorder, OCT_VolumeCache& cache) : m_socket(io_service), m_strand(io_service), m_scheduler(scheduler), m_publisher(publisher), m_encoder(encoder), m_pool(pool), m_recorder(recorder), m_cache(cache), m_readBytes(0), m_readPaused(false), m_busy(false), m_droppedVolumes(0), m_batchRemaining(0), m_batchWaiting(false), m_batchBytes(0), m_fileSize(0), m_startTime(0), m_writeStart(0), m_pyramid(pool), m_progressive(false), m_sendingLevels(false), m_cancelLevels(false), m_liveActive(false), m_liveTimer(scheduler.service()), m_liveFrameNumber(0), m_liveDropped(0), m_defaultSendBuffer(0), m_sendingLive(false), m_liveSent(0), m_liveLatencySum(0), m_liveLatencyMax(0), m_codec(OCT_Codec::None), m_format(OCT_Voxel::UInt8), m_averaging(1), m_writing(false), m_sendFailed(false), m_drainPosted(false), m_ringFull(0)
 {  
 }
  
@@ -11,226 +11,1348 @@ boost::asio::ip::tcp::socket& TCP_Connection::socket()
  
 void TCP_Connection::start()
 {
-	try
+	m_readBuffer.resize(OCT_Protocol::ReadBufferSize);
+	this->read_frames();
+}
+
+void TCP_Connection::deliver_volume(const OCT_VolumePtr& volume)
+{
+	m_strand.post(boost::bind(&TCP_Connection::enqueue_volume, shared_from_this(), volume));
+}
+
+void TCP_Connection::enqueue_volume(OCT_VolumePtr volume)
+{
+	if (m_publishedVolumes.size() >= OCT_Protocol::MaxQueuedVolumes)
+	{
+		m_publishedVolumes.pop_front();
+		m_droppedVolumes++;
+		std::cout << "Subscriber too slow, dropped a published volume (" << m_droppedVolumes << " so far)\n";
+	}
+
+	m_publishedVolumes.push_back(volume);
+
+	if (!m_busy)
+	{
+		this->next_request();
+	}
+}
+
+void TCP_Connection::read_frames()
+{
+	//Makes room if a frame bigger than the free space is on its way
+	if (m_readBytes == m_readBuffer.size())
+	{
+		m_readBuffer.resize(m_readBuffer.size() * 2);
+	}
+
+	//Waits for data without holding a thread. The handler runs on the strand with however many bytes have arrived
+	m_socket.async_read_some(boost::asio::buffer(&m_readBuffer[m_readBytes], m_readBuffer.size() - m_readBytes),
+		m_strand.wrap(boost::bind(&TCP_Connection::handle_read, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+}
+
+void TCP_Connection::handle_read(const boost::system::error_code& error, size_t transferred)
+{
+	if (error)
+	{
+		std::cout << "Connection dropped: " << error.message() << std::endl;
+		this->close();
+		return;
+	}
+
+	m_readBytes += transferred;
+
+	if (!this->parse_frames())
+	{
+		//Garbage on the stream. There is no telling where the next frame starts, so the client is dropped
+		std::cout << "Invalid frame received. Dropping the connection" << std::endl;
+		this->close();
+		return;
+	}
+
+	//Keeps reading while the requests are being run, unless the client has queued up too many of them
+	if (m_requests.size() < OCT_Protocol::MaxPendingRequests)
+	{
+		this->read_frames();
+	}
+	else
+	{
+		m_readPaused = true;
+	}
+}
+
+bool TCP_Connection::parse_frames()
+{
+	size_t position = 0;
+
+	while (m_readBytes - position >= OCT_Protocol::FrameHeaderSize)
 	{
-		while(1)
+		uint32_t frameSize;
+		memcpy(&frameSize, &m_readBuffer[position], sizeof(uint32_t));
+
+		if (frameSize == 0 || frameSize > OCT_Protocol::MaxFrameSize)
 		{
-			//New connection started
-			std::cout << "->start\n";
- 
-			//Waits until there is something to read
-			while (m_socket.available() == 0)
+			return false;
+		}
+
+		//Incomplete frame. Makes sure it will fit and waits for the rest
+		if (m_readBytes - position < OCT_Protocol::FrameHeaderSize + frameSize)
+		{
+			if (m_readBuffer.size() < OCT_Protocol::FrameHeaderSize + frameSize)
 			{
-				;
+				m_readBuffer.resize(OCT_Protocol::FrameHeaderSize + frameSize);
 			}
- 
-			//Read the first byte
-			boost::asio::read(m_socket, m_readBuffer, boost::asio::transfer_exactly(1));
- 
-			//Extracts the contents of the streambuf to a simple char array
-			const char* message = boost::asio::buffer_cast<const char*>(m_readBuffer.data());
-			std::cout << "Received: \"" << message << "\"\n";
- 
-			//Parses the char array
-			this->parse_data(message);
+			break;
+		}
+
+		if (!this->parse_data(&m_readBuffer[position + OCT_Protocol::FrameHeaderSize], frameSize))
+		{
+			return false;
 		}
+
+		position += OCT_Protocol::FrameHeaderSize + frameSize;
 	}
-	catch(...)
+
+	//Moves the start of the next frame to the front so the buffer gets reused
+	if (position > 0)
 	{
-		std::cout << "Exception in start" << std::endl;
+		memmove(&m_readBuffer[0], &m_readBuffer[position], m_readBytes - position);
+		m_readBytes -= position;
 	}
+
+	return true;
 }
  
-void TCP_Connection::parse_data(const char* message)
+bool TCP_Connection::parse_data(const char* message, size_t length)
 {
-	try
+	OCT_Request request;
+	request.command = *message;
+
+	//Received an 'X' message: Cancels the progressive volume being sent right away instead of waiting behind the requests queued meanwhile
+	if (request.command == 'X')
+	{
+		if (m_progressive)
+		{
+			std::cout << "Progressive volume cancelled\n";
+			m_cancelLevels = true;
+		}
+		return true;
+	}
+
+	//Received a 'P', 'S' or 'R' message: Change the oct properties variables and capture a volume. 'S' streams the volume while it is being acquired and 'R' sends it coarse to fine
+	if (request.command == 'P' || request.command == 'S' || request.command == 'R')
+	{
+		if (length != OCT_Protocol::ParamsFrameSize && length != OCT_Protocol::CropParamsFrameSize)
+		{
+			std::cout << "Invalid request! A \'" << request.command << "\' carries " << OCT_Protocol::ParamsFrameSize << " or " << OCT_Protocol::CropParamsFrameSize << " bytes, not " << length << "\n";
+			return false;
+		}
+
+		this->set_oct_params(message, length, request.params);
+	}
+	else if (request.command == 'A')
 	{
-		std::cout << "->parse data. String: " << message << "." << std::endl;
-     
-		//Received a 'P' message: Change one of the oct properties variables
-		if (*message == 'P')
+		if (length != OCT_Protocol::WindowFrameSize)
 		{
-			m_oct.Init();
-         
-			//Waits until there is something to read
-			while (m_socket.available() == 0)
+			std::cout << "Invalid request! An \'A\' carries " << OCT_Protocol::WindowFrameSize << " bytes, not " << length << "\n";
+			return false;
+		}
+
+		this->set_oct_window(message, request.window);
+	}
+	//Received a 'B' message: The rate, then params like a 'P', or the rate alone to stop
+	else if (request.command == 'B')
+	{
+		if (length != 1 + OCT_Protocol::RateSize && length != OCT_Protocol::RateSize + OCT_Protocol::ParamsFrameSize && length != OCT_Protocol::RateSize + OCT_Protocol::CropParamsFrameSize)
+		{
+			std::cout << "Invalid request! A \'B\' carries " << 1 + OCT_Protocol::RateSize << ", " << OCT_Protocol::RateSize + OCT_Protocol::ParamsFrameSize << " or " << OCT_Protocol::RateSize + OCT_Protocol::CropParamsFrameSize << " bytes, not " << length << "\n";
+			return false;
+		}
+
+		memcpy(&request.rate, &message[1], sizeof(float));
+		if (length == 1 + OCT_Protocol::RateSize || !(request.rate > 0.0f))
+		{
+			request.rate = 0.0f;
+		}
+		else
+		{
+			//Keeps the interval of start_live finite and leaves the scanner time for other clients in between frames
+			request.rate = std::min(std::max(request.rate, OCT_Protocol::MinLiveRate), OCT_Protocol::MaxLiveRate);
+
+			//Skips the rate, so the params sit where they do in a 'P'
+			this->set_oct_params(message + OCT_Protocol::RateSize, length - OCT_Protocol::RateSize, request.params);
+		}
+	}
+	//Received a 'G' message: The ID, optionally followed by params like a 'P'
+	else if (request.command == 'G')
+	{
+		if (length != 1 + OCT_Protocol::VolumeIdSize && length != OCT_Protocol::VolumeIdSize + OCT_Protocol::ParamsFrameSize && length != OCT_Protocol::VolumeIdSize + OCT_Protocol::CropParamsFrameSize)
+		{
+			std::cout << "Invalid request! A \'G\' carries " << 1 + OCT_Protocol::VolumeIdSize << ", " << OCT_Protocol::VolumeIdSize + OCT_Protocol::ParamsFrameSize << " or " << OCT_Protocol::VolumeIdSize + OCT_Protocol::CropParamsFrameSize << " bytes, not " << length << "\n";
+			return false;
+		}
+
+		memcpy(&request.volumeId, &message[1], sizeof(uint32_t));
+		request.matchParams = length != 1 + OCT_Protocol::VolumeIdSize;
+		if (request.matchParams)
+		{
+			//Skips the ID, so the params sit where they do in a 'P'
+			this->set_oct_params(message + OCT_Protocol::VolumeIdSize, length - OCT_Protocol::VolumeIdSize, request.params);
+		}
+	}
+	//Received a 'V' message: The ID and the offset to resume from
+	else if (request.command == 'V')
+	{
+		if (length != OCT_Protocol::ResumeFrameSize)
+		{
+			std::cout << "Invalid request! A \'V\' carries " << OCT_Protocol::ResumeFrameSize << " bytes, not " << length << "\n";
+			return false;
+		}
+
+		memcpy(&request.volumeId, &message[1], sizeof(uint32_t));
+		memcpy(&request.offset, &message[1 + OCT_Protocol::VolumeIdSize], sizeof(uint64_t));
+		request.matchParams = false;
+	}
+	//Received an 'N' message: The count, then every scan as the payload of a 'P' with a region
+	else if (request.command == 'N')
+	{
+		const size_t count = length > 1 ? (uint8_t)message[1] : 0;
+		if (count == 0 || count > OCT_Protocol::MaxBatchScans || length != 2 + count * OCT_Protocol::CropParamsFrameSize)
+		{
+			std::cout << "Invalid request! An \'N\' carries 1 to " << OCT_Protocol::MaxBatchScans << " scans of " << OCT_Protocol::CropParamsFrameSize << " bytes after its count, not " << length << " bytes\n";
+			return false;
+		}
+
+		request.batch.resize(count);
+		for (size_t i = 0; i < count; i++)
+		{
+			const char* scan = message + 2 + i * OCT_Protocol::CropParamsFrameSize;
+			if (*scan != 'P')
 			{
-				;
+				std::cout << "Invalid request! Every scan of an \'N\' is a \'P\', not a \'" << *scan << "\'\n";
+				return false;
 			}
- 
-			//Reads the 32 bytes of the 8 4-byte variables transferred as params
-			boost::asio::read(m_socket, m_readBuffer, boost::asio::transfer_exactly(32));
-         
-			//Retrieves the data out of the read buffer in a simple c char array format easier to deal with
-			const char* readBufferData = boost::asio::buffer_cast<const char*>(m_readBuffer.data());
- 
-			//Sets the new params into the oct
-			this->set_oct_params(readBufferData);
-                 
-			//Starts up the m_volScanMessage by building the 512 byte header
-			this->prepare_header(m_volScanMessage);
- 
-			//Appends the voxel data to the m_volScanMessage
-			m_oct.captureVolScan(m_volScanMessage);
- 
-			//Finds the current filesize of m_volScanMessage (used to detect when transfer is complete) and begins message transfer
-			m_fileSize = m_volScanMessage.size();
-			this->send_volScan_message();   
 
-			//Closes the OCT device
-			m_oct.Close();
+			this->set_oct_params(scan, OCT_Protocol::CropParamsFrameSize, request.batch[i]);
+		}
+	}
+	else if (request.command == 'U' || request.command == 'Z' || request.command == 'F' || request.command == 'Y')
+	{
+		if (length != 2)
+		{
+			std::cout << "Invalid request! A \'" << request.command << "\' carries 2 bytes, not " << length << "\n";
+			return false;
+		}
+
+		request.argument = message[1];
+	}
+	else if (request.command != 'Q' && request.command != 'M' && request.command != 'T' && request.command != 'D' && request.command != 'O' && request.command != 'C')
+	{
+		//Incorrect request. The framing is still intact, so it is just skipped
+		std::cout << "Incorrect/invalid request! It should either be a \'P\' for a volume scan, an \'S\' for a streamed volume scan, an \'R\' for a progressive volume scan, an \'N\' for a batch of them, an \'X\' to cancel one, a \'G\' to fetch a cached volume, a \'V\' to resume one, a \'Q\' for a parameter query, an \'M\' for the buffer pool statistics, a \'T\' for the trace, a \'D\' for the recorder statistics, an \'A\' for the voxel window, an \'F\' for the voxel format, a \'Y\' for averaging, a \'Z\' for compression, a \'U\' to subscribe, an \'O\' or \'C\' to open or close the device or a \'B\' for live B mode\n";
+		return true;
+	}
+
+	m_requests.push_back(request);
+
+	if (!m_busy)
+	{
+		this->next_request();
+	}
+
+	return true;
+}
+
+void TCP_Connection::close()
+{
+	boost::system::error_code ignored;
+	m_socket.close(ignored);
+
+	//The live stream's timer would keep the connection alive otherwise, with the scanner capturing frames for nobody
+	m_scheduler.post(boost::bind(&TCP_Connection::stop_live, shared_from_this()));
+}
+
+void TCP_Connection::next_request()
+{
+	//Resumes reading once the client's backlog has been worked down
+	if (m_readPaused && m_requests.size() < OCT_Protocol::MaxPendingRequests)
+	{
+		m_readPaused = false;
+		this->read_frames();
+	}
+
+	//Only set again below if the strand has to wait for the next volume of a batch
+	m_batchWaiting = false;
+
+	//The newest live frame goes out first, as it only gets staler
+	if (m_liveFrame)
+	{
+		m_busy = true;
+		OCT_HeaderLayout::DroppedFrames::write(&m_liveFrame->message[0], m_liveDropped);
+		OCT_VolumePtr frame = m_liveFrame;
+		m_liveFrame.reset();
+		m_sendingLive = true;
+		this->send_volScan_message(frame);
+		return;
+	}
+
+	//Published volumes go out in between this client's own replies
+	if (!m_publishedVolumes.empty())
+	{
+		m_busy = true;
+		OCT_VolumePtr volume = m_publishedVolumes.front();
+		m_publishedVolumes.pop_front();
+		this->send_volScan_message(volume);
+		return;
+	}
+
+	//The rest of a batch goes before any other request, each volume as soon as the scanner has it
+	if (m_batchRemaining > 0)
+	{
+		if (m_batchVolumes.empty())
+		{
+			m_batchWaiting = true;
+			return;
+		}
+
+		m_batchRemaining--;
+		OCT_VolumePtr volume = m_batchVolumes.front();
+		m_batchVolumes.pop_front();
+		m_batchBytes -= volume->message.size();
+		this->resume_batch();
+		this->send_volScan_message(volume);
+		return;
+	}
+
+	if (m_requests.empty())
+	{
+		m_busy = false;
+		return;
+	}
+
+	m_busy = true;
+	OCT_Request request = m_requests.front();
+	m_requests.pop_front();
+
+	std::cout << "->running request " << request.command << "." << std::endl;
+
+	if (request.command == 'P' || request.command == 'S' || request.command == 'R')
+	{
+		m_params = request.params;
+		m_params.format = m_format;
+		m_params.averaging = m_averaging;
+
+		//An 'X' from here on cancels this volume, even before its levels are built
+		m_progressive = request.command == 'R';
+		m_cancelLevels = false;
+
+		//The scan itself waits for its turn on the scanner thread. Other clients keep being served meanwhile
+		m_scheduler.post(boost::bind(&TCP_Connection::capture_volScan, shared_from_this(), request.command));
+	}
+	//Received an 'N' message: The whole batch goes to the scanner at once, and its volumes come back one by one
+	else if (request.command == 'N')
+	{
+		for (size_t i = 0; i < request.batch.size(); i++)
+		{
+			request.batch[i].format = m_format;
+			request.batch[i].averaging = m_averaging;
 		}
-		else if (*message == 'B')
+
+		m_batchRemaining = request.batch.size();
+		m_batchWaiting = true;
+		m_batchRest.clear();
+		m_scheduler.post(boost::bind(&TCP_Connection::capture_batch, shared_from_this(), request.batch));
+	}
+	//Received a 'G' or 'V' message: Reply with a volume from the cache, or the part of it the client is missing, without waiting for the scanner
+	else if (request.command == 'G' || request.command == 'V')
+	{
+		request.params.format = m_format;
+		request.params.averaging = m_averaging;
+		this->send_cached_volume(request);
+	}
+	//Received a 'Q' message: Reply with the header describing the params this client has set, without waiting for the scanner
+	else if (request.command == 'Q')
+	{
+		this->send_params_message();
+	}
+	//Received an 'M' message: Reply with how well the buffer pool is reused
+	else if (request.command == 'M')
+	{
+		this->send_pool_message();
+	}
+	//Received a 'T' message: Reply with the timeline of the last scans
+	else if (request.command == 'T')
+	{
+		this->send_trace_message();
+	}
+	//Received a 'D' message: Reply with how the recording to disk keeps up
+	else if (request.command == 'D')
+	{
+		this->send_recorder_message();
+	}
+	//Received an 'A' message: Every later scan of this client uses the new window
+	else if (request.command == 'A')
+	{
+		m_window = request.window;
+		this->next_request();
+	}
+	//Received a 'Z' message: Switch this client's volumes to the requested codec, if it is one we have, and tell the client which one it got
+	else if (request.command == 'Z')
+	{
+		m_codec = OCT_Codec::isSupported(request.argument) ? request.argument : (uint32_t)OCT_Codec::None;
+		std::cout << "Compression codec " << m_codec << " negotiated\n";
+		this->send_byte_message(m_codec);
+	}
+	//Received an 'F' message: Capture every later volume of this client as the requested voxel type, if it is one we have, and tell the client which one it got
+	else if (request.command == 'F')
+	{
+		m_format = OCT_Voxel::isSupported(request.argument) ? request.argument : (uint32_t)OCT_Voxel::UInt8;
+		m_params.format = m_format;
+		std::cout << "Voxel format " << m_format << " chosen\n";
+		this->send_byte_message(m_format);
+	}
+	//Received a 'Y' message: Average that many B-scans at every Y position of every later volume of this client, and tell the client how many it got
+	else if (request.command == 'Y')
+	{
+		m_averaging = std::max<uint32_t>(request.argument, 1);
+		m_params.averaging = m_averaging;
+		std::cout << "Averaging " << m_averaging << " B-scans per position\n";
+		this->send_byte_message(m_averaging);
+	}
+	//Received a 'U' message: Start or stop receiving the volumes captured for the other clients
+	else if (request.command == 'U')
+	{
+		if (request.argument)
 		{
-			std::cout << "B mode requested\n";
+			m_publisher.subscribe(shared_from_this());
+			std::cout << "Client subscribed\n";
 		}
 		else
 		{
-			//Incorrect request
-			throw "Incorrect/invalid request! It should either be a \'P\' for a volume scan or a \'B\' for a B scan";
+			m_publisher.unsubscribe(this);
+			m_publishedVolumes.clear();
+			std::cout << "Client unsubscribed\n";
 		}
+		this->next_request();
 	}
-	catch(...)
+	//Received an 'O' or 'C' message: Warm the device up ahead of the next scan, or close it right away instead of waiting for the idle timeout. Queued behind any scans already waiting for the scanner
+	else if (request.command == 'O')
+	{
+		m_scheduler.post(boost::bind(&OCT_Scheduler::openSession, &m_scheduler));
+		m_scheduler.post(boost::bind(&OCT_Scheduler::releaseSession, &m_scheduler));
+		this->next_request();
+	}
+	else if (request.command == 'C')
+	{
+		m_scheduler.post(boost::bind(&OCT_Scheduler::closeSession, &m_scheduler));
+		this->next_request();
+	}
+	//Received a 'B' message: Start, change or stop the live stream. Frames then arrive on their own, there is no reply
+	else
 	{
-		std::cout << "Exception on parse data. Has the OCT device timed out?" << std::endl;
+		if (request.rate > 0.0f)
+		{
+			//A single B-scan over and over, so only the first one along y
+			OCT_Params params = request.params;
+			params.format = m_format;
+			params.averaging = m_averaging;
+			params.ysteps = 1;
+			params.ystart = 0;
+			params.ycount = 0;
+			params.clampCrop();
+
+			//Frames queued up in the socket are as stale as the ones the ring drops, so it gets a send buffer of about one frame while streaming
+			boost::system::error_code ignored;
+			boost::asio::socket_base::send_buffer_size sendBuffer;
+			if (m_defaultSendBuffer == 0)
+			{
+				m_socket.get_option(sendBuffer, ignored);
+				m_defaultSendBuffer = sendBuffer.value();
+			}
+			m_socket.set_option(boost::asio::socket_base::send_buffer_size((int)std::min(params.volumeSize() + 512, (size_t)m_defaultSendBuffer)), ignored);
+
+			m_scheduler.post(boost::bind(&TCP_Connection::start_live, shared_from_this(), params, m_window, request.rate));
+			std::cout << "B mode requested at " << request.rate << " frames per second\n";
+		}
+		else
+		{
+			if (m_defaultSendBuffer != 0)
+			{
+				boost::system::error_code ignored;
+				m_socket.set_option(boost::asio::socket_base::send_buffer_size(m_defaultSendBuffer), ignored);
+				m_defaultSendBuffer = 0;
+			}
+
+			m_scheduler.post(boost::bind(&TCP_Connection::stop_live, shared_from_this()));
+			std::cout << "B mode stopped\n";
+		}
+		this->next_request();
 	}
 }
  
-void TCP_Connection::set_oct_params(const char* paramMessage)
-{
-    //Create some temporary variables to hold the params
-    float xrange;
-    float yrange;
-    float zrange;
-    uint32_t xsteps;
-    uint32_t ysteps;
-    uint32_t zsteps;
-    float xoffset;
-    float yoffset;
- 
-    //Memcpy the variables out of the param message into the temp variables. All offset one byte because of the 'P'
-    memcpy(&xrange, &(paramMessage[1]), sizeof(float));
-    memcpy(&yrange, &(paramMessage[5]), sizeof(float));
-    memcpy(&zrange, &(paramMessage[9]), sizeof(float));
-    memcpy(&xsteps, &(paramMessage[13]), sizeof(uint32_t));
-    memcpy(&ysteps, &(paramMessage[17]), sizeof(uint32_t));
-    memcpy(&zsteps, &(paramMessage[21]), sizeof(uint32_t));
-    memcpy(&xoffset, &(paramMessage[25]), sizeof(float));
-    memcpy(&yoffset, &(paramMessage[29]), sizeof(float));
-     
-    //Set the oct params to the values from the temp variables
-    this->m_oct.setXRange(xrange);
-    this->m_oct.setYRange(yrange);
-    this->m_oct.setZRange(zrange);
-    this->m_oct.setXSteps(xsteps);
-    this->m_oct.setYSteps(ysteps);
-    this->m_oct.setZSteps(zsteps);
-    this->m_oct.setXOffset(xoffset);
-    this->m_oct.setYOffset(yoffset);
+void TCP_Connection::set_oct_params(const char* paramMessage, size_t length, OCT_Params& params)
+{
+    OCT_Protocol::readParams(paramMessage, length, params);
  
     //Print out the change log for debug
-    std::cout << "Params changed to:\n\t\tXRANGE: " << xrange
-        << "\n\t\tYRANGE: " << yrange
-        << "\n\t\tZRANGE: " << zrange
-        << "\n\t\tXSTEPS: " << xsteps
-        << "\n\t\tYSTEPS: " << ysteps
-        << "\n\t\tZSTEPS: " << zsteps
-        << "\n\t\tXOFFSET: " << xoffset
-        << "\n\t\tYOFFSET: " << yoffset
+    std::cout << "Params changed to:\n\t\tXRANGE: " << params.xrange
+        << "\n\t\tYRANGE: " << params.yrange
+        << "\n\t\tZRANGE: " << params.zrange
+        << "\n\t\tXSTEPS: " << params.xsteps
+        << "\n\t\tYSTEPS: " << params.ysteps
+        << "\n\t\tZSTEPS: " << params.zsteps
+        << "\n\t\tXOFFSET: " << params.xoffset
+        << "\n\t\tYOFFSET: " << params.yoffset
+        << "\n\t\tCROP: x " << params.xstart << "+" << params.xcount << ", y " << params.ystart << "+" << params.ycount << ", z " << params.zstart << "+" << params.zcount
         << "\n";
+}
  
-    //Clear the read buffer
-    m_readBuffer.consume(m_readBuffer.size());
+void TCP_Connection::set_oct_window(const char* windowMessage, OCT_Window& window)
+{
+    //Offset one byte because of the 'A'
+    memcpy(&window.contrast, &(windowMessage[1]), sizeof(float));
+    memcpy(&window.brightness, &(windowMessage[5]), sizeof(float));
+    memcpy(&window.dBRange, &(windowMessage[9]), sizeof(float));
+    memcpy(&window.maxSigAmplitude, &(windowMessage[13]), sizeof(float));
+
+    std::cout << "Window changed to:\n\t\tCONTRAST: " << window.contrast
+        << "\n\t\tBRIGHTNESS: " << window.brightness
+        << "\n\t\tDBRANGE: " << window.dBRange
+        << "\n\t\tMAXAMPLITUDE: " << window.maxSigAmplitude
+        << "\n";
 }
  
-void TCP_Connection::prepare_header(std::vector<uint8_t>& header)
+void TCP_Connection::prepare_header(OCT_Buffer& header, const OCT_Params& params)
 {
+    //Keeps the capacity, so a reused buffer doesn't get reallocated
     header.clear();
-    header.reserve(512);
 	header.resize(512);
- 
-    //Header size is 512 bytes in total. "Allocate" them here by pushing back NULLs into the vector
-    //for (int i = 0; i < 512; i++)
-    //{
-     //   header.push_back(NULL);
-    //}
- 
-    //Fetch the current parameters from the oct scanner to build the header. Only these parameters are used by the client application, but the 512 byte size is kept in case other parameters start being used in the future
-    uint32_t numOfImagesInFile = this->m_oct.getYSteps();
-    uint32_t imageWidth = this->m_oct.getXSteps();
-    uint32_t imageDepth = this->m_oct.getZSteps();
-    float scanWidth = this->m_oct.getXRange();
-    float scanLength = this->m_oct.getYRange();
- 
-    //Fetch the other parameters from the oct. These aren't built by the standard .img files, but are also packed for sake of completeness
-    float scanDepth = this->m_oct.getZRange();
-    float xOffset = this->m_oct.getXOffset();
-    float yOffset = this->m_oct.getYOffset();
- 
-    //Copy the necessary header variables into the header vector
-    memcpy(&header[16], &numOfImagesInFile, sizeof(uint32_t));
-    memcpy(&header[20], &imageWidth, sizeof(uint32_t));
-    memcpy(&header[24], &imageDepth, sizeof(uint32_t));
-    memcpy(&header[72], &scanWidth, sizeof(float));
-    memcpy(&header[76], &scanLength, sizeof(float));
-    memcpy(&header[80], &scanDepth, sizeof(float));
-    memcpy(&header[84], &xOffset, sizeof(float));
-    memcpy(&header[88], &yOffset, sizeof(float));
+
+    OCT_Protocol::writeHeader(&header[0], params);
 }
  
-void TCP_Connection::send_volScan_message()
+void TCP_Connection::capture_volScan(char command)
 {
-    m_sendFillBuffer[2048] = 0;
- 
-    //std::this_thread::sleep_for(std::chrono::milliseconds(5000));
- 
-    SYSTEMTIME time;
-    GetSystemTime(&time);
-    WORD millisStart = (time.wSecond * 1000) + time.wMilliseconds;
- 
-    for (unsigned int i = 0; i < m_fileSize; i)
-    {
-        //The ammount to transfer is usually the total capacity of the send buffer, unless the ammount of bytes still left to transfer is smaller than that capacity, in which case just ammount left is sent
-        int ammountToSend = min(m_sendFillBuffer.size(), m_fileSize - i);
- 
-        //Copy (exclusively) the file data into the send buffer
-        memcpy(&m_sendFillBuffer, &m_volScanMessage[i], ammountToSend);
- 
-        //Writes the remaining data to the socket
-        size_t transferred = boost::asio::write(m_socket, boost::asio::buffer(m_sendFillBuffer, ammountToSend));
-         
-        std::cout << "Transferred " << transferred << " bytes\n";
- 
-        //Keeps track of how many bytes were written in total
-        i += transferred;
-    }
- 
-    GetSystemTime(&time);
-    WORD millisEnd = (time.wSecond * 1000) + time.wMilliseconds;
-         
-    std::cout << "File transfer complete!\n";
-    std::cout << m_fileSize << " " << m_volScanMessage.size() << "\n\n";
- 
-    float diff = (millisEnd - millisStart)/1000.0;
-    std::cout << "Total time: " << diff << " s. Speed: " << (((float)m_fileSize) / diff) * (1 / 1024.0f) << " KBps " << std::endl;
+	//Runs on the scanner thread, so this connection has the oct to itself until it returns
+	SDOCT& oct = m_scheduler.oct();
+	uint64_t requestStart = OCT_Trace::now();
+	OCT_RecordingPtr recording;
 
-	std::cout << "First 100 bytes of header: \n";
-	for(int i = 0; i < 100; i++)
+	try
 	{
-		std::cout << (int)((unsigned char)m_volScanMessage[i]) << " ";
-	}
+		//Opens the device, unless the session is still warm from an earlier request
+		double startup = m_scheduler.openSession();
+
+		//Sets this client's params and voxel window into the oct. Raw spectra get as many voxels along z as the camera has pixels, which only the oct knows
+		m_params.fitToCamera(oct);
+		m_params.applyTo(oct);
+		m_window.applyTo(oct);
+
+		//Kept for the log at the end. By then the volume has been handed to the strand, which may already be running this client's next request and changing m_params
+		const uint32_t bscans = m_params.ycount;
+
+		//Starts up the volume message by building the 512 byte header. The whole volume is reserved up front so pointers handed to the strand stay valid while captureVolScan appends
+		m_volume = m_pool.acquire(512 + m_params.volumeSize());
+		m_volume->params = m_params;
+		{
+			OCT_Trace::Scope trace("header");
+			this->prepare_header(m_volume->message, m_params);
+		}
+
+		//Lets the volume be fetched again from the cache
+		const uint32_t volumeId = m_cache.nextId();
+		OCT_HeaderLayout::VolumeId::write(&m_volume->message[0], volumeId);
+
+		if (command == 'P')
+		{
+			//Appends the voxel data to the volume message
+			recording = m_recorder.begin(m_volume);
+			oct.captureVolScan(m_volume->message, m_recorder.record(recording, BScanHandler()));
+			m_recorder.finish(recording);
+
+			//The volume is complete and from here on read only. Cached before anything of it is sent, so a client that got it can always fetch it again. The client's own transfer begins on the strand
+			OCT_VolumePtr volume = m_volume;
+			m_volume.reset();
+			m_cache.insert(volumeId, volume);
+			m_strand.post(boost::bind(&TCP_Connection::send_volScan_message, shared_from_this(), volume));
+			m_publisher.publish(volume, this);
+		}
+		else if (command == 'R')
+		{
+			//The levels are built from every B-scan as it comes in, on this thread. Their voxels are done as soon as the capture is
+			const uint32_t levelCount = OCT_Pyramid::levelsFor(m_params, OCT_Protocol::PreviewSize, OCT_Protocol::MaxLevels);
+			OCT_Pyramid& pyramid = m_pyramid;
+			pyramid.reset(m_params, levelCount);
+
+			uint32_t level = 0;
+			OCT_HeaderLayout::Level::write(&m_volume->message[0], level);
+			OCT_HeaderLayout::LevelCount::write(&m_volume->message[0], levelCount);
+
+			recording = m_recorder.begin(m_volume);
+			oct.captureVolScan(m_volume->message, m_recorder.record(recording, boost::bind(&OCT_Pyramid::addBScan, &pyramid, _1, _2)));
+			m_recorder.finish(recording);
+			pyramid.finish();
+
+			//Coarsest first, so the client has something to show after a tiny transfer. The full volume closes the reply
+			std::vector<OCT_VolumePtr> levels;
+			for (level = levelCount - 1; level > 0; level--)
+			{
+				OCT_Trace::Scope trace("header", "level", level);
+				const boost::shared_ptr<OCT_Volume>& levelVolume = pyramid.level(level);
+				OCT_Protocol::writeHeader(&levelVolume->message[0], levelVolume->params);
+				OCT_HeaderLayout::Level::write(&levelVolume->message[0], level);
+				OCT_HeaderLayout::LevelCount::write(&levelVolume->message[0], levelCount);
+				OCT_HeaderLayout::VolumeId::write(&levelVolume->message[0], volumeId);
+				levels.push_back(levelVolume);
+			}
+			pyramid.release();
+
+			OCT_VolumePtr volume = m_volume;
+			m_volume.reset();
+			levels.push_back(volume);
+			m_cache.insert(volumeId, volume);
+			m_strand.post(boost::bind(&TCP_Connection::send_levels, shared_from_this(), levels));
+			m_publisher.publish(volume, this);
+		}
+		else
+		{
+			//The strand has nothing of this transfer to do until the first B-scan is handed over, so it can be set up from here
+			this->begin_chunked_send(m_volume, std::numeric_limits<size_t>::max());
+			m_strand.post(boost::bind(&TCP_Connection::write_chunks, shared_from_this()));
+
+			m_pendingChunks.first = 0;
+			m_pendingChunks.count = 0;
+			m_ringFull = 0;
+
+			recording = m_recorder.begin(m_volume);
+			oct.captureVolScan(m_volume->message, m_recorder.record(recording, boost::bind(&TCP_Connection::capture_chunk, shared_from_this(), _1, _2)));
+			m_recorder.finish(recording);
+
+			//Cached before the last B-scans go out, so a client that got the whole volume can always fetch it again
+			m_cache.insert(volumeId, m_volume);
+			this->push_chunks(true);
 
-	std::cout << "\n\nFirst 100 bytes of voxel data: \n";
-	for(int i = 512; i < 612; i++)
+			if (m_ringFull > 0)
+			{
+				std::cout << "Chunk ring was full " << m_ringFull << " times, the sender fell behind the device\n";
+			}
+
+			//Published before handing back to the strand, because finish_send releases m_volume once the last B-scan has been written
+			m_publisher.publish(m_volume, this);
+			m_strand.post(boost::bind(&TCP_Connection::capture_done, shared_from_this(), m_chunksSubmitted));
+		}
+
+		//Hands the device back. It stays open for the next request until the idle timeout, unless running with a timeout of 0
+		m_scheduler.releaseSession();
+
+		uint64_t requestEnd = OCT_Trace::now();
+		OCT_Trace::record("capture", requestStart, requestEnd, "bscans", bscans);
+		double latency = (requestEnd - requestStart) / 1000000000.0;
+		std::cout << "Scan request took " << latency << " s, of which " << startup << " s device startup" << std::endl;
+	}
+	catch(...)
 	{
-		std::cout << (int)((unsigned char)m_volScanMessage[i]) << " ";
+		//The device might be in a bad state, so the next request starts from a fresh session
+		m_scheduler.closeSession();
+		m_recorder.finish(recording);
+		std::cout << "Exception on capture. Has the OCT device timed out? Dropping the connection" << std::endl;
+		m_strand.post(boost::bind(&TCP_Connection::close, shared_from_this()));
 	}
+}
+
+void TCP_Connection::capture_batch(std::vector<OCT_Params> batch)
+{
+	SDOCT& oct = m_scheduler.oct();
+	uint64_t requestStart = OCT_Trace::now();
+
+	try
+	{
+		double startup = m_scheduler.openSession();
+		m_window.applyTo(oct);
+
+		//No scan waits for the one before it to be sent, so the device goes from one straight to the next. Unless the client is far behind, in which case the rest waits for it on the strand
+		size_t captured = 0;
+		for (; captured < batch.size(); captured++)
+		{
+			if (captured > 0 && m_batchBytes >= OCT_Protocol::MaxBatchAhead)
+			{
+				std::vector<OCT_Params> rest(batch.begin() + captured, batch.end());
+				m_strand.post(boost::bind(&TCP_Connection::batch_paused, shared_from_this(), rest));
+				break;
+			}
+
+			OCT_VolumePtr volume = this->capture_volume(oct, batch[captured]);
+			m_batchBytes += volume->message.size();
+			m_strand.post(boost::bind(&TCP_Connection::batch_volume_ready, shared_from_this(), volume));
+		}
 
-	std::cout << "\n\nLast 100 bytes of voxel data: \n";
-	for(int i = m_fileSize-100; i < m_fileSize; i++)
+		m_scheduler.releaseSession();
+
+		double latency = (OCT_Trace::now() - requestStart) / 1000000000.0;
+		std::cout << "Batch of " << captured << " scans took " << latency << " s, of which " << startup << " s device startup" << std::endl;
+	}
+	catch(...)
 	{
-		std::cout << (int)((unsigned char)m_volScanMessage[i]) << " ";
+		m_scheduler.closeSession();
+		std::cout << "Exception on capture. Has the OCT device timed out? Dropping the connection" << std::endl;
+		m_strand.post(boost::bind(&TCP_Connection::close, shared_from_this()));
 	}
+}
+
+OCT_VolumePtr TCP_Connection::capture_volume(SDOCT& oct, OCT_Params params)
+{
+	uint64_t captureStart = OCT_Trace::now();
+	params.fitToCamera(oct);
+	params.applyTo(oct);
+
+	boost::shared_ptr<OCT_Volume> volume = m_pool.acquire(512 + params.volumeSize());
+	volume->params = params;
+	{
+		OCT_Trace::Scope trace("header");
+		this->prepare_header(volume->message, params);
+	}
+
+	const uint32_t volumeId = m_cache.nextId();
+	OCT_HeaderLayout::VolumeId::write(&volume->message[0], volumeId);
+
+	OCT_RecordingPtr recording = m_recorder.begin(volume);
+	try
+	{
+		oct.captureVolScan(volume->message, m_recorder.record(recording, BScanHandler()));
+	}
+	catch(...)
+	{
+		m_recorder.finish(recording);
+		throw;
+	}
+	m_recorder.finish(recording);
+
+	//Cached before any subscriber gets it, so it can always be fetched again
+	m_cache.insert(volumeId, volume);
+	m_publisher.publish(volume, this);
+
+	OCT_Trace::record("capture", captureStart, OCT_Trace::now(), "bscans", params.ycount);
+	return volume;
+}
+
+void TCP_Connection::batch_volume_ready(OCT_VolumePtr volume)
+{
+	m_batchVolumes.push_back(volume);
+
+	if (m_batchWaiting)
+	{
+		this->next_request();
+	}
+}
+
+void TCP_Connection::batch_paused(std::vector<OCT_Params> rest)
+{
+	std::cout << "Client is behind on its batch, " << rest.size() << " scans wait until it has caught up\n";
+	m_batchRest = rest;
+
+	//The strand may have sent enough of the batch while this was on its way
+	this->resume_batch();
+}
+
+void TCP_Connection::resume_batch()
+{
+	if (m_batchRest.empty() || m_batchBytes >= OCT_Protocol::MaxBatchAhead)
+	{
+		return;
+	}
+
+	m_scheduler.post(boost::bind(&TCP_Connection::capture_batch, shared_from_this(), m_batchRest));
+	m_batchRest.clear();
+}
+
+void TCP_Connection::start_live(OCT_Params params, OCT_Window window, float rate)
+{
+	m_liveParams = params;
+	m_liveParams.fitToCamera(m_scheduler.oct());
+	m_liveWindow = window;
+
+	//The rate was clamped by parse_data, so the interval is always a sane number of microseconds
+	const boost::posix_time::time_duration lastInterval = m_liveInterval;
+	m_liveInterval = boost::posix_time::microseconds((boost::int64_t)(1000000.0 / rate));
+
+	if (m_liveRing.empty())
+	{
+		for (size_t i = 0; i < OCT_Protocol::LiveFrameRing; i++)
+		{
+			m_liveRing.push_back(boost::make_shared<OCT_Volume>());
+		}
+	}
+
+	//A running stream picks the new params up with its next frame, which is moved to the new rate right away rather than after a long interval of the old one
+	if (!m_liveActive)
+	{
+		m_liveActive = true;
+		m_liveNext = boost::asio::deadline_timer::traits_type::now();
+		this->capture_frame();
+	}
+	else
+	{
+		m_liveNext += m_liveInterval - lastInterval;
+		boost::posix_time::ptime now = boost::asio::deadline_timer::traits_type::now();
+		if (m_liveNext < now)
+		{
+			m_liveNext = now;
+		}
+
+		//Cancels the wait for the old time, whose handler then does nothing
+		m_liveTimer.expires_at(m_liveNext);
+		m_liveTimer.async_wait(boost::bind(&TCP_Connection::handle_live_timer, shared_from_this(), boost::asio::placeholders::error));
+	}
+}
+
+void TCP_Connection::stop_live()
+{
+	m_liveActive = false;
+	m_liveTimer.cancel();
+}
+
+void TCP_Connection::capture_frame()
+{
+	if (!m_liveActive)
+	{
+		return;
+	}
+
+	//A buffer nobody but the ring refers to anymore is neither waiting nor being sent. The strand holds two at most, so there always is one
+	boost::shared_ptr<OCT_Volume> frame;
+	for (size_t i = 0; i < m_liveRing.size() && !frame; i++)
+	{
+		if (m_liveRing[i].unique())
+		{
+			frame = m_liveRing[i];
+		}
+	}
+
+	if (frame)
+	{
+		SDOCT& oct = m_scheduler.oct();
+
+		try
+		{
+			OCT_Trace::Scope trace("frame", "frame", m_liveFrameNumber);
+
+			//Other clients' scans may have changed the oct since the last frame
+			m_scheduler.openSession();
+			m_liveParams.applyTo(oct);
+			m_liveWindow.applyTo(oct);
+
+			//The buffer keeps its capacity, so after the first round through the ring nothing gets allocated
+			frame->params = m_liveParams;
+			this->prepare_header(frame->message, m_liveParams);
+			oct.captureVolScan(frame->message);
+
+			m_scheduler.releaseSession();
+		}
+		catch(...)
+		{
+			m_scheduler.closeSession();
+			m_liveActive = false;
+			std::cout << "Exception on capture. Has the OCT device timed out? Stopping B mode" << std::endl;
+			return;
+		}
+
+		boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+		uint64_t captureTime = (boost::posix_time::microsec_clock::universal_time() - epoch).total_microseconds();
+		OCT_HeaderLayout::FrameNumber::write(&frame->message[0], m_liveFrameNumber);
+		OCT_HeaderLayout::CaptureTime::write(&frame->message[0], captureTime);
+		m_liveFrameNumber++;
+
+		m_strand.post(boost::bind(&TCP_Connection::frame_ready, shared_from_this(), frame));
+	}
+
+	//Keeps to the rate without drifting, but never tries to catch up on frames the device was too slow for
+	m_liveNext += m_liveInterval;
+	boost::posix_time::ptime now = boost::asio::deadline_timer::traits_type::now();
+	if (m_liveNext < now)
+	{
+		m_liveNext = now;
+	}
+
+	m_liveTimer.expires_at(m_liveNext);
+	m_liveTimer.async_wait(boost::bind(&TCP_Connection::handle_live_timer, shared_from_this(), boost::asio::placeholders::error));
+}
+
+void TCP_Connection::handle_live_timer(const boost::system::error_code& error)
+{
+	if (error == boost::asio::error::operation_aborted)
+	{
+		return;
+	}
+
+	this->capture_frame();
+}
+
+void TCP_Connection::frame_ready(boost::shared_ptr<OCT_Volume> frame)
+{
+	if (m_liveFrame)
+	{
+		m_liveDropped++;
+	}
+
+	m_liveFrame = frame;
+
+	if (!m_busy)
+	{
+		this->next_request();
+	}
+}
+
+void TCP_Connection::send_volScan_message(OCT_VolumePtr volume)
+{
+    this->begin_chunked_send(volume, volume->params.ycount);
+
+    //Every B-scan is a chunk of the volume. Without compression they are sent straight out of the volume, gathered into large writes
+    const size_t chunkSize = volume->params.bscanSize();
+    for (size_t i = 0; i < volume->params.ycount; i++)
+    {
+        this->submit_chunk(&volume->message[512 + i * chunkSize], chunkSize);
+    }
+
+    //Gets the header going while the chunks are still being compressed
+    this->write_chunks();
+}
+
+void TCP_Connection::send_cached_volume(const OCT_Request& request)
+{
+    OCT_VolumePtr volume = request.matchParams ? m_cache.find(request.volumeId, request.params) : m_cache.find(request.volumeId);
+
+    OCT_VolumeCache::Stats stats = m_cache.stats();
+    if (volume && request.command == 'V')
+    {
+        std::cout << "Resuming cached volume " << request.volumeId << " from byte " << request.offset << " (" << stats.volumes << " volumes, " << stats.bytes / (1024 * 1024) << " MB cached)\n";
+        this->send_volume_tail(volume, request.offset);
+        return;
+    }
+    else if (volume)
+    {
+        std::cout << "Sending cached volume " << request.volumeId << " (" << stats.volumes << " volumes, " << stats.bytes / (1024 * 1024) << " MB cached)\n";
+    }
+    else
+    {
+        //Nothing but a header, like the end of a cancelled progressive volume
+        std::cout << "Volume " << request.volumeId << (request.matchParams ? " with these params" : "") << " isn't cached (" << stats.volumes << " volumes, " << stats.bytes / (1024 * 1024) << " MB cached)\n";
+        boost::shared_ptr<OCT_Volume> empty = m_pool.acquire(512);
+        empty->params.format = m_format;
+        this->prepare_header(empty->message, empty->params);
+        volume = empty;
+    }
+
+    this->send_volScan_message(volume);
+}
+
+void TCP_Connection::send_volume_tail(OCT_VolumePtr volume, uint64_t offset)
+{
+    const size_t bscanSize = volume->params.bscanSize();
+    const size_t size = volume->message.size();
+
+    //The header goes out again anyway, so the tail never starts before the voxels
+    size_t start = (size_t)std::min<uint64_t>(std::max<uint64_t>(offset, 512), size);
+    const size_t first = bscanSize > 0 ? (start - 512) / bscanSize : volume->params.ycount;
+
+    //Chunks are compressed whole, so a compressed tail starts with the whole B-scan the offset is in
+    if (m_codec != OCT_Codec::None && first < volume->params.ycount)
+    {
+        start = 512 + first * bscanSize;
+    }
+
+    const uint32_t chunks = volume->params.ycount - (uint32_t)first;
+    this->begin_chunked_send(volume, chunks);
+
+    //Only in the copy of the header that goes out, the cached volume stays as it is
+    OCT_HeaderLayout::ResumeOffset::write(&m_sendHeader[0], start);
+    if (m_sendCodec != OCT_Codec::None)
+    {
+        OCT_HeaderLayout::Chunks::write(&m_sendHeader[0], chunks);
+    }
+
+    //The first B-scan may only be sent from the offset on, the others go out whole
+    for (size_t i = first; i < volume->params.ycount; i++)
+    {
+        const size_t chunkStart = std::max(512 + i * bscanSize, start);
+        this->submit_chunk(&volume->message[chunkStart], 512 + (i + 1) * bscanSize - chunkStart);
+    }
+
+    this->write_chunks();
+}
+
+void TCP_Connection::send_levels(std::vector<OCT_VolumePtr> levels)
+{
+    m_levels.assign(levels.begin(), levels.end());
+    m_sendingLevels = true;
+    this->send_next_level();
+}
+
+void TCP_Connection::send_next_level()
+{
+    if (m_levels.empty())
+    {
+        m_sendingLevels = false;
+        m_progressive = false;
+        this->next_request();
+        return;
+    }
+
+    OCT_VolumePtr level;
+    if (m_cancelLevels)
+    {
+        //Nothing but a header, with the level count of the cancelled volume so the client can tell the two apart
+        boost::shared_ptr<OCT_Volume> empty = m_pool.acquire(512);
+        empty->params.format = m_levels.back()->params.format;
+        this->prepare_header(empty->message, empty->params);
+        OCT_HeaderLayout::LevelCount::write(&empty->message[0], OCT_HeaderLayout::LevelCount::read(&m_levels.back()->message[0]));
+
+        level = empty;
+        m_levels.clear();
+    }
+    else
+    {
+        level = m_levels.front();
+        m_levels.pop_front();
+    }
+
+    this->send_volScan_message(level);
+}
+
+void TCP_Connection::send_params_message()
+{
+    this->prepare_header(m_headerMessage, m_params);
+
+    boost::asio::async_write(m_socket, boost::asio::buffer(m_headerMessage),
+        m_strand.wrap(boost::bind(&TCP_Connection::handle_message_sent, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+}
+
+void TCP_Connection::send_pool_message()
+{
+    OCT_BufferPool::Stats stats = m_pool.stats();
+    const uint64_t values[8] = { stats.hits, stats.misses, stats.unpooled, stats.buffers, stats.inUse, stats.bytes, stats.budget, stats.evicted };
+
+    m_headerMessage.resize(sizeof(values));
+    memcpy(&m_headerMessage[0], values, sizeof(values));
+
+    boost::asio::async_write(m_socket, boost::asio::buffer(m_headerMessage),
+        m_strand.wrap(boost::bind(&TCP_Connection::handle_message_sent, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+}
+
+void TCP_Connection::send_recorder_message()
+{
+    OCT_Recorder::Stats stats = m_recorder.stats();
+    const uint64_t values[8] = { stats.recorded, stats.skipped, stats.failed, stats.active, stats.bytesWritten, stats.bytesQueued, stats.peakQueued, stats.writeMicroseconds };
+
+    m_headerMessage.resize(sizeof(values));
+    memcpy(&m_headerMessage[0], values, sizeof(values));
+
+    boost::asio::async_write(m_socket, boost::asio::buffer(m_headerMessage),
+        m_strand.wrap(boost::bind(&TCP_Connection::handle_message_sent, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+}
+
+void TCP_Connection::send_trace_message()
+{
+    std::string trace;
+    OCT_Trace::dump(trace);
+
+    uint32_t length = (uint32_t)trace.size();
+    m_headerMessage.resize(sizeof(uint32_t) + trace.size());
+    memcpy(&m_headerMessage[0], &length, sizeof(uint32_t));
+    memcpy(&m_headerMessage[sizeof(uint32_t)], trace.data(), trace.size());
+
+    boost::asio::async_write(m_socket, boost::asio::buffer(m_headerMessage),
+        m_strand.wrap(boost::bind(&TCP_Connection::handle_message_sent, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+}
+
+void TCP_Connection::send_byte_message(uint32_t value)
+{
+    m_headerMessage.assign(1, (uint8_t)value);
+
+    boost::asio::async_write(m_socket, boost::asio::buffer(m_headerMessage),
+        m_strand.wrap(boost::bind(&TCP_Connection::handle_message_sent, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+}
+
+void TCP_Connection::handle_message_sent(const boost::system::error_code& error, size_t)
+{
+    if (error)
+    {
+        std::cout << "Exception on send. Dropping the connection: " << error.message() << std::endl;
+        return;
+    }
+
+    this->next_request();
+}
+
+void TCP_Connection::begin_chunked_send(const OCT_VolumePtr& volume, size_t chunkCount)
+{
+    m_sendingVolume = volume;
+    m_sendCodec = m_codec;
+    m_startTime = OCT_Trace::now();
+    m_fileSize = 0;
+    m_writing = false;
+    m_sendFailed = false;
+    m_chunksSubmitted = 0;
+    m_chunksWritten = 0;
+    m_chunksExpected = chunkCount;
+
+    //A compressed volume gets its own copy of the header with the codec filled in. The raw one goes out as is
+    m_sendHeader.assign(volume->message.begin(), volume->message.begin() + 512);
+    if (m_sendCodec != OCT_Codec::None)
+    {
+        OCT_HeaderLayout::Codec::write(&m_sendHeader[0], m_sendCodec);
+        OCT_HeaderLayout::Chunks::write(&m_sendHeader[0], volume->params.ycount);
+        OCT_HeaderLayout::ChunkSize::write(&m_sendHeader[0], (uint32_t)volume->params.bscanSize());
+    }
+    m_headerSent = false;
+
+    //Sized before the first chunk is submitted, so encoder threads never see them reallocate
+    m_chunks.assign(volume->params.ycount, boost::asio::const_buffer());
+    m_chunkReady.assign(volume->params.ycount, false);
+    //Only ever grows, so the compressed chunks of earlier volumes lend their capacity to the next ones
+    if (m_sendCodec != OCT_Codec::None && m_encodedChunks.size() < volume->params.ycount)
+    {
+        m_encodedChunks.resize(volume->params.ycount);
+    }
+}
+
+void TCP_Connection::submit_chunk(const uint8_t* chunk, size_t size)
+{
+    size_t index = m_chunksSubmitted++;
+
+    if (m_sendCodec == OCT_Codec::None)
+    {
+        m_strand.dispatch(boost::bind(&TCP_Connection::chunk_ready, shared_from_this(), index, boost::asio::const_buffer(chunk, size)));
+    }
+    else
+    {
+        //Compressed on the worker pool, so encoding keeps up with acquisition no matter how many cores a B-scan takes
+        m_encoder.post(boost::bind(&TCP_Connection::encode_chunk, shared_from_this(), index, chunk, size));
+    }
+}
+
+void TCP_Connection::capture_chunk(const uint8_t* chunk, size_t size)
+{
+    if (m_sendCodec != OCT_Codec::None)
+    {
+        this->submit_chunk(chunk, size);
+        return;
+    }
+
+    //Raw B-scans lie back to back in the volume, so a run of them is all the strand needs to know
+    if (m_pendingChunks.count == 0)
+    {
+        m_pendingChunks.first = m_chunksSubmitted;
+    }
+    m_pendingChunks.count++;
+    m_chunksSubmitted++;
+
+    this->push_chunks(false);
+}
+
+void TCP_Connection::push_chunks(bool wait)
+{
+    while (m_pendingChunks.count > 0)
+    {
+        if (m_chunkRing.push(m_pendingChunks))
+        {
+            m_pendingChunks.count = 0;
+        }
+        else if (wait)
+        {
+            boost::this_thread::yield();
+            continue;
+        }
+        else
+        {
+            //Backpressure: the B-scan waits in the run for the next push instead of holding up the device
+            m_ringFull++;
+        }
+
+        if (!m_drainPosted.exchange(true))
+        {
+            m_strand.post(boost::bind(&TCP_Connection::drain_chunks, shared_from_this()));
+        }
+
+        if (!wait)
+        {
+            return;
+        }
+    }
+}
+
+void TCP_Connection::drain_chunks()
+{
+    //Cleared before popping, so a run pushed from here on gets its own wake up
+    m_drainPosted = false;
+
+    const size_t chunkSize = m_sendingVolume->params.bscanSize();
+    OCT_ChunkRange range;
+    while (m_chunkRing.pop(range))
+    {
+        for (size_t i = range.first; i < range.first + range.count; i++)
+        {
+            m_chunks[i] = boost::asio::const_buffer(&m_sendingVolume->message[512 + i * chunkSize], chunkSize);
+            m_chunkReady[i] = true;
+        }
+    }
+
+    this->write_chunks();
+}
+
+void TCP_Connection::encode_chunk(size_t index, const uint8_t* chunk, size_t size)
+{
+    OCT_Trace::Scope trace("encode", "bscan", index);
+
+    //Each chunk goes on the wire as its compressed size followed by the compressed bytes
+    std::vector<uint8_t>& encoded = m_encodedChunks[index];
+    encoded.resize(sizeof(uint32_t));
+    uint32_t encodedSize = (uint32_t)OCT_Codec::compress(m_sendCodec, chunk, size, encoded);
+    memcpy(&encoded[0], &encodedSize, sizeof(uint32_t));
+
+    m_strand.post(boost::bind(&TCP_Connection::chunk_ready, shared_from_this(), index, boost::asio::const_buffer(&encoded[0], encoded.size())));
+}
+
+void TCP_Connection::chunk_ready(size_t index, boost::asio::const_buffer chunk)
+{
+    //After a failed write the rest of the capture is just let through
+    if (m_sendFailed)
+    {
+        return;
+    }
+
+    m_chunks[index] = chunk;
+    m_chunkReady[index] = true;
+
+    this->write_chunks();
+}
+
+void TCP_Connection::write_chunks()
+{
+    if (m_writing || m_sendFailed)
+    {
+        return;
+    }
+
+    //Takes every chunk that is ready in order, so a writer that fell behind catches up with one gathered write
+    m_writeBuffers.clear();
+    if (!m_headerSent)
+    {
+        m_writeBuffers.push_back(boost::asio::buffer(m_sendHeader));
+        m_headerSent = true;
+    }
+
+    m_chunksInFlight = 0;
+    for (size_t i = m_chunksWritten; i < m_chunks.size() && m_chunkReady[i]; i++)
+    {
+        m_writeBuffers.push_back(m_chunks[i]);
+        m_chunksInFlight++;
+    }
+
+    if (m_writeBuffers.empty())
+    {
+        return;
+    }
+
+    m_writing = true;
+    m_writeStart = OCT_Trace::now();
+    boost::asio::async_write(m_socket, m_writeBuffers,
+        m_strand.wrap(boost::bind(&TCP_Connection::handle_chunks_written, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+}
+
+void TCP_Connection::handle_chunks_written(const boost::system::error_code& error, size_t transferred)
+{
+    m_writing = false;
+    OCT_Trace::record("socket write", m_writeStart, OCT_Trace::now(), "bytes", transferred);
+
+    if (error)
+    {
+        //A capture can't be aborted halfway, so just stop sending. The connection is dropped once nothing refers to it anymore
+        std::cout << "Exception on send. Dropping the connection: " << error.message() << std::endl;
+        m_sendFailed = true;
+
+        //No read may be pending to notice the connection is gone, so the live stream is stopped from here too
+        m_scheduler.post(boost::bind(&TCP_Connection::stop_live, shared_from_this()));
+        return;
+    }
+
+    m_fileSize += transferred;
+    m_chunksWritten += m_chunksInFlight;
+
+    if (m_chunksWritten == m_chunksExpected)
+    {
+        this->finish_send();
+    }
+    else
+    {
+        this->write_chunks();
+    }
+}
+
+void TCP_Connection::capture_done(size_t chunkCount)
+{
+    m_chunksExpected = chunkCount;
+
+    //The last run may still be in the ring
+    this->drain_chunks();
+
+    if (!m_writing && !m_sendFailed && m_chunksWritten == m_chunksExpected)
+    {
+        this->finish_send();
+    }
+}
+
+void TCP_Connection::finish_send()
+{
+    uint64_t end = OCT_Trace::now();
+    OCT_Trace::record("send", m_startTime, end, "bytes", m_fileSize);
+
+    //Live frames only add to the latency figures, reported once a second
+    if (m_sendingLive)
+    {
+        boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+        boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+        uint64_t captureTime = OCT_HeaderLayout::CaptureTime::read(&m_sendingVolume->message[0]);
+        double latency = ((now - epoch).total_microseconds() - (double)captureTime) / 1000.0;
+
+        m_liveSent++;
+        m_liveLatencySum += latency;
+        m_liveLatencyMax = std::max(m_liveLatencyMax, latency);
+
+        if (m_liveReportTime.is_not_a_date_time())
+        {
+            m_liveReportTime = now;
+        }
+        else if (now - m_liveReportTime >= boost::posix_time::seconds(1))
+        {
+            double seconds = (now - m_liveReportTime).total_microseconds() / 1000000.0;
+            std::cout << "B mode: " << m_liveSent / seconds << " frames per second, capture to sent latency " << m_liveLatencySum / m_liveSent << " ms mean, " << m_liveLatencyMax << " ms max, " << m_liveDropped << " frames dropped so far\n";
+            m_liveReportTime = now;
+            m_liveSent = 0;
+            m_liveLatencySum = 0;
+            m_liveLatencyMax = 0;
+        }
+
+        m_sendingLive = false;
+        m_sendingVolume.reset();
+        this->next_request();
+        return;
+    }
+
+    float diff = (end - m_startTime) / 1000000000.0f;
+    const OCT_Buffer& message = m_sendingVolume->message;
+
+    std::cout << "File transfer complete!\n";
+    std::cout << m_fileSize << " bytes on the wire for " << message.size() << " bytes of volume\n\n";
+    std::cout << "Total time: " << diff << " s. Speed: " << (((float)message.size()) / diff) * (1 / 1024.0f) << " KBps " << std::endl;
+
+    m_sendingVolume.reset();
+    m_volume.reset();
+
+    //Only the last level of a progressive volume moves on to the next request
+    if (m_sendingLevels)
+    {
+        this->send_next_level();
+        return;
+    }
 
-    m_volScanMessage.clear();
+    this->next_request();
 }
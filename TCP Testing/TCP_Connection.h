@@ -1,4 +1,4 @@
-#define BOOST_ASIO_ENABLE_HANDLER_TRACKING
+//#define BOOST_ASIO_ENABLE_HANDLER_TRACKING
  
 #ifndef TCP_CONNECTION
 #define TCP_CONNECTION
@@ -7,58 +7,294 @@
 //#include <fstream>
 #include <sstream>
 #include <string>
+#include <deque>
+#include <limits>
  
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
+#include <boost/atomic.hpp>
 #include <boost/bind.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/make_shared.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
  
 #include <SDOCT.h>
+#include <OCT_BufferPool.h>
+#include <OCT_Compression.h>
+#include <OCT_Params.h>
+#include <OCT_Protocol.h>
+#include <OCT_Publisher.h>
+#include <OCT_Pyramid.h>
+#include <OCT_Recorder.h>
+#include <OCT_Scheduler.h>
+#include <OCT_Trace.h>
+#include <OCT_Volume.h>
+#include <OCT_VolumeCache.h>
+#include <OCT_WorkerPool.h>
  
-//This class moderates the transfer of information between the server and the client. It is created by a TCP_Server instance and gets deleted when the connection is droppedy
-class TCP_Connection
+//Run of consecutive B-scans of a streamed volume, handed from the scanner thread to the connection through its chunk ring
+struct OCT_ChunkRange
+{
+    size_t first;
+    size_t count;
+};
+
+//This class moderates the transfer of information between the server and the client. It is created by a TCP_Server instance and gets deleted when the connection is dropped, i.e. when the last handler holding a shared pointer to it is done
+//All of its socket handlers run through m_strand, so they never run concurrently even with several io_service threads. Scanner work is posted to the OCT_Scheduler and hands its results back through m_strand
+class TCP_Connection : public boost::enable_shared_from_this<TCP_Connection>
 {
 private:
     boost::asio::ip::tcp::socket m_socket;
-    SDOCT m_oct;
+    boost::asio::io_service::strand m_strand;
+    OCT_Scheduler& m_scheduler;
+    OCT_Publisher& m_publisher;
+    OCT_WorkerPool& m_encoder;
+    OCT_BufferPool& m_pool;
+    OCT_Recorder& m_recorder;
+    OCT_VolumeCache& m_cache;
+
+    //Scan parameters of the request currently being run, and the voxel window this client last set
+    OCT_Params m_params;
+    OCT_Window m_window;
  
-    boost::asio::streambuf m_readBuffer;
+    //Reusable buffer holding the bytes received but not parsed yet. It only grows if a frame doesn't fit
+    std::vector<char> m_readBuffer;
+    size_t m_readBytes;
+    bool m_readPaused;
+
+    //Requests parsed from the socket that haven't been run yet, and whether one is running right now
+    std::deque<OCT_Request> m_requests;
+    bool m_busy;
+
     std::string m_sendBuffer;
-    boost::array<char, 4096> m_sendFillBuffer;
-    std::vector<uint8_t> m_volScanMessage;
+
+    //Volume being captured for this client's request, volume being written to the socket and header replying to a 'Q'
+    boost::shared_ptr<OCT_Volume> m_volume;
+    OCT_VolumePtr m_sendingVolume;
+    OCT_Buffer m_headerMessage;
+
+    //Volumes published by other clients' scans waiting to be sent to this subscriber, and how many were dropped because it fell behind
+    std::deque<OCT_VolumePtr> m_publishedVolumes;
+    uint32_t m_droppedVolumes;
+
+    //Volumes of the running 'N' captured but not sent yet, how many of its volumes are still to be sent, and whether the strand is waiting for the scanner to hand over the next one
+    //m_batchBytes counts the bytes of the volumes captured but not sent yet on the scanner thread, and m_batchRest holds the scans it left for later because there were too many, until the strand has sent enough of them to post the rest again
+    std::deque<OCT_VolumePtr> m_batchVolumes;
+    size_t m_batchRemaining;
+    bool m_batchWaiting;
+    boost::atomic<size_t> m_batchBytes;
+    std::vector<OCT_Params> m_batchRest;
  
     uint32_t m_fileSize;
  
-    int m_startTime;
-    int m_endTime;
+    //OCT_Trace::now() when the volume being sent started going out, and when the write in progress was started
+    uint64_t m_startTime;
+    uint64_t m_writeStart;
+
+    //Levels of the progressive volume still to be sent, coarsest first, whether one is being sent at all and whether the client cancelled the rest of them with an 'X'
+    //m_progressive holds from the moment an 'R' starts running until its last level is sent, so an 'X' that comes while it is still being acquired is kept for when its levels are ready
+    std::deque<OCT_VolumePtr> m_levels;
+    OCT_Pyramid m_pyramid;
+    bool m_progressive;
+    bool m_sendingLevels;
+    bool m_cancelLevels;
+
+    //Live B mode stream started with a 'B'. Its params, window, timer and frame ring only get touched on the scanner thread, where the frames are captured in between the other clients' jobs
+    bool m_liveActive;
+    OCT_Params m_liveParams;
+    OCT_Window m_liveWindow;
+    boost::posix_time::time_duration m_liveInterval;
+    boost::posix_time::ptime m_liveNext;
+    boost::asio::deadline_timer m_liveTimer;
+    std::vector<boost::shared_ptr<OCT_Volume> > m_liveRing;
+    uint32_t m_liveFrameNumber;
+
+    //Strand side of the live stream: the newest frame waiting to be sent, the frames dropped for a newer one and the latency of the frames sent since the last report
+    boost::shared_ptr<OCT_Volume> m_liveFrame;
+    uint32_t m_liveDropped;
+    int m_defaultSendBuffer;
+    bool m_sendingLive;
+    uint32_t m_liveSent;
+    double m_liveLatencySum;
+    double m_liveLatencyMax;
+    boost::posix_time::ptime m_liveReportTime;
+
+    //Codec negotiated by this client with a 'Z' request, voxel format chosen with an 'F' and B-scans averaged per position with a 'Y'
+    uint32_t m_codec;
+    uint32_t m_format;
+    uint32_t m_averaging;
+
+    //Chunked transfer of the volume being sent, shared by 'P' replies, published volumes and 'S' streams. Every B-scan is one chunk, and chunks always go out in order, whether they are raw slices of the volume or compressed on the worker pool
+    uint32_t m_sendCodec;
+    std::vector<uint8_t> m_sendHeader;
+    bool m_headerSent;
+    std::vector<boost::asio::const_buffer> m_chunks;
+    std::vector<bool> m_chunkReady;
+    std::vector<std::vector<uint8_t> > m_encodedChunks;
+    size_t m_chunksSubmitted;
+    size_t m_chunksWritten;
+    size_t m_chunksInFlight;
+    size_t m_chunksExpected;
+    std::vector<boost::asio::const_buffer> m_writeBuffers;
+    bool m_writing;
+    bool m_sendFailed;
+
+    //Lock-free hand-off of the raw B-scans of an 'S' from the scanner thread, the only producer, to the strand, the only consumer. Acquisition never waits on the strand: when the ring is full the B-scans pile up in m_pendingChunks and go in as one run once there is room again
+    //m_drainPosted is set while a drain_chunks is on its way, so the strand gets woken once per batch rather than once per B-scan
+    boost::lockfree::spsc_queue<OCT_ChunkRange, boost::lockfree::capacity<OCT_Protocol::ChunkRingSize> > m_chunkRing;
+    boost::atomic<bool> m_drainPosted;
+    OCT_ChunkRange m_pendingChunks;
+    uint32_t m_ringFull;
  
     //int m_rollingSum;
  
 public:
  
-    //Constructor receives an io_service instance and an SDOCT instance
-    TCP_Connection(boost::asio::io_service& io_service, SDOCT& m_oct);
+    //Constructor receives an io_service instance, the scheduler guarding the shared SDOCT instance, the publisher fanning volumes out to subscribers, the worker pool compressing B-scans and the pool the volumes come from
+    TCP_Connection(boost::asio::io_service& io_service, OCT_Scheduler& scheduler, OCT_Publisher& publisher, OCT_WorkerPool& encoder, OCT_BufferPool& pool, OCT_Recorder& recorder, OCT_VolumeCache& cache);
      
     //Returns it's own socket object. Inside the class we just access the member variable directly for shorter syntax
     boost::asio::ip::tcp::socket& socket();
  
-    //Server begins listening for messages on the socket
+    //Server begins listening for messages on the socket. Returns immediately, the connection keeps reading for as long as the client is connected
     void start();
+
+    //Called by the OCT_Publisher from the scanner thread. Queues the volume on the strand and returns immediately
+    void deliver_volume(const OCT_VolumePtr&);
+
+private:
+    //Runs on the strand. Queues a published volume, dropping the oldest waiting one if this subscriber is too far behind
+    void enqueue_volume(OCT_VolumePtr);
+
+    //Reads whatever the client has sent so far into the free end of m_readBuffer
+    void read_frames();
+
+    //Completion handler of read_frames. Parses every complete frame and keeps reading
+    void handle_read(const boost::system::error_code&, size_t);
+
+    //Cuts the complete frames out of m_readBuffer and moves any partial frame to its front
+    bool parse_frames();
      
-    //Interprets the read data and calls the intended functions
-    void parse_data(const char*);
+    //Interprets the payload of one frame and queues the intended request
+    bool parse_data(const char*, size_t);
  
-    //Parses the message containing the new oct parameters sent from the client and sets them in the oct
-    void set_oct_params(const char*);
+    //Parses the message containing the new oct parameters sent from the client and logs them
+    void set_oct_params(const char*, size_t, OCT_Params&);
+
+    //Parses the message containing the new voxel window sent from the client
+    void set_oct_window(const char*, OCT_Window&);
+
+    //Closes the socket, which makes every pending handler fail and so drops the connection. Runs on the strand
+    void close();
+
+    //Runs the next queued request, if there is one and none is running. Every request calls it again once its reply is sent
+    void next_request();
  
-    //Clears and prepares a vector to hold 512 bytes of header according to the specifications of the .img files produced by the GUI software, with the intent on using the same pipelines. Only the necessary parameters are filled, the rest is populated with NULLs
-    void prepare_header(std::vector<uint8_t>&);
+    //Clears and prepares a vector to hold 512 bytes of header for a volume captured with the params, according to the specifications of the .img files produced by the GUI software, with the intent on using the same pipelines. Only the necessary parameters are filled, the rest is populated with NULLs
+    void prepare_header(OCT_Buffer&, const OCT_Params&);
+
+    //Scanner job: applies m_params to the oct and captures a volume into m_volume. For 'P' the message gets sent once complete, for 'S' every B-scan is streamed as soon as it is processed and for 'R' the levels get built along the way. Either way the finished volume is published to the subscribers
+    void capture_volScan(char command);
+
+    //Scanner job: captures every scan of an 'N' back to back with this client's voxel window, handing each volume to the strand as soon as it is complete
+    //Stops once more than MaxBatchAhead bytes wait to be sent and hands the scans left to batch_paused
+    void capture_batch(std::vector<OCT_Params> batch);
+
+    //Captures one complete volume with the params on the scanner thread, recording, caching and publishing it like a 'P'
+    OCT_VolumePtr capture_volume(SDOCT& oct, OCT_Params params);
+
+    //Runs on the strand. Queues a volume of the running 'N' and sends it if the strand was waiting for it
+    void batch_volume_ready(OCT_VolumePtr);
+
+    //Runs on the strand. Keeps the scans of an 'N' the scanner left for later, and posts them again right away if the client has caught up meanwhile
+    void batch_paused(std::vector<OCT_Params> rest);
+
+    //Runs on the strand. Posts the scans left of an 'N' to the scanner again once few enough bytes of it wait to be sent
+    void resume_batch();
+
+    //Scanner job: starts the live stream or changes its params and rate. rate is in frames per second
+    void start_live(OCT_Params, OCT_Window, float rate);
+
+    //Scanner job: stops the live stream. Frames already captured still get sent
+    void stop_live();
+
+    //Scanner job: captures the next frame of the live stream into a free buffer of the ring, hands it to the strand and sets the timer for the one after
+    void capture_frame();
+
+    //Completion handler of m_liveTimer, on the scanner thread
+    void handle_live_timer(const boost::system::error_code&);
+
+    //Runs on the strand. Makes the frame the one to be sent next, dropping the one that was still waiting
+    void frame_ready(boost::shared_ptr<OCT_Volume>);
+
+    //Sends the levels of a progressive volume one after the other, as the reply to an 'R'
+    void send_levels(std::vector<OCT_VolumePtr>);
+
+    //Sends the next level, or the empty level 0 ending a cancelled reply. Runs the next request once there is none left
+    void send_next_level();
  
-    //Sends voxel data + header to the client. Gets recursively called writing several packets
-    void TCP_Connection::send_volScan_message();       
+    //Sends voxel data + header to the client, B-scan by B-scan straight out of the volume
+    void send_volScan_message(OCT_VolumePtr);       
+
+    //Sends the cached volume a 'G' or 'V' asks for, or a header with steps of 0 if it isn't cached anymore. Doesn't touch the scanner
+    void send_cached_volume(const OCT_Request&);
+
+    //Sends the header and the bytes of the volume from offset on, as the reply to a 'V'
+    void send_volume_tail(OCT_VolumePtr volume, uint64_t offset);
+
+    //Sends only the 512 byte header built from this client's params, as the reply to a 'Q' query. Doesn't touch the scanner
+    void send_params_message();
+
+    //Sends a single byte, the codec, format or averaging agreed on, as the reply to a 'Z', an 'F' or a 'Y'
+    void send_byte_message(uint32_t value);
+
+    //Sends the buffer pool statistics as 6 uint64, as the reply to an 'M'
+    void send_pool_message();
+
+    //Sends the recorder statistics as 8 uint64, as the reply to a 'D'
+    void send_recorder_message();
+
+    //Sends the trace ring as Chrome trace JSON behind its 4 byte length, as the reply to a 'T'
+    void send_trace_message();
+
+    //Completion handler of a write after which the next request can be run
+    void handle_message_sent(const boost::system::error_code&, size_t);
+
+    //Resets the chunked transfer for the volume. chunkCount is the number of B-scans that will be submitted, or the max size_t while a streamed capture doesn't know yet
+    void begin_chunked_send(const OCT_VolumePtr&, size_t chunkCount);
+
+    //Hands the next B-scan of the volume over. Called on the strand for complete volumes and by captureVolScan on the scanner thread for 'S'. Returns immediately
+    void submit_chunk(const uint8_t*, size_t);
+
+    //Called by captureVolScan on the scanner thread for every B-scan of an 'S'. Raw B-scans go through m_chunkRing, compressed ones to submit_chunk
+    void capture_chunk(const uint8_t*, size_t);
+
+    //Pushes m_pendingChunks into the ring if there is room, and wakes the strand up unless it is already on its way. With wait set it keeps trying until the run is in, for the end of the capture. Scanner thread only
+    void push_chunks(bool wait);
+
+    //Runs on the strand. Takes every run out of the ring, marks its B-scans ready and writes them
+    void drain_chunks();
+
+    //Worker pool job compressing one B-scan
+    void encode_chunk(size_t index, const uint8_t*, size_t);
+
+    //Runs on the strand. Marks a chunk as ready and starts writing if no write is in progress
+    void chunk_ready(size_t index, boost::asio::const_buffer);
+
+    //Writes the header, if it hasn't gone out yet, and every chunk that is ready in order with one gathered write
+    void write_chunks();
+
+    //Completion handler of write_chunks
+    void handle_chunks_written(const boost::system::error_code&, size_t);
+
+    //Posted to the strand once captureVolScan has returned in streaming mode, with the number of B-scans it produced
+    void capture_done(size_t chunkCount);
+
+    //Reports the transfer once every chunk is written, then runs the next request
+    void finish_send();
 };
  
 #endif
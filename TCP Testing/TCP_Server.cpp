@@ -1,6 +1,6 @@
 #include <TCP_Server.h>
  
-TCP_Server::TCP_Server(boost::asio::io_service& service, SDOCT& oct) : m_acceptor(service, tcp::endpoint(tcp::v4(), 12345)), m_oct(oct)
+TCP_Server::TCP_Server(boost::asio::io_service& service, OCT_Scheduler& scheduler, OCT_Publisher& publisher, OCT_WorkerPool& encoder, OCT_BufferPool& pool, OCT_Recorder& recorder, OCT_VolumeCache& cache, unsigned short port) : m_service(service), m_acceptor(service, tcp::endpoint(tcp::v4(), port)), m_scheduler(scheduler), m_publisher(publisher), m_encoder(encoder), m_pool(pool), m_recorder(recorder), m_cache(cache)
 {
     std::cout << "Constructor called\n";
     boost::asio::ip::tcp::no_delay opt_nodelay(true);
@@ -12,24 +12,25 @@ TCP_Server::TCP_Server(boost::asio::io_service& service, SDOCT& oct) : m_accepto
   
 void TCP_Server::do_accept()
 {
-    try
-    {
-        std::cout << "do_accept called\n";
-        TCP_Connection* new_connection = new TCP_Connection(m_acceptor.get_io_service(), this->m_oct);
- 
-        std::cout << "Waiting for connections" << std::endl;
-        m_acceptor.accept(new_connection->socket());
+    std::cout << "do_accept called\n";
+    boost::shared_ptr<TCP_Connection> new_connection = boost::make_shared<TCP_Connection>(boost::ref(m_service), boost::ref(m_scheduler), boost::ref(m_publisher), boost::ref(m_encoder), boost::ref(m_pool), boost::ref(m_recorder), boost::ref(m_cache));
  
+    std::cout << "Waiting for connections" << std::endl;
+    m_acceptor.async_accept(new_connection->socket(), boost::bind(&TCP_Server::handle_accept, this, new_connection, boost::asio::placeholders::error));
+}
+
+void TCP_Server::handle_accept(boost::shared_ptr<TCP_Connection> new_connection, const boost::system::error_code& error)
+{
+    if (!error)
+    {
         std::cout << "New client connected" << std::endl;
+
+        //The connection keeps itself alive through the handlers it posts, and gets deleted when the client drops
         new_connection->start();
- 
-        delete new_connection;
-        std::cout << "do_accept ended\n";
-         
     }
-    catch (...)
+    else
     {
-        std::cout << "Exception in do accept. Dropping connection and waiting for the next one\n";
+        std::cout << "Exception in accept: " << error.message() << ". Waiting for the next connection\n";
     }
  
     do_accept();
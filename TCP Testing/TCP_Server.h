@@ -12,23 +12,38 @@
 #include <boost/shared_ptr.hpp>
  
 #include <SDOCT.h>
+#include <OCT_Publisher.h>
+#include <OCT_Scheduler.h>
+#include <OCT_WorkerPool.h>
+#include <OCT_BufferPool.h>
+#include <OCT_Recorder.h>
+#include <OCT_VolumeCache.h>
 #include <TCP_Connection.h>
  
-//This class handles accepting and creating TCP_Connections between the server and potential clients
+//This class handles accepting and creating TCP_Connections between the server and potential clients. Any number of clients can be connected at once, each one served by whichever io_service thread is free
 class TCP_Server
 {
 private:
     typedef boost::asio::ip::tcp tcp;
+    boost::asio::io_service& m_service;
     tcp::acceptor m_acceptor;
-    SDOCT &m_oct;
+    OCT_Scheduler &m_scheduler;
+    OCT_Publisher &m_publisher;
+    OCT_WorkerPool &m_encoder;
+    OCT_BufferPool &m_pool;
+    OCT_Recorder &m_recorder;
+    OCT_VolumeCache &m_cache;
  
 public:
     //Constructs the acceptor and sockets with the proper input from the class constructor. Should only deal with IPv4 at the specific port
-    TCP_Server(boost::asio::io_service& service, SDOCT& oct);
+    TCP_Server(boost::asio::io_service& service, OCT_Scheduler& scheduler, OCT_Publisher& publisher, OCT_WorkerPool& encoder, OCT_BufferPool& pool, OCT_Recorder& recorder, OCT_VolumeCache& cache, unsigned short port);
  
 private:
-    //This function runs recursively. They wait and accept an incomming connection, create a shared pointer to that created socket, then create and start a TCP_Connection instance. When and if the client drops, do_accept() is called again and the servers just waits for the next connection
+    //Creates the TCP_Connection for the next client and waits for it asynchronously. Returns immediately
     void do_accept();
+
+    //Starts the accepted connection and goes straight back to accepting the next one
+    void handle_accept(boost::shared_ptr<TCP_Connection> new_connection, const boost::system::error_code& error);
 };
  
 #endif
@@ -4,7 +4,18 @@
 #include "boost/asio.hpp"
 #include <boost/asio.hpp>
  
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/thread.hpp>
+
 #include <SDOCT.h>
+#include <OCT_BufferPool.h>
+#include <OCT_Protocol.h>
+#include <OCT_Publisher.h>
+#include <OCT_Recorder.h>
+#include <OCT_Scheduler.h>
+#include <OCT_Trace.h>
+#include <OCT_VolumeCache.h>
+#include <OCT_WorkerPool.h>
 #include <TCP_Server.h>
  
 #include <iostream>
@@ -12,18 +23,83 @@
 #include <sstream>
 #include <string>
  
-int main()
+//Body of each thread of the pool serving the clients
+void WorkerThread(boost::asio::io_service* service)
+{
+  OCT_Trace::nameThread("io");
+  service->run();
+}
+
+int main(int argc, char* argv[])
 {
   try
   {
+      //Number of io_service threads serving the clients. Can be passed as the first argument, defaults to one per core
+      unsigned int numThreads = boost::thread::hardware_concurrency();
+      if (argc > 1)
+      {
+          numThreads = boost::lexical_cast<unsigned int>(argv[1]);
+      }
+      if (numThreads == 0)
+      {
+          numThreads = 1;
+      }
+
+      //Seconds the device stays open after the last request. Can be passed as the second argument, 0 opens and closes it around every request
+      int idleTimeout = 60;
+      if (argc > 2)
+      {
+          idleTimeout = boost::lexical_cast<int>(argv[2]);
+      }
+
+      //Timeline tracing of every scan, dumped with a 'T' request. On unless the third argument is 0
+      if (argc > 3)
+      {
+          OCT_Trace::setEnabled(boost::lexical_cast<int>(argv[3]) != 0);
+      }
+
+      //Directory every captured volume is recorded into as an .img file. Recording is off unless it is passed as the fourth argument
+      std::string recordDirectory;
+      if (argc > 4)
+      {
+          recordDirectory = argv[4];
+      }
+
+      //Megabytes the volume cache may hold for 'G' requests. Can be passed as the fifth argument, 0 turns the cache off
+      size_t cacheBudget = OCT_Protocol::CacheBudget;
+      if (argc > 5)
+      {
+          cacheBudget = boost::lexical_cast<size_t>(argv[5]) * 1024 * 1024;
+      }
+
       boost::asio::io_service service;
       SDOCT oct;
+      OCT_Publisher publisher;
+
+      //Volumes and pyramid levels are taken from here and come back once sent, so scanning doesn't allocate. The cached volumes count towards its budget
+      OCT_BufferPool pool(OCT_Protocol::PooledBuffersPerClass, cacheBudget + OCT_Protocol::PoolBudget);
+
+      //Compresses B-scans for the clients that negotiated a codec, on every core
+      OCT_WorkerPool encoder(std::max(1u, boost::thread::hardware_concurrency()));
+
+      OCT_Scheduler scheduler(oct, idleTimeout);
+
+      //Writes the volumes to disk on a thread of its own while they are captured and sent
+      OCT_Recorder recorder(recordDirectory);
 
-      TCP_Server server(service, oct);
+      //The last volumes captured, so they can be sent again without rescanning
+      OCT_VolumeCache cache(OCT_Protocol::CachedVolumes, cacheBudget);
 
-      service.run();
+      TCP_Server server(service, scheduler, publisher, encoder, pool, recorder, cache, OCT_Protocol::Port);
 
+      std::cout << "Serving clients on " << numThreads << " threads\n";
+      boost::thread_group workerThreads;
+      for (unsigned int i = 0; i < numThreads; i++)
+      {
+          workerThreads.create_thread(boost::bind(&WorkerThread, &service));
+      }
 
+      workerThreads.join_all();
   }
   catch (...)
   {